@@ -0,0 +1,845 @@
+/*
+ *	Wireless Tools
+ *
+ * Apache Arrow IPC output for the scanning tools...
+ *
+ * We don't want to depend on the Arrow or FlatBuffers libraries, so the
+ * few metadata tables we need are built by hand. The builder below
+ * writes FlatBuffers front to back : a table is written with
+ * placeholders for its offsets, then its children are written after
+ * it and the offsets patched (FlatBuffers offsets must point forward,
+ * vtable offsets may point anywhere).
+ * All FlatBuffers scalars are little endian, whatever the host. The
+ * body (column data) is in host order, which the schema advertises.
+ *
+ * References : Arrow columnar format and IPC specification,
+ * format/Schema.fbs and format/Message.fbs in the Arrow sources.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iwarrow.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Rows allocated at once */
+#define IW_ARROW_ROWS_STEP	256
+
+/* MetadataVersion */
+#define IW_ARROW_V5		4
+/* MessageHeader union */
+#define IW_ARROW_MSG_SCHEMA	1
+#define IW_ARROW_MSG_DICTIONARY	2
+#define IW_ARROW_MSG_RECORD	3
+/* Type union */
+#define IW_ARROW_TYPE_INT	2
+#define IW_ARROW_TYPE_UTF8	5
+#define IW_ARROW_TYPE_TIMESTAMP	10
+/* TimeUnit */
+#define IW_ARROW_MILLISECOND	1
+/* Endianness */
+#define IW_ARROW_LITTLE		0
+#define IW_ARROW_BIG		1
+
+/* IPC framing */
+#define IW_ARROW_CONTINUATION	0xFFFFFFFF
+/* Body buffers alignment */
+#define IW_ARROW_ALIGN		8
+
+/* Dictionary id of the ESSID column */
+#define IW_ARROW_ESSID_DICT	0
+
+/****************************** TYPES ******************************/
+
+/* Description of a column, for the schema */
+struct iw_arrow_col
+{
+  const char *	name;
+  int		type;		/* IW_ARROW_TYPE_XXX */
+  int		bits;		/* Int width */
+  int		is_signed;	/* Int sign */
+  int		size;		/* Bytes per value in the body */
+};
+
+/* Table being built */
+struct iw_fb_table
+{
+  size_t	vtable;		/* Position of the vtable */
+  size_t	start;		/* Position of the table */
+  int		nslots;
+};
+
+/**************************** VARIABLES ****************************/
+
+/* Must match IW_ARROW_COL_XXX */
+static const struct iw_arrow_col	iw_arrow_cols[IW_ARROW_NUM_COLS] = {
+  { "time",		IW_ARROW_TYPE_TIMESTAMP, 64, 1, 8 },
+  { "bssid",		IW_ARROW_TYPE_INT, 64, 0, 8 },
+  { "essid",		IW_ARROW_TYPE_UTF8, 32, 1, 4 },	/* Indices */
+  { "freq_mhz",		IW_ARROW_TYPE_INT, 16, 0, 2 },
+  { "channel",		IW_ARROW_TYPE_INT, 8, 0, 1 },
+  { "mode",		IW_ARROW_TYPE_INT, 8, 0, 1 },
+  { "signal_dbm",	IW_ARROW_TYPE_INT, 16, 1, 2 },
+  { "noise_dbm",	IW_ARROW_TYPE_INT, 16, 1, 2 },
+  { "quality",		IW_ARROW_TYPE_INT, 8, 0, 1 },
+};
+
+/************************** BUFFER HELPERS **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for n more bytes.
+ */
+static int
+iw_abuf_reserve(iw_arrow_buf *	b,
+		size_t		n)
+{
+  unsigned char *	newdata;
+  size_t		newmax;
+
+  if(b->len + n <= b->max)
+    return(0);
+  if(b->error)
+    return(-1);
+
+  newmax = b->max ? b->max : 1024;
+  while(newmax < b->len + n)
+    newmax *= 2;
+  newdata = realloc(b->data, newmax);
+  if(newdata == NULL)
+    {
+      b->error = 1;
+      return(-1);
+    }
+  b->data = newdata;
+  b->max = newmax;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append bytes (or zeros if data is NULL), return where they went.
+ * On allocation failure, the error is remembered and checked at the
+ * end, this avoids checking every single write.
+ */
+static size_t
+iw_abuf_put(iw_arrow_buf *	b,
+	    const void *	data,
+	    size_t		n)
+{
+  size_t	pos = b->len;
+
+  if((n == 0) || (iw_abuf_reserve(b, n) < 0))
+    return(pos);
+  if(data != NULL)
+    memcpy(b->data + b->len, data, n);
+  else
+    memset(b->data + b->len, 0, n);
+  b->len += n;
+  return(pos);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Pad with zeros up to the alignment.
+ */
+static void
+iw_abuf_align(iw_arrow_buf *	b,
+	      size_t		align)
+{
+  if(b->len % align)
+    iw_abuf_put(b, NULL, align - (b->len % align));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Write a little endian scalar at a given position.
+ */
+static void
+iw_abuf_set_le(iw_arrow_buf *	b,
+	       size_t		pos,
+	       uint64_t		value,
+	       int		size)
+{
+  int		i;
+
+  if(b->error)
+    return;
+  for(i = 0; i < size; i++)
+    b->data[pos + i] = (value >> (8 * i)) & 0xFF;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a little endian scalar, naturally aligned.
+ */
+static size_t
+iw_abuf_put_le(iw_arrow_buf *	b,
+	       uint64_t		value,
+	       int		size)
+{
+  size_t	pos;
+
+  iw_abuf_align(b, size);
+  pos = iw_abuf_put(b, NULL, size);
+  iw_abuf_set_le(b, pos, value, size);
+  return(pos);
+}
+
+/*********************** FLATBUFFERS BUILDER ***********************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Start a table with nslots fields : vtable, then the table itself.
+ */
+static void
+iw_fb_start(iw_arrow_buf *		b,
+	    struct iw_fb_table *	t,
+	    int				nslots)
+{
+  iw_abuf_align(b, 2);
+  t->nslots = nslots;
+  t->vtable = iw_abuf_put(b, NULL, 4 + 2 * nslots);
+  iw_abuf_align(b, 4);
+  t->start = b->len;
+  /* soffset to the vtable : vtable = table - soffset */
+  iw_abuf_put_le(b, t->start - t->vtable, 4);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add a scalar field.
+ */
+static void
+iw_fb_scalar(iw_arrow_buf *		b,
+	     struct iw_fb_table *	t,
+	     int			slot,
+	     uint64_t			value,
+	     int			size)
+{
+  size_t	pos = iw_abuf_put_le(b, value, size);
+
+  iw_abuf_set_le(b, t->vtable + 4 + 2 * slot, pos - t->start, 2);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add an offset field, to be patched with iw_fb_patch() once the
+ * child has been written. Return the position to patch.
+ */
+static size_t
+iw_fb_offset(iw_arrow_buf *		b,
+	     struct iw_fb_table *	t,
+	     int			slot)
+{
+  size_t	pos = iw_abuf_put_le(b, 0, 4);
+
+  iw_abuf_set_le(b, t->vtable + 4 + 2 * slot, pos - t->start, 2);
+  return(pos);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Done with the inline part of the table, children come next.
+ */
+static void
+iw_fb_end(iw_arrow_buf *	b,
+	  struct iw_fb_table *	t)
+{
+  iw_abuf_set_le(b, t->vtable, 4 + 2 * t->nslots, 2);
+  iw_abuf_set_le(b, t->vtable + 2, b->len - t->start, 2);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Point the offset at position at to the object at target.
+ */
+static void
+iw_fb_patch(iw_arrow_buf *	b,
+	    size_t		at,
+	    size_t		target)
+{
+  iw_abuf_set_le(b, at, target - at, 4);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Start a vector of count elements, the elements follow.
+ * Return the position of the vector.
+ */
+static size_t
+iw_fb_vector(iw_arrow_buf *	b,
+	     int		count,
+	     size_t		align)
+{
+  /* The length is 4 aligned, the elements must be aligned as well */
+  while((b->len % 4) || ((b->len + 4) % align))
+    iw_abuf_put(b, NULL, 1);
+  return(iw_abuf_put_le(b, count, 4));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Write a string. Return its position.
+ */
+static size_t
+iw_fb_string(iw_arrow_buf *	b,
+	     const char *	str)
+{
+  size_t	pos = iw_fb_vector(b, strlen(str), 4);
+
+  iw_abuf_put(b, str, strlen(str) + 1);
+  return(pos);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Write an Int type table. Return its position.
+ */
+static size_t
+iw_fb_int_type(iw_arrow_buf *	b,
+	       int		bits,
+	       int		is_signed)
+{
+  struct iw_fb_table	t;
+
+  iw_fb_start(b, &t, 2);
+  iw_fb_scalar(b, &t, 0, bits, 4);		/* bitWidth */
+  iw_fb_scalar(b, &t, 1, is_signed, 1);		/* is_signed */
+  iw_fb_end(b, &t);
+  return(t.start);
+}
+
+/************************* MESSAGE BUILDERS *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Write a Field table and its children. Return its position.
+ */
+static size_t
+iw_arrow_field(iw_arrow_buf *			b,
+	       const struct iw_arrow_col *	col,
+	       int				nullable)
+{
+  struct iw_fb_table	t;
+  size_t		name;
+  size_t		type;
+  size_t		dict = 0;
+  size_t		children;
+  size_t		pos;
+
+  iw_fb_start(b, &t, 6);
+  name = iw_fb_offset(b, &t, 0);
+  iw_fb_scalar(b, &t, 1, nullable, 1);
+  iw_fb_scalar(b, &t, 2, col->type, 1);		/* type_type */
+  type = iw_fb_offset(b, &t, 3);
+  if(col->type == IW_ARROW_TYPE_UTF8)
+    dict = iw_fb_offset(b, &t, 4);
+  children = iw_fb_offset(b, &t, 5);
+  iw_fb_end(b, &t);
+
+  iw_fb_patch(b, name, iw_fb_string(b, col->name));
+
+  /* Type */
+  switch(col->type)
+    {
+    case IW_ARROW_TYPE_TIMESTAMP:
+      {
+	struct iw_fb_table	ts;
+	size_t			tz;
+
+	iw_fb_start(b, &ts, 2);
+	iw_fb_scalar(b, &ts, 0, IW_ARROW_MILLISECOND, 2);
+	tz = iw_fb_offset(b, &ts, 1);
+	iw_fb_end(b, &ts);
+	iw_fb_patch(b, tz, iw_fb_string(b, "UTC"));
+	pos = ts.start;
+      }
+      break;
+    case IW_ARROW_TYPE_UTF8:
+      {
+	/* Empty table */
+	struct iw_fb_table	utf8;
+
+	iw_fb_start(b, &utf8, 0);
+	iw_fb_end(b, &utf8);
+	pos = utf8.start;
+      }
+      break;
+    default:
+      pos = iw_fb_int_type(b, col->bits, col->is_signed);
+    }
+  iw_fb_patch(b, type, pos);
+
+  /* Dictionary encoding, the indices are described by the Int */
+  if(dict)
+    {
+      struct iw_fb_table	enc;
+      size_t			index;
+
+      iw_fb_start(b, &enc, 2);
+      iw_fb_scalar(b, &enc, 0, IW_ARROW_ESSID_DICT, 8);	/* id */
+      index = iw_fb_offset(b, &enc, 1);
+      iw_fb_end(b, &enc);
+      iw_fb_patch(b, dict, enc.start);
+      iw_fb_patch(b, index, iw_fb_int_type(b, col->bits, col->is_signed));
+    }
+
+  /* Readers insist on having children, even none */
+  iw_fb_patch(b, children, iw_fb_vector(b, 0, 4));
+
+  return(t.start);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Start a Message, return where to patch the header.
+ */
+static size_t
+iw_arrow_message(iw_arrow_buf *	b,
+		 int		type,
+		 int64_t	body_len)
+{
+  struct iw_fb_table	t;
+  size_t		root;
+  size_t		header;
+
+  b->len = 0;
+  b->error = 0;
+  root = iw_abuf_put_le(b, 0, 4);
+
+  iw_fb_start(b, &t, 4);
+  iw_fb_scalar(b, &t, 0, IW_ARROW_V5, 2);		/* version */
+  iw_fb_scalar(b, &t, 1, type, 1);			/* header_type */
+  header = iw_fb_offset(b, &t, 2);
+  iw_fb_scalar(b, &t, 3, body_len, 8);			/* bodyLength */
+  iw_fb_end(b, &t);
+
+  iw_fb_patch(b, root, t.start);
+  return(header);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Write a RecordBatch table describing the body. nodes and buffers
+ * are pairs of (length, null_count) and (offset, length).
+ * Return its position.
+ */
+static size_t
+iw_arrow_record(iw_arrow_buf *	b,
+		int64_t		length,
+		const int64_t *	nodes,
+		int		num_nodes,
+		const int64_t *	buffers,
+		int		num_buffers)
+{
+  struct iw_fb_table	t;
+  size_t		pnodes;
+  size_t		pbuffers;
+  int			i;
+
+  iw_fb_start(b, &t, 3);
+  iw_fb_scalar(b, &t, 0, length, 8);
+  pnodes = iw_fb_offset(b, &t, 1);
+  pbuffers = iw_fb_offset(b, &t, 2);
+  iw_fb_end(b, &t);
+
+  /* Vectors of structs, 16 bytes each, 8 aligned */
+  iw_fb_patch(b, pnodes, iw_fb_vector(b, num_nodes, 8));
+  for(i = 0; i < 2 * num_nodes; i++)
+    iw_abuf_put_le(b, nodes[i], 8);
+  iw_fb_patch(b, pbuffers, iw_fb_vector(b, num_buffers, 8));
+  for(i = 0; i < 2 * num_buffers; i++)
+    iw_abuf_put_le(b, buffers[i], 8);
+
+  return(t.start);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Frame the metadata in meta and the body in body, append to out.
+ */
+static int
+iw_arrow_frame(iw_arrow *	arrow,
+	       iw_arrow_buf *	out)
+{
+  /* Metadata is padded so that the body starts 8 aligned */
+  iw_abuf_align(&arrow->meta, 8);
+  if(arrow->meta.error || arrow->body.error)
+    return(-1);
+
+  iw_abuf_align(out, 8);
+  iw_abuf_put_le(out, IW_ARROW_CONTINUATION, 4);
+  iw_abuf_put_le(out, arrow->meta.len, 4);
+  iw_abuf_put(out, arrow->meta.data, arrow->meta.len);
+  iw_abuf_put(out, arrow->body.data, arrow->body.len);
+  return(out->error ? -1 : 0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add a buffer to the body, remember its (offset, length).
+ */
+static void
+iw_arrow_body(iw_arrow_buf *	body,
+	      const void *	data,
+	      size_t		len,
+	      int64_t *		desc)
+{
+  iw_abuf_align(body, IW_ARROW_ALIGN);
+  desc[0] = body->len;
+  desc[1] = len;
+  iw_abuf_put(body, data, len);
+}
+
+/************************ ARROW INTERFACE ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Create an empty batch.
+ */
+iw_arrow *
+iw_arrow_new(void)
+{
+  iw_arrow *	arrow = calloc(1, sizeof(iw_arrow));
+
+  if(arrow == NULL)
+    fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+  return(arrow);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append the schema message to out. It must be written once, at the
+ * start of the stream.
+ */
+int
+iw_arrow_schema(iw_arrow *	arrow,
+		iw_arrow_buf *	out)
+{
+  iw_arrow_buf *	b = &arrow->meta;
+  struct iw_fb_table	t;
+  size_t		header;
+  size_t		fields;
+  size_t		vec;
+  int			i;
+
+  header = iw_arrow_message(b, IW_ARROW_MSG_SCHEMA, 0);
+
+  iw_fb_start(b, &t, 2);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  iw_fb_scalar(b, &t, 0, IW_ARROW_BIG, 2);
+#else
+  iw_fb_scalar(b, &t, 0, IW_ARROW_LITTLE, 2);
+#endif
+  fields = iw_fb_offset(b, &t, 1);
+  iw_fb_end(b, &t);
+  iw_fb_patch(b, header, t.start);
+
+  /* Vector of offsets to the fields */
+  vec = iw_fb_vector(b, IW_ARROW_NUM_COLS, 4);
+  iw_fb_patch(b, fields, vec);
+  iw_abuf_put(b, NULL, 4 * IW_ARROW_NUM_COLS);
+  for(i = 0; i < IW_ARROW_NUM_COLS; i++)
+    {
+      /* Time and BSSID are always there */
+      size_t	field = iw_arrow_field(b, &iw_arrow_cols[i],
+				       i > IW_ARROW_COL_BSSID);
+      iw_fb_patch(b, vec + 4 + 4 * i, field);
+    }
+
+  arrow->body.len = 0;
+  return(iw_arrow_frame(arrow, out));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Look up an ESSID in the dictionary of the batch, add it if needed.
+ * Return its index, or -1 on allocation failure.
+ */
+static int
+iw_arrow_dict(iw_arrow *	arrow,
+	      const char *	str,
+	      int		len)
+{
+  uint32_t	h = 2166136261U;	/* FNV-1a */
+  int		i;
+
+  /* Keep the hash at most half full */
+  if(2 * (arrow->dict_num + 1) > arrow->dict_hsize)
+    {
+      int	hsize = arrow->dict_hsize ? 2 * arrow->dict_hsize : 64;
+      int32_t *	hash = calloc(hsize, sizeof(int32_t));
+      int32_t *	offsets = realloc(arrow->dict_offsets,
+				  (hsize / 2 + 1) * sizeof(int32_t));
+
+      if(offsets != NULL)
+	arrow->dict_offsets = offsets;
+      if((hash == NULL) || (offsets == NULL))
+	{
+	  free(hash);
+	  return(-1);
+	}
+      /* Rehash */
+      for(i = 0; i < arrow->dict_num; i++)
+	{
+	  const unsigned char *	s = arrow->dict_data.data
+				    + arrow->dict_offsets[i];
+	  int			n = arrow->dict_offsets[i + 1]
+				    - arrow->dict_offsets[i];
+	  uint32_t		rh = 2166136261U;
+
+	  while(n--)
+	    rh = (rh ^ *s++) * 16777619U;
+	  while(hash[rh & (hsize - 1)])
+	    rh++;
+	  hash[rh & (hsize - 1)] = i + 1;
+	}
+      free(arrow->dict_hash);
+      arrow->dict_hash = hash;
+      arrow->dict_hsize = hsize;
+      if(arrow->dict_num == 0)
+	arrow->dict_offsets[0] = 0;
+    }
+
+  for(i = 0; i < len; i++)
+    h = (h ^ (unsigned char) str[i]) * 16777619U;
+
+  /* Linear probing */
+  while(arrow->dict_hash[h & (arrow->dict_hsize - 1)])
+    {
+      int	idx = arrow->dict_hash[h & (arrow->dict_hsize - 1)] - 1;
+
+      if((arrow->dict_offsets[idx + 1] - arrow->dict_offsets[idx] == len)
+	 && !memcmp(arrow->dict_data.data + arrow->dict_offsets[idx],
+		    str, len))
+	return(idx);
+      h++;
+    }
+
+  /* New entry */
+  iw_abuf_put(&arrow->dict_data, str, len);
+  if(arrow->dict_data.error)
+    return(-1);
+  arrow->dict_hash[h & (arrow->dict_hsize - 1)] = arrow->dict_num + 1;
+  arrow->dict_offsets[arrow->dict_num + 1] = arrow->dict_data.len;
+  return(arrow->dict_num++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for one more row in all the columns.
+ */
+static int
+iw_arrow_grow(iw_arrow *	arrow)
+{
+  int		max = arrow->max_rows + IW_ARROW_ROWS_STEP;
+  void **	cols[IW_ARROW_NUM_COLS] = {
+    (void **) &arrow->time, (void **) &arrow->bssid, (void **) &arrow->essid,
+    (void **) &arrow->freq, (void **) &arrow->channel, (void **) &arrow->mode,
+    (void **) &arrow->signal, (void **) &arrow->noise,
+    (void **) &arrow->quality };
+  int		i;
+
+  for(i = 0; i < IW_ARROW_NUM_COLS; i++)
+    {
+      void *	col = realloc(*cols[i], max * iw_arrow_cols[i].size);
+      uint8_t *	valid = realloc(arrow->valid[i], max / 8);
+
+      if(col != NULL)
+	*cols[i] = col;
+      if(valid != NULL)
+	{
+	  arrow->valid[i] = valid;
+	  memset(valid + arrow->max_rows / 8, 0, IW_ARROW_ROWS_STEP / 8);
+	}
+      if((col == NULL) || (valid == NULL))
+	{
+	  fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	  return(-1);
+	}
+    }
+  arrow->max_rows = max;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a cell to the batch.
+ */
+int
+iw_arrow_append(iw_arrow *		arrow,
+		const iw_arrow_row *	row)
+{
+  int		r = arrow->rows;
+  int		i;
+
+  if((r == arrow->max_rows) && (iw_arrow_grow(arrow) < 0))
+    return(-1);
+
+  arrow->time[r] = row->time;
+  arrow->bssid[r] = row->bssid;
+  arrow->essid[r] = 0;
+  if(row->has & IW_ARROW_HAS(IW_ARROW_COL_ESSID))
+    {
+      arrow->essid[r] = iw_arrow_dict(arrow, row->essid, row->essid_len);
+      if(arrow->essid[r] < 0)
+	return(-1);
+    }
+  arrow->freq[r] = row->freq;
+  arrow->channel[r] = row->channel;
+  arrow->mode[r] = row->mode;
+  arrow->signal[r] = row->signal;
+  arrow->noise[r] = row->noise;
+  arrow->quality[r] = row->quality;
+
+  /* Time and BSSID are always valid */
+  for(i = 0; i < IW_ARROW_NUM_COLS; i++)
+    if((i <= IW_ARROW_COL_BSSID) || (row->has & IW_ARROW_HAS(i)))
+      arrow->valid[i][r / 8] |= 1 << (r % 8);
+    else
+      arrow->nulls[i]++;
+
+  arrow->rows++;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append the dictionary and record batch messages for the rows
+ * accumulated so far to out, and start a new batch.
+ * The dictionary replaces the previous one, so each batch can be
+ * read on its own after the schema.
+ */
+int
+iw_arrow_flush(iw_arrow *	arrow,
+	       iw_arrow_buf *	out)
+{
+  iw_arrow_buf *	b = &arrow->meta;
+  int64_t		nodes[2 * IW_ARROW_NUM_COLS];
+  int64_t		buffers[2 * 2 * IW_ARROW_NUM_COLS];
+  const void *		cols[IW_ARROW_NUM_COLS] = {
+    arrow->time, arrow->bssid, arrow->essid, arrow->freq, arrow->channel,
+    arrow->mode, arrow->signal, arrow->noise, arrow->quality };
+  size_t		header;
+  size_t		data;
+  struct iw_fb_table	t;
+  int			ret = -1;
+  int			i;
+
+  if(arrow->rows == 0)
+    return(0);
+
+  /* Dictionary batch : one utf8 column, no nulls */
+  arrow->body.len = 0;
+  iw_arrow_body(&arrow->body, NULL, 0, &buffers[0]);
+  if(arrow->dict_num == 0)
+    {
+      /* Only hidden networks, still need a valid (empty) dictionary */
+      int32_t	zero = 0;
+      iw_arrow_body(&arrow->body, &zero, sizeof(zero), &buffers[2]);
+    }
+  else
+    iw_arrow_body(&arrow->body, arrow->dict_offsets,
+		  (arrow->dict_num + 1) * sizeof(int32_t), &buffers[2]);
+  iw_arrow_body(&arrow->body, arrow->dict_data.data, arrow->dict_data.len,
+		&buffers[4]);
+  iw_abuf_align(&arrow->body, IW_ARROW_ALIGN);
+  nodes[0] = arrow->dict_num;
+  nodes[1] = 0;
+
+  header = iw_arrow_message(b, IW_ARROW_MSG_DICTIONARY, arrow->body.len);
+  iw_fb_start(b, &t, 2);
+  iw_fb_scalar(b, &t, 0, IW_ARROW_ESSID_DICT, 8);	/* id */
+  data = iw_fb_offset(b, &t, 1);
+  iw_fb_end(b, &t);
+  iw_fb_patch(b, header, t.start);
+  iw_fb_patch(b, data, iw_arrow_record(b, arrow->dict_num, nodes, 1,
+				       buffers, 3));
+  if(iw_arrow_frame(arrow, out) < 0)
+    goto reset;
+
+  /* Record batch : validity bitmap and values for each column */
+  arrow->body.len = 0;
+  for(i = 0; i < IW_ARROW_NUM_COLS; i++)
+    {
+      nodes[2 * i] = arrow->rows;
+      nodes[2 * i + 1] = arrow->nulls[i];
+      /* No bitmap needed without nulls */
+      iw_arrow_body(&arrow->body, arrow->valid[i],
+		    arrow->nulls[i] ? (size_t) (arrow->rows + 7) / 8 : 0,
+		    &buffers[4 * i]);
+      iw_arrow_body(&arrow->body, cols[i],
+		    arrow->rows * iw_arrow_cols[i].size, &buffers[4 * i + 2]);
+    }
+  iw_abuf_align(&arrow->body, IW_ARROW_ALIGN);
+
+  header = iw_arrow_message(b, IW_ARROW_MSG_RECORD, arrow->body.len);
+  iw_fb_patch(b, header, iw_arrow_record(b, arrow->rows,
+					 nodes, IW_ARROW_NUM_COLS,
+					 buffers, 2 * IW_ARROW_NUM_COLS));
+  ret = iw_arrow_frame(arrow, out);
+
+ reset:
+  /* Start over, even on failure, the rows would pile up otherwise */
+  for(i = 0; i < IW_ARROW_NUM_COLS; i++)
+    {
+      memset(arrow->valid[i], 0, (arrow->rows + 7) / 8);
+      arrow->nulls[i] = 0;
+    }
+  arrow->rows = 0;
+  if(arrow->dict_hsize)
+    memset(arrow->dict_hash, 0, arrow->dict_hsize * sizeof(int32_t));
+  arrow->dict_num = 0;
+  arrow->dict_data.len = 0;
+  arrow->dict_data.error = 0;
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append the end of stream marker to out.
+ */
+int
+iw_arrow_eos(iw_arrow_buf *	out)
+{
+  iw_abuf_put_le(out, IW_ARROW_CONTINUATION, 4);
+  iw_abuf_put_le(out, 0, 4);
+  return(out->error ? -1 : 0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release everything.
+ */
+void
+iw_arrow_free(iw_arrow *	arrow)
+{
+  int		i;
+
+  if(arrow == NULL)
+    return;
+  for(i = 0; i < IW_ARROW_NUM_COLS; i++)
+    free(arrow->valid[i]);
+  free(arrow->time);
+  free(arrow->bssid);
+  free(arrow->essid);
+  free(arrow->freq);
+  free(arrow->channel);
+  free(arrow->mode);
+  free(arrow->signal);
+  free(arrow->noise);
+  free(arrow->quality);
+  free(arrow->dict_hash);
+  free(arrow->dict_offsets);
+  free(arrow->dict_data.data);
+  free(arrow->meta.data);
+  free(arrow->body.data);
+  free(arrow);
+}
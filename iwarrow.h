@@ -0,0 +1,122 @@
+/*
+ *	Wireless Tools
+ *
+ * Apache Arrow IPC output for the scanning tools...
+ *
+ * Cells are accumulated in typed columns and written as Arrow IPC
+ * streaming format messages : a schema first, then for each batch a
+ * dictionary batch (the ESSIDs) followed by a record batch. The
+ * result can be memory-mapped and read without parsing by any Arrow
+ * implementation (pyarrow.ipc.open_stream() and friends).
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWARROW_H
+#define IWARROW_H
+
+/***************************** INCLUDES *****************************/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Columns, in schema order */
+#define IW_ARROW_COL_TIME	0	/* timestamp[ms, UTC] */
+#define IW_ARROW_COL_BSSID	1	/* uint64, first octet most significant */
+#define IW_ARROW_COL_ESSID	2	/* dictionary<int32, utf8>, null if hidden */
+#define IW_ARROW_COL_FREQ	3	/* uint16, MHz */
+#define IW_ARROW_COL_CHANNEL	4	/* uint8 */
+#define IW_ARROW_COL_MODE	5	/* uint8, see iw_operation_mode[] */
+#define IW_ARROW_COL_SIGNAL	6	/* int16, dBm */
+#define IW_ARROW_COL_NOISE	7	/* int16, dBm */
+#define IW_ARROW_COL_QUALITY	8	/* uint8 */
+#define IW_ARROW_NUM_COLS	9
+
+/* Mask of the columns present in a row (see iw_arrow_row) */
+#define IW_ARROW_HAS(col)	(1 << (col))
+
+/****************************** TYPES ******************************/
+
+/* One cell, as appended to the batch */
+typedef struct iw_arrow_row
+{
+  int		has;		/* IW_ARROW_HAS() of the valid columns */
+  int64_t	time;		/* ms since the epoch */
+  uint64_t	bssid;
+  const char *	essid;
+  int		essid_len;
+  uint16_t	freq;
+  uint8_t	channel;
+  uint8_t	mode;
+  int16_t	signal;
+  int16_t	noise;
+  uint8_t	quality;
+} iw_arrow_row;
+
+/* A growable byte buffer */
+typedef struct iw_arrow_buf
+{
+  unsigned char *	data;
+  size_t		len;
+  size_t		max;
+  int			error;		/* Allocation failed */
+} iw_arrow_buf;
+
+/* The batch being accumulated. Treat as opaque. */
+typedef struct iw_arrow
+{
+  int		rows;
+  int		max_rows;
+  int		nulls[IW_ARROW_NUM_COLS];
+  uint8_t *	valid[IW_ARROW_NUM_COLS];	/* Validity bitmaps */
+  int64_t *	time;
+  uint64_t *	bssid;
+  int32_t *	essid;		/* Dictionary indices */
+  uint16_t *	freq;
+  uint8_t *	channel;
+  uint8_t *	mode;
+  int16_t *	signal;
+  int16_t *	noise;
+  uint8_t *	quality;
+
+  /* ESSID dictionary of the batch */
+  int		dict_num;
+  int		dict_hsize;	/* Hash size, power of 2 */
+  int32_t *	dict_hash;	/* Dictionary index + 1, 0 if free */
+  int32_t *	dict_offsets;	/* dict_num + 1 entries */
+  iw_arrow_buf	dict_data;
+
+  /* Scratch buffers for the messages */
+  iw_arrow_buf	meta;
+  iw_arrow_buf	body;
+} iw_arrow;
+
+/**************************** PROTOTYPES ****************************/
+
+iw_arrow *
+	iw_arrow_new(void);
+int
+	iw_arrow_schema(iw_arrow *	arrow,
+			iw_arrow_buf *	out);
+int
+	iw_arrow_append(iw_arrow *		arrow,
+			const iw_arrow_row *	row);
+int
+	iw_arrow_flush(iw_arrow *	arrow,
+		       iw_arrow_buf *	out);
+int
+	iw_arrow_eos(iw_arrow_buf *	out);
+void
+	iw_arrow_free(iw_arrow *	arrow);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* IWARROW_H */
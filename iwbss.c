@@ -0,0 +1,349 @@
+/*
+ *	Wireless Tools
+ *
+ * Persistent index of the BSS seen across scans...
+ *
+ * The entries live in a fixed pool, so that their index is stable and
+ * can be used to chain them in LRU order. The hash only holds entry
+ * indices : it's a small array of integers, which is cheap to probe and
+ * to shift around when an entry is removed (linear probing with
+ * backward shift deletion, no tombstones).
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iwbss.h"		/* Header */
+#include "iwlib.h"		/* iw_ether_key() */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Multiplicative hashing, 2^64 / golden ratio */
+#define IW_BSS_HASH_MULT	0x9E3779B97F4A7C15ULL
+
+/* Fixed point of the signal average */
+#define IW_BSS_EWMA_ONE		256
+
+/************************* HASH SUBROUTINES *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Home slot of a BSSID.
+ */
+static uint32_t
+iw_bss_home(const iw_bss_index *	index,
+	    uint64_t			bssid)
+{
+  return((uint32_t) ((bssid * IW_BSS_HASH_MULT) >> 32) & index->hash_mask);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find the slot holding a BSSID, or the free slot where it would go.
+ */
+static uint32_t
+iw_bss_slot(const iw_bss_index *	index,
+	    uint64_t			bssid)
+{
+  uint32_t	slot = iw_bss_home(index, bssid);
+
+  /* The hash is never full, this terminates */
+  while(index->hash[slot]
+	&& (index->entries[index->hash[slot] - 1].bssid != bssid))
+    slot = (slot + 1) & index->hash_mask;
+  return(slot);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Remove the entry in slot from the hash. Shift back the entries that
+ * follow it in the same cluster, so that they can still be found.
+ */
+static void
+iw_bss_unhash(iw_bss_index *	index,
+	      uint32_t		slot)
+{
+  uint32_t	next = slot;
+  uint32_t	home;
+
+  while(1)
+    {
+      next = (next + 1) & index->hash_mask;
+      if(!index->hash[next])
+	break;
+      home = iw_bss_home(index, index->entries[index->hash[next] - 1].bssid);
+      /* Leave it if its home is cyclically in ]slot ; next] */
+      if(((next - home) & index->hash_mask) < ((next - slot) & index->hash_mask))
+	continue;
+      index->hash[slot] = index->hash[next];
+      slot = next;
+    }
+  index->hash[slot] = 0;
+}
+
+/************************* LRU SUBROUTINES *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Take an entry out of the LRU list.
+ */
+static void
+iw_bss_unlink(iw_bss_index *	index,
+	      int32_t		i)
+{
+  iw_bss_entry *	entry = &index->entries[i];
+
+  if(entry->prev >= 0)
+    index->entries[entry->prev].next = entry->next;
+  else
+    index->lru_head = entry->next;
+  if(entry->next >= 0)
+    index->entries[entry->next].prev = entry->prev;
+  else
+    index->lru_tail = entry->prev;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Put an entry at the head of the LRU list.
+ */
+static void
+iw_bss_push(iw_bss_index *	index,
+	    int32_t		i)
+{
+  iw_bss_entry *	entry = &index->entries[i];
+
+  entry->prev = -1;
+  entry->next = index->lru_head;
+  if(index->lru_head >= 0)
+    index->entries[index->lru_head].prev = i;
+  else
+    index->lru_tail = i;
+  index->lru_head = i;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Remove an entry from the index, and give it back to the pool.
+ */
+static void
+iw_bss_remove(iw_bss_index *	index,
+	      int32_t		i)
+{
+  iw_bss_unhash(index, iw_bss_slot(index, index->entries[i].bssid));
+  iw_bss_unlink(index, i);
+  index->entries[i].next = index->free_list;
+  index->free_list = i;
+  index->num_entries--;
+}
+
+/************************ INDEX SUBROUTINES ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Create an index of at most max_entries BSS. Entries not seen for
+ * more than max_age (in the units of the clock passed to
+ * iw_bss_update(), 0 for never) are removed by iw_bss_expire().
+ * All the memory is allocated here.
+ */
+iw_bss_index *
+iw_bss_new(int		max_entries,
+	   int64_t	max_age)
+{
+  iw_bss_index *	index;
+  uint32_t		hsize = 1;
+  int			i;
+
+  if(max_entries <= 0)
+    return(NULL);
+
+  /* Keep the hash at most half full */
+  while(hsize < 2 * (uint32_t) max_entries)
+    hsize <<= 1;
+
+  index = calloc(1, sizeof(iw_bss_index));
+  if(index != NULL)
+    {
+      index->entries = malloc(max_entries * sizeof(iw_bss_entry));
+      index->hash = calloc(hsize, sizeof(int32_t));
+    }
+  if((index == NULL) || (index->entries == NULL) || (index->hash == NULL))
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      iw_bss_free(index);
+      return(NULL);
+    }
+
+  index->max_entries = max_entries;
+  index->max_age = max_age;
+  index->hash_mask = hsize - 1;
+  index->lru_head = -1;
+  index->lru_tail = -1;
+  for(i = 0; i < max_entries; i++)
+    index->entries[i].next = (i + 1 < max_entries) ? i + 1 : -1;
+  index->free_list = 0;
+  return(index);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Pack a BSSID in an integer, first octet most significant.
+ */
+uint64_t
+iw_bss_key(const struct sockaddr *	ap_addr)
+{
+  return(iw_ether_key((const unsigned char *) ap_addr->sa_data));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Look up a BSS. Return NULL if it's not in the index.
+ */
+iw_bss_entry *
+iw_bss_find(iw_bss_index *	index,
+	    uint64_t		bssid)
+{
+  uint32_t	slot = iw_bss_slot(index, bssid);
+
+  if(!index->hash[slot])
+    return(NULL);
+  return(&index->entries[index->hash[slot] - 1]);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Record an observation of a BSS, at time now, with its signal in dBm
+ * if has_signal. If the BSS was not known, it's added, evicting the
+ * least recently seen BSS if the index is full.
+ * *isnew (if not NULL) tells if the BSS was added.
+ * Return the entry of the BSS.
+ */
+iw_bss_entry *
+iw_bss_update(iw_bss_index *	index,
+	      uint64_t		bssid,
+	      int64_t		now,
+	      int		has_signal,
+	      int		signal,
+	      int *		isnew)
+{
+  uint32_t		slot = iw_bss_slot(index, bssid);
+  iw_bss_entry *	entry;
+  int32_t		i;
+
+  if(index->hash[slot])
+    {
+      /* Known, make it the most recent */
+      i = index->hash[slot] - 1;
+      entry = &index->entries[i];
+      if(index->lru_head != i)
+	{
+	  iw_bss_unlink(index, i);
+	  iw_bss_push(index, i);
+	}
+      if(isnew)
+	*isnew = IW_BSS_SEEN;
+    }
+  else
+    {
+      /* Full, make room. This may move our slot */
+      if(index->free_list < 0)
+	{
+	  iw_bss_remove(index, index->lru_tail);
+	  index->evicted++;
+	  slot = iw_bss_slot(index, bssid);
+	}
+      i = index->free_list;
+      entry = &index->entries[i];
+      index->free_list = entry->next;
+      index->num_entries++;
+
+      memset(entry, 0, sizeof(iw_bss_entry));
+      entry->bssid = bssid;
+      entry->first_seen = now;
+      index->hash[slot] = i + 1;
+      iw_bss_push(index, i);
+      if(isnew)
+	*isnew = IW_BSS_NEW;
+    }
+
+  entry->last_seen = now;
+  entry->count++;
+  if(has_signal)
+    {
+      if(entry->samples == 0)
+	{
+	  entry->min_signal = signal;
+	  entry->max_signal = signal;
+	  entry->ewma_signal = signal * IW_BSS_EWMA_ONE;
+	}
+      else
+	{
+	  if(signal < entry->min_signal)
+	    entry->min_signal = signal;
+	  if(signal > entry->max_signal)
+	    entry->max_signal = signal;
+	  entry->ewma_signal += (signal * IW_BSS_EWMA_ONE - entry->ewma_signal)
+				/ (1 << IW_BSS_EWMA_SHIFT);
+	}
+      entry->samples++;
+    }
+  return(entry);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Remove the BSS not seen for more than max_age before now.
+ * Only the oldest entries are visited.
+ * Return the number of entries removed.
+ */
+int
+iw_bss_expire(iw_bss_index *	index,
+	      int64_t		now)
+{
+  int		num = 0;
+
+  if(index->max_age <= 0)
+    return(0);
+
+  while((index->lru_tail >= 0)
+	&& (now - index->entries[index->lru_tail].last_seen > index->max_age))
+    {
+      iw_bss_remove(index, index->lru_tail);
+      num++;
+    }
+  index->expired += num;
+  return(num);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Average signal of a BSS, in dBm, rounded.
+ */
+int
+iw_bss_signal(const iw_bss_entry *	entry)
+{
+  int32_t	ewma = entry->ewma_signal;
+
+  if(ewma >= 0)
+    return((ewma + IW_BSS_EWMA_ONE / 2) / IW_BSS_EWMA_ONE);
+  return((ewma - IW_BSS_EWMA_ONE / 2) / IW_BSS_EWMA_ONE);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the index.
+ */
+void
+iw_bss_free(iw_bss_index *	index)
+{
+  if(index == NULL)
+    return;
+  free(index->entries);
+  free(index->hash);
+  free(index);
+}
@@ -0,0 +1,101 @@
+/*
+ *	Wireless Tools
+ *
+ * Persistent index of the BSS seen across scans...
+ *
+ * Long running probes see the same BSS over and over. This index keeps
+ * a small record per BSSID (when it was first and last seen, how often,
+ * and its signal statistics), so that each scan only updates it instead
+ * of starting from scratch.
+ * Memory is allocated once : when the index is full, the BSS that has
+ * not been seen for the longest time is evicted.
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWBSS_H
+#define IWBSS_H
+
+/***************************** INCLUDES *****************************/
+
+#include <stdint.h>
+#include <sys/socket.h>		/* struct sockaddr */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Weight of the new sample in the signal average, 1/2^N */
+#define IW_BSS_EWMA_SHIFT	3
+
+/* Returned by iw_bss_update() in *isnew */
+#define IW_BSS_SEEN		0	/* Already in the index */
+#define IW_BSS_NEW		1	/* First time seen */
+
+/****************************** TYPES ******************************/
+
+/* What we know about one BSS */
+typedef struct iw_bss_entry
+{
+  uint64_t	bssid;		/* See iw_bss_key() */
+  int64_t	first_seen;	/* Caller's clock, usually ms */
+  int64_t	last_seen;
+  uint32_t	count;		/* Number of observations */
+  uint32_t	samples;	/* Observations with a signal */
+  int16_t	min_signal;	/* dBm, valid if samples > 0 */
+  int16_t	max_signal;
+  int32_t	ewma_signal;	/* dBm, fixed point 1/256 */
+  /* LRU list, most recently seen first. Indices, -1 terminated */
+  int32_t	prev;
+  int32_t	next;
+} iw_bss_entry;
+
+/* The index. Treat as opaque. */
+typedef struct iw_bss_index
+{
+  int		max_entries;
+  int		num_entries;
+  int64_t	max_age;	/* Expire older entries, 0 = never */
+  iw_bss_entry *	entries;	/* max_entries */
+  int32_t	free_list;	/* Unused entries, chained by next */
+  int32_t	lru_head;	/* Most recently seen */
+  int32_t	lru_tail;	/* Least recently seen */
+  /* Open addressing, linear probing : entry index + 1, 0 if free */
+  uint32_t	hash_mask;
+  int32_t *	hash;
+  unsigned long	evicted;	/* Entries evicted to make room */
+  unsigned long	expired;	/* Entries removed by age */
+} iw_bss_index;
+
+/**************************** PROTOTYPES ****************************/
+
+iw_bss_index *
+	iw_bss_new(int		max_entries,
+		   int64_t	max_age);
+uint64_t
+	iw_bss_key(const struct sockaddr *	ap_addr);
+iw_bss_entry *
+	iw_bss_find(iw_bss_index *	index,
+		    uint64_t		bssid);
+iw_bss_entry *
+	iw_bss_update(iw_bss_index *	index,
+		      uint64_t		bssid,
+		      int64_t		now,
+		      int		has_signal,
+		      int		signal,
+		      int *		isnew);
+int
+	iw_bss_expire(iw_bss_index *	index,
+		      int64_t		now);
+int
+	iw_bss_signal(const iw_bss_entry *	entry);
+void
+	iw_bss_free(iw_bss_index *	index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* IWBSS_H */
@@ -0,0 +1,268 @@
+/*
+ *	Wireless Tools
+ *
+ * C++20 coroutine interface to scanning...
+ *
+ * iw_scan() sleeps until the results are in. Here the coroutine is
+ * suspended instead, and resumed by the caller's event loop, either
+ * when the retry delay given by iw_process_scan() has expired, or as
+ * soon as the kernel reports the end of the scan on rtnetlink. A
+ * single thread can then scan any number of interfaces at once.
+ *
+ * The event loop is reached through an executor provided by the
+ * caller, which must have :
+ *	template<class F> void after(std::chrono::milliseconds delay, F f);
+ *		Call f() once, after delay.
+ *	template<class F> void readable(int fd, std::chrono::milliseconds
+ *					timeout, F f);
+ *		Call f(ready) once, when fd is readable (ready == true)
+ *		or after timeout (ready == false).
+ * Both are a few lines over asio::steady_timer and
+ * asio::posix::stream_descriptor::async_wait(), or epoll + timerfd.
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWCORO_HPP
+#define IWCORO_HPP
+
+/***************************** INCLUDES *****************************/
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <vector>
+
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "iwlib.hpp"
+
+namespace iw {
+
+/**************************** LINK WATCH ****************************/
+
+/*
+ * An rtnetlink socket listening to link events, where the kernel
+ * reports completed scans (SIOCGIWSCAN in IFLA_WIRELESS). One watch
+ * can be shared by all the scans of an event loop.
+ */
+class link_watch
+{
+public:
+  link_watch()
+    : sock_(::socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		     NETLINK_ROUTE))
+  {
+    struct sockaddr_nl	local;
+
+    if(sock_.get() < 0)
+      throw std::system_error(errno, std::system_category(), "socket");
+    std::memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_LINK;
+    if(bind(sock_.get(), reinterpret_cast<struct sockaddr *>(&local),
+	    sizeof(local)) < 0)
+      throw std::system_error(errno, std::system_category(), "bind");
+  }
+
+  int fd() const noexcept { return sock_.get(); }
+
+  /*
+   * Read what's pending, and tell if a scan completed on ifindex.
+   * Completions for other interfaces are kept for their own scans.
+   */
+  bool scan_done(unsigned ifindex, int we_version) noexcept
+  {
+    char	buf[8192];
+    ssize_t	len;
+
+    while((len = recv(sock_.get(), buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      parse(buf, len, we_version);
+    return claim(ifindex);
+  }
+
+  /*
+   * Take a completion for ifindex already read from the socket, by
+   * the scan of another interface. The socket won't tell about it
+   * again, so check before waiting on it.
+   */
+  bool claim(unsigned ifindex) noexcept
+  {
+    auto	it = std::find(done_.begin(), done_.end(), ifindex);
+
+    if(it == done_.end())
+      return false;
+    done_.erase(it);
+    return true;
+  }
+
+  /* Forget an old completion, before starting a new scan */
+  void clear(unsigned ifindex) noexcept
+  {
+    done_.erase(std::remove(done_.begin(), done_.end(), ifindex),
+		done_.end());
+  }
+
+private:
+  void parse(char *buf, ssize_t len, int we_version) noexcept
+  {
+    int		left = len;
+
+    for(auto *nlh = reinterpret_cast<struct nlmsghdr *>(buf);
+	NLMSG_OK(nlh, left); nlh = NLMSG_NEXT(nlh, left))
+      {
+	if(nlh->nlmsg_type != RTM_NEWLINK)
+	  continue;
+
+	auto *		ifi = static_cast<struct ifinfomsg *>(NLMSG_DATA(nlh));
+	int		alen = IFLA_PAYLOAD(nlh);
+
+	for(auto *rta = IFLA_RTA(ifi); RTA_OK(rta, alen);
+	    rta = RTA_NEXT(rta, alen))
+	  if((rta->rta_type == IFLA_WIRELESS)
+	     && has_scan_event(static_cast<char *>(RTA_DATA(rta)),
+			       RTA_PAYLOAD(rta), we_version)
+	     && (std::find(done_.begin(), done_.end(),
+			   static_cast<unsigned>(ifi->ifi_index))
+		 == done_.end()))
+	    done_.push_back(ifi->ifi_index);
+      }
+  }
+
+  static bool has_scan_event(char *data, int len, int we_version) noexcept
+  {
+    stream_descr	stream;
+    iw_event		event;
+
+    iw_init_event_stream(&stream, data, len);
+    while(iw_extract_event_stream(&stream, &event, we_version) > 0)
+      if(event.cmd == SIOCGIWSCAN)
+	return true;
+    return false;
+  }
+
+  socket			sock_;
+  std::vector<unsigned>		done_;	/* Completed, not yet claimed */
+};
+
+/***************************** AWAITABLE *****************************/
+
+/*
+ * co_await async_scan(...) : scan an interface without blocking.
+ * The result is that of iw_scan(), 0 or -1 with errno set, and the
+ * cells are in results.
+ */
+template<class Executor>
+class scan_awaitable
+{
+public:
+  scan_awaitable(Executor &ex, const socket &sock, const char *ifname,
+		 int we_version, scan_results &results,
+		 link_watch *watch) noexcept
+    : ex_(ex), sock_(sock), ifname_(ifname), we_version_(we_version),
+      results_(results), watch_(watch),
+      ifindex_(watch ? if_nametoindex(ifname) : 0)
+  {}
+
+  /* Trigger the scan, it's only done when the driver can't scan */
+  bool await_ready() noexcept
+  {
+    wireless_scan_head &	head = results_.get();
+
+    /* Like iw_scan(), the previous results are recycled */
+    head.result = nullptr;
+    head.cells = nullptr;
+    head.num_cells = 0;
+    head.retry = 0;
+    if(watch_ && ifindex_)
+      watch_->clear(ifindex_);
+    status_ = results_.process(sock_, ifname_, we_version_);
+    return status_ <= 0;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    handle_ = handle;
+    wait(std::chrono::milliseconds(status_));
+  }
+
+  int await_resume() const noexcept { return status_; }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  /* Come back after delay, or earlier if the scan completes */
+  void wait(std::chrono::milliseconds delay)
+  {
+    if(watch_ && ifindex_)
+      {
+	/* Another scan may have read our completion already */
+	if(watch_->claim(ifindex_))
+	  {
+	    step();
+	    return;
+	  }
+	deadline_ = clock::now() + delay;
+	ex_.readable(watch_->fd(), delay, [this](bool ready) {
+	    if(ready && !watch_->scan_done(ifindex_, we_version_))
+	      {
+		/* Someone else's event, keep waiting */
+		auto	left = std::chrono::duration_cast<
+		  std::chrono::milliseconds>(deadline_ - clock::now());
+
+		if(left.count() > 0)
+		  {
+		    wait(left);
+		    return;
+		  }
+	      }
+	    step();
+	  });
+      }
+    else
+      ex_.after(delay, [this]() { step(); });
+  }
+
+  /* Try to get the results */
+  void step()
+  {
+    status_ = results_.process(sock_, ifname_, we_version_);
+    if(status_ > 0)
+      wait(std::chrono::milliseconds(status_));
+    else
+      handle_.resume();
+  }
+
+  Executor &			ex_;
+  const socket &		sock_;
+  const char *			ifname_;
+  int				we_version_;
+  scan_results &		results_;
+  link_watch *			watch_;
+  unsigned			ifindex_;
+  int				status_ = -1;
+  clock::time_point		deadline_;
+  std::coroutine_handle<>	handle_;
+};
+
+/*
+ * Scan ifname, resuming on the executor. With a watch, the coroutine
+ * is resumed as soon as the kernel reports the end of the scan,
+ * otherwise only when the retry delays expire.
+ */
+template<class Executor>
+scan_awaitable<Executor>
+async_scan(Executor &ex, const socket &sock, const char *ifname,
+	   int we_version, scan_results &results,
+	   link_watch *watch = nullptr) noexcept
+{
+  return scan_awaitable<Executor>(ex, sock, ifname, we_version, results,
+				  watch);
+}
+
+} /* namespace iw */
+
+#endif	/* IWCORO_HPP */
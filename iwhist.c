@@ -0,0 +1,866 @@
+/*
+ *	Wireless Tools
+ *
+ * Compact on-disk scan history...
+ *
+ * Layout of the history file :
+ *	header (iw_hist_header)
+ *	block, block, ... (8 aligned)
+ * Each block is :
+ *	block header (iw_hist_block)
+ *	scan, scan, ...
+ * Each scan is :
+ *	varint	time delta (zigzag, ms, from the previous scan of the block)
+ *	u16	number of cells
+ *	cell, cell, ...
+ * Each cell is :
+ *	varint	(BSSID number << 2) | signal present << 1 | definition
+ *	if definition :
+ *		6 bytes BSSID, only if it's a new BSSID number
+ *		varint frequency (MHz)
+ *		u8 ESSID length, ESSID
+ *	if signal present :
+ *		varint signal delta (zigzag, dBm, from the previous one)
+ * BSSID numbers are given in order of first appearance in the block.
+ * A definition is repeated only when the ESSID or frequency changes.
+ *
+ * The header's data_end is only updated once a scan is complete, so a
+ * crash never leaves a partial scan visible. The index file has one
+ * entry per closed block, blocks left open by a crash are indexed the
+ * next time the history is opened for writing.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "iwhist.h"		/* Header */
+#include "iwlib.h"		/* iw_ether_key() */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Cell flags */
+#define IW_HIST_DEF		0x01	/* Definition follows */
+#define IW_HIST_SIG		0x02	/* Signal follows */
+
+/* Blocks are 8 aligned */
+#define IW_HIST_ALIGN(x)	(((x) + 7) & ~((size_t) 7))
+
+/* Slots of the writer dictionary hash */
+#define IW_HIST_HASH_SIZE	(2 * IW_HIST_MAX_DICT)
+
+/************************ VARINT SUBROUTINES ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Store an unsigned varint (LEB128). Return the number of bytes.
+ */
+static int
+iw_hist_put_varint(unsigned char *	p,
+		   uint64_t		value)
+{
+  int		n = 0;
+
+  while(value >= 0x80)
+    {
+      p[n++] = (value & 0x7F) | 0x80;
+      value >>= 7;
+    }
+  p[n++] = value;
+  return(n);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Store a signed varint (zigzag). Return the number of bytes.
+ */
+static int
+iw_hist_put_svarint(unsigned char *	p,
+		    int64_t		value)
+{
+  return(iw_hist_put_varint(p, ((uint64_t) value << 1) ^ (value >> 63)));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Read an unsigned varint, without going past the committed data.
+ * Return -1 if it's truncated.
+ */
+static int
+iw_hist_get_varint(iw_hist_reader *	reader,
+		   uint64_t *		value)
+{
+  int		shift = 0;
+  unsigned char	b;
+
+  *value = 0;
+  do
+    {
+      if((reader->pos >= reader->size) || (shift > 63))
+	return(-1);
+      b = reader->map[reader->pos++];
+      *value |= (uint64_t) (b & 0x7F) << shift;
+      shift += 7;
+    }
+  while(b & 0x80);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Read a signed varint.
+ */
+static int
+iw_hist_get_svarint(iw_hist_reader *	reader,
+		    int64_t *		value)
+{
+  uint64_t	v;
+
+  if(iw_hist_get_varint(reader, &v) < 0)
+    return(-1);
+  *value = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+  return(0);
+}
+
+/************************* WRITER SUBROUTINES *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Make sure n more bytes can be written, growing the file and the
+ * mapping if needed.
+ */
+static int
+iw_hist_reserve(iw_hist *	hist,
+		size_t		n)
+{
+  size_t	size;
+  void *	map;
+
+  if(hist->pos + n <= hist->map_size)
+    return(0);
+
+  size = hist->map_size + ((n > IW_HIST_GROW) ? n : IW_HIST_GROW);
+  if(ftruncate(hist->fd, size) < 0)
+    {
+      fprintf(stderr, "Can't grow history : %s\n", strerror(errno));
+      return(-1);
+    }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, hist->fd, 0);
+  if(map == MAP_FAILED)
+    {
+      fprintf(stderr, "Can't map history : %s\n", strerror(errno));
+      return(-1);
+    }
+  munmap(hist->map, hist->map_size);
+  hist->map = map;
+  hist->map_size = size;
+  hist->header = map;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Block header at a given offset.
+ */
+static iw_hist_block *
+iw_hist_block_at(unsigned char *	map,
+		 uint64_t		offset)
+{
+  return((iw_hist_block *) (map + offset));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add a block to the index.
+ */
+static int
+iw_hist_index_add(iw_hist *	hist,
+		  uint64_t	offset)
+{
+  iw_hist_block *	block = iw_hist_block_at(hist->map, offset);
+  iw_hist_index		entry;
+
+  entry.first_time = block->first_time;
+  entry.last_time = block->last_time;
+  entry.offset = offset;
+  if(write(hist->index_fd, &entry, sizeof(entry)) != sizeof(entry))
+    {
+      fprintf(stderr, "Can't write history index : %s\n", strerror(errno));
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Index the blocks a previous writer didn't get to close.
+ */
+static int
+iw_hist_recover(iw_hist *	hist)
+{
+  uint64_t		data_end = hist->header->data_end;
+  uint64_t		offset = hist->header->header_size;
+  iw_hist_index		last;
+  off_t			size;
+
+  /* Start after the last indexed block */
+  size = lseek(hist->index_fd, 0, SEEK_END);
+  if(size >= (off_t) sizeof(last))
+    {
+      size -= size % sizeof(last);
+      if((pread(hist->index_fd, &last, sizeof(last), size - sizeof(last))
+	  == sizeof(last))
+	 && (last.offset + sizeof(iw_hist_block) <= data_end))
+	offset = IW_HIST_ALIGN(last.offset
+			       + iw_hist_block_at(hist->map,
+						  last.offset)->length);
+    }
+
+  while(offset + sizeof(iw_hist_block) <= data_end)
+    {
+      iw_hist_block *	block = iw_hist_block_at(hist->map, offset);
+
+      if((block->magic != IW_HIST_BLOCK_MAGIC)
+	 || (block->length < sizeof(iw_hist_block)))
+	break;
+      if(iw_hist_index_add(hist, offset) < 0)
+	return(-1);
+      offset = IW_HIST_ALIGN(offset + block->length);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Done with the current block.
+ */
+static int
+iw_hist_block_close(iw_hist *	hist)
+{
+  int		ret;
+
+  if(hist->block == 0)
+    return(0);
+  ret = iw_hist_index_add(hist, hist->block);
+  hist->block = 0;
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Hash slot of a BSSID in the writer dictionary.
+ */
+static int
+iw_hist_slot(iw_hist *	hist,
+	     uint64_t	bssid)
+{
+  int		slot = (bssid * 0x9E3779B97F4A7C15ULL) >> 51;
+
+  slot &= IW_HIST_HASH_SIZE - 1;
+  while(hist->dict_hash[slot]
+	&& (hist->dict[hist->dict_hash[slot] - 1].bssid != bssid))
+    slot = (slot + 1) & (IW_HIST_HASH_SIZE - 1);
+  return(slot);
+}
+
+/************************** WRITER INTERFACE **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Open a history file for appending, create it if needed.
+ * The index is in the same file name with IW_HIST_INDEX_SUFFIX.
+ */
+iw_hist *
+iw_hist_open(const char *	path)
+{
+  iw_hist *	hist;
+  char *	index_path;
+  struct stat	st;
+  int		created;
+
+  hist = calloc(1, sizeof(iw_hist));
+  index_path = malloc(strlen(path) + sizeof(IW_HIST_INDEX_SUFFIX));
+  if((hist == NULL) || (index_path == NULL))
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      free(hist);
+      free(index_path);
+      return(NULL);
+    }
+  sprintf(index_path, "%s%s", path, IW_HIST_INDEX_SUFFIX);
+  hist->index_fd = -1;
+
+  hist->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if((hist->fd < 0) || (fstat(hist->fd, &st) < 0))
+    goto fail;
+  hist->index_fd = open(index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+			0644);
+  if(hist->index_fd < 0)
+    goto fail;
+
+  /* Map it all, a new file gets a first chunk */
+  created = (st.st_size == 0);
+  hist->map_size = created ? IW_HIST_GROW : (size_t) st.st_size;
+  if(created && (ftruncate(hist->fd, hist->map_size) < 0))
+    goto fail;
+  if(hist->map_size < sizeof(iw_hist_header))
+    {
+      errno = EINVAL;
+      goto fail;
+    }
+  hist->map = mmap(NULL, hist->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   hist->fd, 0);
+  if(hist->map == MAP_FAILED)
+    {
+      hist->map = NULL;
+      goto fail;
+    }
+  hist->header = (iw_hist_header *) hist->map;
+
+  if(created)
+    {
+      memcpy(hist->header->magic, IW_HIST_MAGIC, sizeof(hist->header->magic));
+      hist->header->byte_order = IW_HIST_BYTE_ORDER;
+      hist->header->header_size = sizeof(iw_hist_header);
+      hist->header->data_end = sizeof(iw_hist_header);
+    }
+  else if(memcmp(hist->header->magic, IW_HIST_MAGIC,
+		 sizeof(hist->header->magic))
+	  || (hist->header->byte_order != IW_HIST_BYTE_ORDER)
+	  || (hist->header->data_end > hist->map_size))
+    {
+      errno = EINVAL;
+      goto fail;
+    }
+  else if(iw_hist_recover(hist) < 0)
+    goto fail;
+
+  hist->pos = hist->header->data_end;
+  free(index_path);
+  return(hist);
+
+ fail:
+  fprintf(stderr, "Can't open history %s : %s\n", path, strerror(errno));
+  free(index_path);
+  if(hist->map != NULL)
+    munmap(hist->map, hist->map_size);
+  if(hist->index_fd >= 0)
+    close(hist->index_fd);
+  if(hist->fd >= 0)
+    close(hist->fd);
+  free(hist);
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Start recording a scan done at time (ms).
+ */
+int
+iw_hist_begin(iw_hist *	hist,
+	      int64_t	time)
+{
+  iw_hist_block *	block;
+
+  /* Left open, keep what we got */
+  if(hist->count_pos)
+    iw_hist_end(hist);
+
+  /* Start a new block when this one is big enough, or could run out
+   * of BSSID numbers during this scan */
+  if(hist->block
+     && ((hist->pos - hist->block >= IW_HIST_BLOCK_SIZE)
+	 || (hist->dict_num > IW_HIST_MAX_DICT - IW_HIST_DICT_SLACK)))
+    iw_hist_block_close(hist);
+
+  if(hist->block == 0)
+    {
+      hist->pos = IW_HIST_ALIGN(hist->pos);
+      if(iw_hist_reserve(hist, sizeof(iw_hist_block)) < 0)
+	return(-1);
+      block = iw_hist_block_at(hist->map, hist->pos);
+      memset(block, 0, sizeof(iw_hist_block));
+      block->magic = IW_HIST_BLOCK_MAGIC;
+      block->length = sizeof(iw_hist_block);
+      block->first_time = time;
+      block->last_time = time;
+      hist->block = hist->pos;
+      hist->pos += sizeof(iw_hist_block);
+      hist->last_time = time;
+      hist->dict_num = 0;
+      memset(hist->dict_hash, 0, sizeof(hist->dict_hash));
+    }
+
+  if(iw_hist_reserve(hist, 10 + 2) < 0)
+    return(-1);
+  hist->pos += iw_hist_put_svarint(hist->map + hist->pos,
+				   time - hist->last_time);
+  hist->last_time = time;
+  hist->count_pos = hist->pos;
+  hist->pos += 2;
+  hist->num_cells = 0;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Record a cell of the current scan.
+ */
+int
+iw_hist_add(iw_hist *			hist,
+	     const iw_hist_cell *	cell)
+{
+  iw_hist_bss *		bss;
+  unsigned char *	p;
+  int			essid_len = cell->essid_len;
+  int			isnew = 0;
+  int			flags = 0;
+  int			slot;
+  int			idx;
+  int			i;
+
+  if((hist->count_pos == 0) || (hist->num_cells == IW_HIST_MAX_CELLS)
+     || (iw_hist_reserve(hist, IW_HIST_CELL_MAX) < 0))
+    {
+      hist->dropped++;
+      return(-1);
+    }
+  if(essid_len > (int) sizeof(bss->essid_buf))
+    essid_len = sizeof(bss->essid_buf);
+
+  slot = iw_hist_slot(hist, cell->bssid);
+  if(hist->dict_hash[slot])
+    {
+      idx = hist->dict_hash[slot] - 1;
+      bss = &hist->dict[idx];
+      /* Repeat the definition only if it changed */
+      if((bss->freq != cell->freq) || (bss->essid_len != essid_len)
+	 || memcmp(bss->essid_buf, cell->essid, essid_len))
+	flags |= IW_HIST_DEF;
+    }
+  else
+    {
+      if(hist->dict_num == IW_HIST_MAX_DICT)
+	{
+	  hist->dropped++;
+	  return(-1);
+	}
+      idx = hist->dict_num++;
+      hist->dict_hash[slot] = idx + 1;
+      bss = &hist->dict[idx];
+      bss->bssid = cell->bssid;
+      bss->signal = 0;
+      isnew = 1;
+      flags |= IW_HIST_DEF;
+    }
+  if(cell->has_signal)
+    flags |= IW_HIST_SIG;
+
+  p = hist->map + hist->pos;
+  p += iw_hist_put_varint(p, ((uint64_t) idx << 2) | flags);
+  if(isnew)
+    for(i = 5; i >= 0; i--)
+      *p++ = cell->bssid >> (8 * i);
+  if(flags & IW_HIST_DEF)
+    {
+      bss->freq = cell->freq;
+      bss->essid_len = essid_len;
+      memcpy(bss->essid_buf, cell->essid, essid_len);
+      p += iw_hist_put_varint(p, cell->freq);
+      *p++ = essid_len;
+      memcpy(p, cell->essid, essid_len);
+      p += essid_len;
+    }
+  if(flags & IW_HIST_SIG)
+    {
+      p += iw_hist_put_svarint(p, cell->signal - bss->signal);
+      bss->signal = cell->signal;
+    }
+
+  hist->pos = p - hist->map;
+  hist->num_cells++;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Done with the current scan, commit it.
+ */
+int
+iw_hist_end(iw_hist *	hist)
+{
+  iw_hist_block *	block;
+  uint16_t		count = hist->num_cells;
+
+  if(hist->count_pos == 0)
+    return(-1);
+  memcpy(hist->map + hist->count_pos, &count, sizeof(count));
+  hist->count_pos = 0;
+
+  block = iw_hist_block_at(hist->map, hist->block);
+  if(hist->last_time > block->last_time)
+    block->last_time = hist->last_time;
+  block->num_scans++;
+  block->num_bssids = hist->dict_num;
+  block->length = hist->pos - hist->block;
+
+  /* Now readers can see it */
+  hist->header->data_end = hist->pos;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Close the history, and give back the space allocated in advance.
+ */
+void
+iw_hist_close(iw_hist *	hist)
+{
+  if(hist == NULL)
+    return;
+  if(hist->count_pos)
+    iw_hist_end(hist);
+  iw_hist_block_close(hist);
+
+  msync(hist->map, hist->map_size, MS_SYNC);
+  if(ftruncate(hist->fd, hist->header->data_end) < 0)
+    fprintf(stderr, "Can't trim history : %s\n", strerror(errno));
+  munmap(hist->map, hist->map_size);
+  close(hist->index_fd);
+  close(hist->fd);
+  if(hist->dropped)
+    fprintf(stderr, "%lu cells didn't fit in the history\n", hist->dropped);
+  free(hist);
+}
+
+/************************* READER SUBROUTINES *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Start reading the block at offset.
+ * The last block may be the one a writer is filling : its length and
+ * number of scans keep growing past what was committed when we mapped
+ * the file, so it is read up to the committed data only.
+ * Return 0 if there is no (valid) block there.
+ */
+static int
+iw_hist_enter(iw_hist_reader *	reader,
+	      size_t		offset)
+{
+  const iw_hist_block *	block;
+
+  if(offset + sizeof(iw_hist_block) > reader->size)
+    return(0);
+  block = (const iw_hist_block *) (reader->map + offset);
+  if((block->magic != IW_HIST_BLOCK_MAGIC)
+     || (block->length < sizeof(iw_hist_block)))
+    return(0);
+
+  reader->block = offset;
+  reader->live = (offset + block->length >= reader->size);
+  reader->pos = offset + sizeof(iw_hist_block);
+  reader->scans_left = block->num_scans;
+  reader->cells_left = 0;
+  reader->time = block->first_time;
+  reader->dict_num = 0;
+  return(1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Offset of the block after the current one.
+ */
+static size_t
+iw_hist_next_block(iw_hist_reader *	reader,
+		   size_t		offset)
+{
+  const iw_hist_block *	block;
+
+  block = (const iw_hist_block *) (reader->map + offset);
+  return(IW_HIST_ALIGN(offset + block->length));
+}
+
+/************************** READER INTERFACE **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Map a history file (and its index) for reading.
+ * Reading starts at the beginning, see iw_hist_seek().
+ */
+iw_hist_reader *
+iw_hist_map(const char *	path)
+{
+  iw_hist_reader *		reader;
+  const iw_hist_header *	header;
+  char *			index_path;
+  struct stat			st;
+  void *			map;
+  int				fd;
+
+  reader = calloc(1, sizeof(iw_hist_reader));
+  index_path = malloc(strlen(path) + sizeof(IW_HIST_INDEX_SUFFIX));
+  if((reader == NULL) || (index_path == NULL))
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      free(reader);
+      free(index_path);
+      return(NULL);
+    }
+  sprintf(index_path, "%s%s", path, IW_HIST_INDEX_SUFFIX);
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if((fd < 0) || (fstat(fd, &st) < 0))
+    goto fail;
+  if((size_t) st.st_size < sizeof(iw_hist_header))
+    {
+      close(fd);
+      errno = EINVAL;
+      goto fail;
+    }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    goto fail;
+  reader->map = map;
+  reader->map_size = st.st_size;
+  header = map;
+  if(memcmp(header->magic, IW_HIST_MAGIC, sizeof(header->magic))
+     || (header->byte_order != IW_HIST_BYTE_ORDER))
+    {
+      munmap(map, st.st_size);
+      errno = EINVAL;
+      goto fail;
+    }
+  /* Only what's committed, the writer may be ahead of us */
+  reader->size = st.st_size;
+  if(header->data_end < reader->size)
+    reader->size = header->data_end;
+
+  /* The index is optional, without it we walk the blocks */
+  fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  if((fd >= 0) && (fstat(fd, &st) == 0)
+     && ((size_t) st.st_size >= sizeof(iw_hist_index)))
+    {
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if(map != MAP_FAILED)
+	{
+	  reader->index = map;
+	  reader->index_size = st.st_size;
+	  reader->num_index = st.st_size / sizeof(iw_hist_index);
+	  /* Ignore blocks beyond what we can see */
+	  while(reader->num_index
+		&& (reader->index[reader->num_index - 1].offset
+		    + sizeof(iw_hist_block) > reader->size))
+	    reader->num_index--;
+	}
+    }
+  if(fd >= 0)
+    close(fd);
+
+  free(index_path);
+  iw_hist_seek(reader, INT64_MIN);
+  return(reader);
+
+ fail:
+  fprintf(stderr, "Can't map history %s : %s\n", path, strerror(errno));
+  free(index_path);
+  free(reader);
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Position the reader on the first scan done at or after time (ms).
+ * Only the block containing it is decoded.
+ * Return 1 if there is such a scan, 0 if not, -1 on corruption.
+ */
+int
+iw_hist_seek(iw_hist_reader *	reader,
+	     int64_t		time)
+{
+  const iw_hist_header *	header = (const iw_hist_header *) reader->map;
+  size_t			offset = header->header_size;
+  int64_t			scan_time;
+  int				num_cells;
+  int				lo = 0;
+  int				hi = reader->num_index;
+  int				ret;
+
+  /* First indexed block ending at or after time */
+  while(lo < hi)
+    {
+      int	mid = (lo + hi) / 2;
+
+      if(reader->index[mid].last_time < time)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if(lo < reader->num_index)
+    offset = reader->index[lo].offset;
+  else if(reader->num_index > 0)
+    /* Not indexed yet, look after the last indexed block */
+    offset = iw_hist_next_block(reader,
+				reader->index[reader->num_index - 1].offset);
+
+  reader->pending = 0;
+  if(!iw_hist_enter(reader, offset))
+    {
+      /* Nothing there, iteration ends right away */
+      reader->scans_left = 0;
+      reader->block = reader->size;
+      return(0);
+    }
+
+  /* Skip the earlier scans of the block */
+  while((ret = iw_hist_next_scan(reader, &scan_time, &num_cells)) > 0)
+    if(scan_time >= time)
+      {
+	/* Give it again on the next call */
+	reader->pending = 1;
+	return(1);
+      }
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Move to the next scan. Its cells are returned by iw_hist_next_cell().
+ * Return 1 if there is one, 0 at the end, -1 on corruption.
+ */
+int
+iw_hist_next_scan(iw_hist_reader *	reader,
+		  int64_t *		time,
+		  int *			num_cells)
+{
+  iw_hist_cell	cell;
+  int64_t	delta;
+  uint16_t	count;
+  int		ret;
+
+  if(reader->pending)
+    {
+      reader->pending = 0;
+      *time = reader->time;
+      *num_cells = reader->cells_left;
+      return(1);
+    }
+
+  /* Skip what the caller didn't read, to keep the dictionary right */
+  while((ret = iw_hist_next_cell(reader, &cell)) > 0)
+    ;
+  if(ret < 0)
+    return(-1);
+
+  /* The live block ends with the committed data, whatever it says */
+  while((reader->scans_left == 0)
+	|| (reader->live && (reader->pos >= reader->size)))
+    if((reader->block >= reader->size)
+       || !iw_hist_enter(reader, iw_hist_next_block(reader, reader->block)))
+      return(0);
+
+  if((iw_hist_get_svarint(reader, &delta) < 0)
+     || (reader->pos + sizeof(count) > reader->size))
+    return(-1);
+  memcpy(&count, reader->map + reader->pos, sizeof(count));
+  reader->pos += sizeof(count);
+  reader->scans_left--;
+  reader->time += delta;
+  reader->cells_left = count;
+
+  *time = reader->time;
+  *num_cells = count;
+  return(1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get the next cell of the current scan. The ESSID points in the
+ * mapping, it's valid until iw_hist_unmap().
+ * Return 1 if there is one, 0 at the end of the scan, -1 on corruption.
+ */
+int
+iw_hist_next_cell(iw_hist_reader *	reader,
+		  iw_hist_cell *	cell)
+{
+  iw_hist_bss *	bss;
+  uint64_t	value;
+  uint64_t	idx;
+  int64_t	delta;
+  int		flags;
+
+  if(reader->cells_left == 0)
+    return(0);
+
+  if(iw_hist_get_varint(reader, &value) < 0)
+    return(-1);
+  idx = value >> 2;
+  flags = value & (IW_HIST_DEF | IW_HIST_SIG);
+  if((idx > (uint64_t) reader->dict_num)
+     || ((idx == (uint64_t) reader->dict_num)
+	 && (!(flags & IW_HIST_DEF) || (idx == IW_HIST_MAX_DICT))))
+    return(-1);
+
+  bss = &reader->dict[idx];
+  if(idx == (uint64_t) reader->dict_num)
+    {
+      /* New BSSID number */
+      if(reader->pos + 6 > reader->size)
+	return(-1);
+      bss->bssid = iw_ether_key(reader->map + reader->pos);
+      reader->pos += ETH_ALEN;
+      bss->signal = 0;
+      reader->dict_num++;
+    }
+  if(flags & IW_HIST_DEF)
+    {
+      if((iw_hist_get_varint(reader, &value) < 0)
+	 || (reader->pos >= reader->size))
+	return(-1);
+      bss->freq = value;
+      bss->essid_len = reader->map[reader->pos++];
+      bss->essid = (const char *) reader->map + reader->pos;
+      reader->pos += bss->essid_len;
+      if(reader->pos > reader->size)
+	return(-1);
+    }
+  if(flags & IW_HIST_SIG)
+    {
+      if(iw_hist_get_svarint(reader, &delta) < 0)
+	return(-1);
+      bss->signal += delta;
+    }
+
+  cell->bssid = bss->bssid;
+  cell->freq = bss->freq;
+  cell->essid = bss->essid;
+  cell->essid_len = bss->essid_len;
+  cell->has_signal = (flags & IW_HIST_SIG) != 0;
+  cell->signal = cell->has_signal ? bss->signal : 0;
+  reader->cells_left--;
+  return(1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the mappings.
+ */
+void
+iw_hist_unmap(iw_hist_reader *	reader)
+{
+  if(reader == NULL)
+    return;
+  munmap(reader->map, reader->map_size);
+  if(reader->index != NULL)
+    munmap(reader->index, reader->index_size);
+  free(reader);
+}
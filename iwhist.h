@@ -0,0 +1,177 @@
+/*
+ *	Wireless Tools
+ *
+ * Compact on-disk scan history...
+ *
+ * An append-only log of scans, written through a memory mapping and
+ * read back in place. Scans are grouped in blocks, each block being
+ * self-contained : BSSIDs are coded with a per-block dictionary, scan
+ * times as deltas, and signals as deltas from the previous signal of
+ * the same BSSID, all as varints. A small index of the blocks, in a
+ * separate file, lets readers skip to a time range.
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWHIST_H
+#define IWHIST_H
+
+/***************************** INCLUDES *****************************/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* File identification */
+#define IW_HIST_MAGIC		"IWHIST\0\1"
+#define IW_HIST_BYTE_ORDER	0x01020304	/* Files are in host order */
+#define IW_HIST_BLOCK_MAGIC	0x4B4C4249	/* "IBLK" */
+#define IW_HIST_INDEX_SUFFIX	".idx"
+
+/* Limits */
+#define IW_HIST_BLOCK_SIZE	65536	/* Close blocks above this size */
+#define IW_HIST_MAX_DICT	4096	/* BSSIDs per block */
+#define IW_HIST_DICT_SLACK	1024	/* Room for the cells of a scan */
+#define IW_HIST_MAX_CELLS	65535	/* Cells per scan */
+#define IW_HIST_GROW		(1024 * 1024)	/* File growth step */
+
+/* Largest encoding of a cell */
+#define IW_HIST_CELL_MAX	(5 + 6 + 5 + 1 + 32 + 5)
+
+/****************************** TYPES ******************************/
+
+/* Start of the history file */
+typedef struct iw_hist_header
+{
+  char		magic[8];	/* IW_HIST_MAGIC */
+  uint32_t	byte_order;	/* IW_HIST_BYTE_ORDER */
+  uint32_t	header_size;	/* Offset of the first block */
+  uint64_t	data_end;	/* Committed length of the file */
+  uint64_t	reserved[5];
+} iw_hist_header;
+
+/* Start of each block, blocks are 8 aligned */
+typedef struct iw_hist_block
+{
+  uint32_t	magic;		/* IW_HIST_BLOCK_MAGIC */
+  uint32_t	length;		/* Including this header */
+  int64_t	first_time;	/* ms, base of the time deltas */
+  int64_t	last_time;	/* Latest scan */
+  uint32_t	num_scans;
+  uint32_t	num_bssids;
+} iw_hist_block;
+
+/* Entry of the index file, one per closed block */
+typedef struct iw_hist_index
+{
+  int64_t	first_time;
+  int64_t	last_time;
+  uint64_t	offset;		/* Of the block in the history file */
+} iw_hist_index;
+
+/* A BSSID of the current block */
+typedef struct iw_hist_bss
+{
+  uint64_t	bssid;
+  int		freq;		/* MHz, 0 if unknown */
+  int		signal;		/* Last signal, base of the next delta */
+  int		essid_len;
+  const char *	essid;		/* Reader : in the mapping */
+  char		essid_buf[32];	/* Writer : copy */
+} iw_hist_bss;
+
+/* A cell, as given to the writer or returned by the reader */
+typedef struct iw_hist_cell
+{
+  uint64_t	bssid;		/* See iw_bss_key() */
+  int		freq;		/* MHz, 0 if unknown */
+  int		has_signal;
+  int		signal;		/* dBm */
+  const char *	essid;		/* Not terminated */
+  int		essid_len;
+} iw_hist_cell;
+
+/* Writer. Treat as opaque. */
+typedef struct iw_hist
+{
+  int		fd;
+  int		index_fd;
+  unsigned char *	map;
+  size_t	map_size;
+  iw_hist_header *	header;
+  /* Current block */
+  uint64_t	block;		/* Offset, 0 if none */
+  int64_t	last_time;	/* Of the last scan */
+  size_t	pos;		/* Where the next bytes go */
+  int		dict_num;
+  iw_hist_bss	dict[IW_HIST_MAX_DICT];
+  int16_t	dict_hash[2 * IW_HIST_MAX_DICT];	/* Index + 1 */
+  /* Current scan */
+  size_t	count_pos;	/* Where the number of cells goes */
+  int		num_cells;
+  unsigned long	dropped;	/* Cells that didn't fit */
+} iw_hist;
+
+/* Reader. Treat as opaque. */
+typedef struct iw_hist_reader
+{
+  unsigned char *	map;		/* Read only */
+  size_t		map_size;
+  size_t		size;		/* Committed data */
+  iw_hist_index *	index;
+  int			num_index;
+  size_t		index_size;
+  /* Position */
+  size_t		block;		/* Offset of the current block */
+  size_t		pos;
+  uint32_t		scans_left;	/* In the block */
+  int			live;		/* Last block, maybe still written */
+  int			cells_left;	/* In the scan */
+  int64_t		time;		/* Of the current scan */
+  int			pending;	/* Scan found by iw_hist_seek() */
+  int			dict_num;
+  iw_hist_bss		dict[IW_HIST_MAX_DICT];
+} iw_hist_reader;
+
+/**************************** PROTOTYPES ****************************/
+
+/* Writer */
+iw_hist *
+	iw_hist_open(const char *	path);
+int
+	iw_hist_begin(iw_hist *	hist,
+		      int64_t	time);
+int
+	iw_hist_add(iw_hist *			hist,
+		    const iw_hist_cell *	cell);
+int
+	iw_hist_end(iw_hist *	hist);
+void
+	iw_hist_close(iw_hist *	hist);
+
+/* Reader */
+iw_hist_reader *
+	iw_hist_map(const char *	path);
+int
+	iw_hist_seek(iw_hist_reader *	reader,
+		     int64_t		time);
+int
+	iw_hist_next_scan(iw_hist_reader *	reader,
+			  int64_t *		time,
+			  int *			num_cells);
+int
+	iw_hist_next_cell(iw_hist_reader *	reader,
+			  iw_hist_cell *	cell);
+void
+	iw_hist_unmap(iw_hist_reader *	reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* IWHIST_H */
@@ -12,6 +12,9 @@
 /***************************** INCLUDES *****************************/
 
 #include "iwlib.h"		/* Header */
+#include <limits.h>		/* INT_MIN, INT_MAX */
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>	/* RTM_GETLINK */
 
 /************************ CONSTANTS & MACROS ************************/
 
@@ -90,6 +93,9 @@ union	iw_range_raw
 #define iwr_off(f)	( ((char *) &(((struct iw_range *) NULL)->f)) - \
 			  (char *) NULL)
 
+/* Sequence number of our link dumps, link events have 0 */
+#define IW_LINK_DUMP_SEQ	1
+
 /**************************** VARIABLES ****************************/
 
 /* Modes as human readable strings */
@@ -138,7 +144,8 @@ const struct iw_modul_descr	iw_modul_list[] = {
     "Driver specific modulation (check driver documentation)" },
 };
 
-/* Disable runtime version warning in iw_get_range_info() */
+/* Disable runtime version warning in iw_get_range_info().
+ * Process wide, iw_get_range_info_r() and iw_context don't use it. */
 int	iw_ignore_version = 0;
 
 /************************ SOCKET SUBROUTINES *************************/
@@ -179,6 +186,508 @@ iw_sockets_open(void)
   return -1;
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Tell if an interface from the link dump is wireless, without an
+ * ioctl when its type or kind says it all. With no_probe (already
+ * probed, or the caller doesn't filter), never ask the driver.
+ */
+static int
+iw_link_is_wireless(int			skfd,
+		    const iw_ifinfo *	info,
+		    int			has_wireless,
+		    int			has_kind,
+		    int			no_probe)
+{
+  struct iwreq		wrq;
+
+  /* Only in notifications, but let's take it when it's there */
+  if(has_wireless)
+    return(1);
+
+  switch(info->type)
+    {
+    case ARPHRD_IEEE80211:
+    case ARPHRD_IEEE80211_PRISM:
+    case ARPHRD_IEEE80211_RADIOTAP:
+      return(1);
+    case ARPHRD_ETHER:
+      /* Virtual devices (veth, bridge, vlan...) have a kind, radios
+       * don't. Only the others are worth asking */
+      if(has_kind || no_probe)
+	return(0);
+      return(iw_get_ext(skfd, info->name, SIOCGIWNAME, &wrq) >= 0);
+    default:
+      return(0);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Parse a RTM_NEWLINK. If we already know the interface, as wireless
+ * (known) or not, we don't probe it again (no_probe).
+ * Return -1 if it has no name.
+ */
+static int
+iw_link_parse(int			skfd,
+	      struct nlmsghdr *		nlh,
+	      iw_ifinfo *		info,
+	      const iw_ifinfo *		known,
+	      int			no_probe)
+{
+  struct ifinfomsg *	ifi = NLMSG_DATA(nlh);
+  struct rtattr *	rta;
+  int			len = IFLA_PAYLOAD(nlh);
+  int			has_wireless = 0;
+  int			has_kind = 0;
+
+  memset(info, 0, sizeof(iw_ifinfo));
+  info->ifindex = ifi->ifi_index;
+  info->type = ifi->ifi_type;
+  info->flags = ifi->ifi_flags;
+  for(rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+    switch(rta->rta_type)
+      {
+      case IFLA_IFNAME:
+	strncpy(info->name, RTA_DATA(rta), IFNAMSIZ);
+	break;
+      case IFLA_WIRELESS:
+	has_wireless = 1;
+	break;
+      case IFLA_LINKINFO:
+	{
+	  struct rtattr *	sub;
+	  int			sublen = RTA_PAYLOAD(rta);
+
+	  for(sub = RTA_DATA(rta); RTA_OK(sub, sublen);
+	      sub = RTA_NEXT(sub, sublen))
+	    if(sub->rta_type == IFLA_INFO_KIND)
+	      has_kind = 1;
+	}
+	break;
+      }
+  if(info->name[0] == '\0')
+    return(-1);
+
+  if(known != NULL)
+    info->wireless = known->wireless || has_wireless;
+  else
+    info->wireless = iw_link_is_wireless(skfd, info, has_wireless, has_kind,
+					 no_probe);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add an interface at the end of a list.
+ */
+static int
+iw_ifinfo_append(iw_ifinfo **		plist,
+		 int *			num,
+		 int *			max,
+		 const iw_ifinfo *	info)
+{
+  if(*num == *max)
+    {
+      int		newmax = *max ? 2 * *max : 16;
+      iw_ifinfo *	list = realloc(*plist, newmax * sizeof(iw_ifinfo));
+
+      if(list == NULL)
+	{
+	  fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	  return(-1);
+	}
+      *plist = list;
+      *max = newmax;
+    }
+  (*plist)[(*num)++] = *info;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Ask the kernel for a dump of all the links.
+ */
+static int
+iw_link_dump(int	nlfd)
+{
+  struct
+  {
+    struct nlmsghdr	nlh;
+    struct ifinfomsg	ifi;
+  }			req;
+  struct sockaddr_nl	kernel;
+
+  memset(&req, 0, sizeof(req));
+  req.nlh.nlmsg_len = sizeof(req);
+  req.nlh.nlmsg_type = RTM_GETLINK;
+  req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.nlh.nlmsg_seq = IW_LINK_DUMP_SEQ;
+  req.ifi.ifi_family = AF_UNSPEC;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  return(sendto(nlfd, &req, sizeof(req), 0, (struct sockaddr *) &kernel,
+		sizeof(kernel)));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * List the interfaces with a single rtnetlink dump (RTM_GETLINK).
+ * Unlike /proc/net/dev or SIOCGIFCONF, this gives the index and the
+ * name together, and never truncates. Types and link kinds filter out
+ * most non wireless interfaces without any ioctl. Without
+ * wireless_only, there is no ioctl at all, and the wireless flag of
+ * radios that don't say so in the dump is left unset.
+ * The list must be released with free().
+ * Return the number of interfaces, or -1 (rtnetlink not available).
+ */
+int
+iw_get_ifaces(int		skfd,
+	      int		wireless_only,
+	      iw_ifinfo **	plist)
+{
+  char *		buf;
+  int			size = 16384;
+  iw_ifinfo *		list = NULL;
+  iw_ifinfo		info;
+  int			num = 0;
+  int			max = 0;
+  int			done = 0;
+  int			nlfd;
+
+  *plist = NULL;
+  buf = malloc(size);
+  if(buf == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      return(-1);
+    }
+  nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if(nlfd < 0)
+    {
+      free(buf);
+      return(-1);
+    }
+  if(iw_link_dump(nlfd) < 0)
+    goto fail;
+
+  /* The dump comes in several datagrams, until NLMSG_DONE */
+  while(!done)
+    {
+      struct nlmsghdr *	nlh;
+      int		len;
+
+      /* Make sure the datagram fits, rather than losing its end */
+      len = recv(nlfd, buf, size, MSG_PEEK | MSG_TRUNC);
+      if(len > size)
+	{
+	  char *	newbuf = realloc(buf, len);
+
+	  if(newbuf == NULL)
+	    {
+	      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	      goto fail;
+	    }
+	  buf = newbuf;
+	  size = len;
+	}
+      if(len >= 0)
+	len = recv(nlfd, buf, size, 0);
+      if(len < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  goto fail;
+	}
+      if(len == 0)
+	break;
+      for(nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+	  nlh = NLMSG_NEXT(nlh, len))
+	{
+	  /* Only the answer to our dump */
+	  if(nlh->nlmsg_seq != IW_LINK_DUMP_SEQ)
+	    continue;
+	  if(nlh->nlmsg_type == NLMSG_DONE)
+	    {
+	      done = 1;
+	      break;
+	    }
+	  if(nlh->nlmsg_type == NLMSG_ERROR)
+	    goto fail;
+	  if((nlh->nlmsg_type != RTM_NEWLINK)
+	     || (iw_link_parse(skfd, nlh, &info, NULL, !wireless_only) < 0)
+	     || (wireless_only && !info.wireless))
+	    continue;
+	  if(iw_ifinfo_append(&list, &num, &max, &info) < 0)
+	    goto fail;
+	}
+    }
+
+  close(nlfd);
+  free(buf);
+  *plist = list;
+  return(num);
+
+ fail:
+  close(nlfd);
+  free(buf);
+  free(list);
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find an interface of the tracker by index. NULL if not there.
+ */
+iw_ifinfo *
+iw_iftracker_find(iw_iftracker *	tracker,
+		  int			ifindex)
+{
+  int		i;
+
+  for(i = 0; i < tracker->num; i++)
+    if(tracker->ifaces[i].ifindex == ifindex)
+      return(&tracker->ifaces[i]);
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find an interface the tracker knows is not wireless. -1 if not there.
+ */
+static int
+iw_iftracker_find_wired(iw_iftracker *	tracker,
+			int		ifindex)
+{
+  int		i;
+
+  for(i = 0; i < tracker->num_wired; i++)
+    if(tracker->wired[i] == ifindex)
+      return(i);
+  return(-1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Remember that an interface is not wireless, so that its link events
+ * (carrier changes...) don't probe it again until it goes away.
+ */
+static int
+iw_iftracker_add_wired(iw_iftracker *	tracker,
+		       int		ifindex)
+{
+  if(tracker->num_wired == tracker->max_wired)
+    {
+      int	newmax = tracker->max_wired ? 2 * tracker->max_wired : 16;
+      int *	wired = realloc(tracker->wired, newmax * sizeof(int));
+
+      if(wired == NULL)
+	{
+	  fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	  return(-1);
+	}
+      tracker->wired = wired;
+      tracker->max_wired = newmax;
+    }
+  tracker->wired[tracker->num_wired++] = ifindex;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Apply one link message to the set of wireless interfaces.
+ * Links taken down or up are stamped, but don't change the set.
+ * Return 1 if the set changed (addition, removal, rename), 0 if not,
+ * -1 on allocation failure.
+ */
+static int
+iw_iftracker_msg(iw_iftracker *		tracker,
+		 struct nlmsghdr *	nlh)
+{
+  struct ifinfomsg *	ifi = NLMSG_DATA(nlh);
+  iw_ifinfo *		known = iw_iftracker_find(tracker, ifi->ifi_index);
+  int			wired = iw_iftracker_find_wired(tracker,
+							ifi->ifi_index);
+  iw_ifinfo		info;
+  int			changed;
+
+  if(nlh->nlmsg_type == RTM_DELLINK)
+    {
+      if(wired >= 0)
+	tracker->wired[wired] = tracker->wired[--tracker->num_wired];
+      if(known == NULL)
+	return(0);
+      /* Keep the order, it's the order of appearance */
+      memmove(known, known + 1,
+	      (tracker->ifaces + tracker->num - known - 1) * sizeof(iw_ifinfo));
+      tracker->num--;
+      tracker->generation++;
+      return(1);
+    }
+
+  if((nlh->nlmsg_type != RTM_NEWLINK)
+     || (iw_link_parse(tracker->skfd, nlh, &info, known, wired >= 0) < 0))
+    return(0);
+  if(!info.wireless)
+    {
+      if(wired < 0)
+	return(iw_iftracker_add_wired(tracker, info.ifindex));
+      return(0);
+    }
+
+  if(known != NULL)
+    {
+      /* State change, maybe renamed. Wireless events come this way
+       * too, they don't count */
+      changed = strcmp(known->name, info.name) != 0;
+      info.changed = known->changed;
+      if(changed || (known->type != info.type)
+	 || ((known->flags ^ info.flags) & IFF_UP))
+	info.changed = ++tracker->generation;
+      *known = info;
+      return(changed);
+    }
+
+  info.changed = ++tracker->generation;
+  if(iw_ifinfo_append(&tracker->ifaces, &tracker->num, &tracker->max,
+		      &info) < 0)
+    return(-1);
+  return(1);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Read the link messages, and apply them. With wait, read until the
+ * end of a dump, otherwise only what is pending.
+ * Return the number of changes, -1 on error.
+ */
+static int
+iw_iftracker_read(iw_iftracker *	tracker,
+		  int			wait)
+{
+  char			buf[16384];
+  int			changes = 0;
+  int			ret;
+
+  while(1)
+    {
+      struct nlmsghdr *	nlh;
+      int		len = recv(tracker->fd, buf, sizeof(buf),
+				   wait ? 0 : MSG_DONTWAIT);
+
+      if(len < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(!wait && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+	    return(changes);
+	  return(-1);
+	}
+      if(len == 0)
+	return(changes);
+      for(nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+	  nlh = NLMSG_NEXT(nlh, len))
+	{
+	  if(nlh->nlmsg_type == NLMSG_DONE)
+	    {
+	      if(wait)
+		return(changes);
+	      continue;
+	    }
+	  if(nlh->nlmsg_type == NLMSG_ERROR)
+	    return(-1);
+	  ret = iw_iftracker_msg(tracker, nlh);
+	  if(ret < 0)
+	    return(-1);
+	  changes += ret;
+	}
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Start over from a fresh dump, when we may have missed events.
+ */
+static int
+iw_iftracker_sync(iw_iftracker *	tracker)
+{
+  /* Indexes of links we missed the removal of may be reused */
+  tracker->num = 0;
+  tracker->num_wired = 0;
+  tracker->generation++;
+  if(iw_link_dump(tracker->fd) < 0)
+    return(-1);
+  if(iw_iftracker_read(tracker, 1) < 0)
+    return(-1);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Start tracking the wireless interfaces : subscribe to the link
+ * events, and get the current set with a dump. skfd is used to probe
+ * the new interfaces. The tracker must be zeroed before use.
+ * Return -1 if rtnetlink is not available.
+ */
+int
+iw_iftracker_open(iw_iftracker *	tracker,
+		  int			skfd)
+{
+  struct sockaddr_nl	local;
+
+  tracker->skfd = skfd;
+  tracker->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if(tracker->fd < 0)
+    return(-1);
+
+  memset(&local, 0, sizeof(local));
+  local.nl_family = AF_NETLINK;
+  local.nl_groups = RTMGRP_LINK;
+  if((bind(tracker->fd, (struct sockaddr *) &local, sizeof(local)) < 0)
+     || (iw_iftracker_sync(tracker) < 0))
+    {
+      iw_iftracker_close(tracker);
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Apply the pending link events, without blocking. Call it when
+ * tracker->fd is readable.
+ * Return the number of changes to the set, -1 on error.
+ */
+int
+iw_iftracker_update(iw_iftracker *	tracker)
+{
+  int		changes = iw_iftracker_read(tracker, 0);
+
+  /* The socket overflowed, we lost events */
+  if((changes < 0) && (errno == ENOBUFS))
+    {
+      if(iw_iftracker_sync(tracker) < 0)
+	return(-1);
+      return(1);
+    }
+  return(changes);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Stop tracking.
+ */
+void
+iw_iftracker_close(iw_iftracker *	tracker)
+{
+  if(tracker->fd >= 0)
+    close(tracker->fd);
+  free(tracker->ifaces);
+  free(tracker->wired);
+  memset(tracker, 0, sizeof(iw_iftracker));
+  tracker->fd = -1;
+}
+
 /*------------------------------------------------------------------*/
 /*
  * Extract the interface name out of /proc/net/wireless or /proc/net/dev.
@@ -221,6 +730,7 @@ iw_get_ifname(char *	name,	/* Where to store the name */
 /*------------------------------------------------------------------*/
 /*
  * Enumerate devices and call specified routine
+ * The newest way is a rtnetlink dump (see iw_get_ifaces()).
  * The new way just use /proc/net/wireless, so get all wireless interfaces,
  * whether configured or not. This is the default if available.
  * The old way use SIOCGIFCONF, so get only configured interfaces (wireless
@@ -236,8 +746,24 @@ iw_enum_devices(int		skfd,
   FILE *	fh;
   struct ifconf ifc;
   struct ifreq *ifr;
+  iw_ifinfo *	list;
+  int		num;
   int		i;
 
+  /* One request for all of them */
+#ifndef IW_RESTRIC_ENUM
+  num = iw_get_ifaces(skfd, 0, &list);
+#else
+  num = iw_get_ifaces(skfd, 1, &list);
+#endif
+  if(num >= 0)
+    {
+      for(i = 0; i < num; i++)
+	(*fn)(skfd, list[i].name, args, count);
+      free(list);
+      return;
+    }
+
 #ifndef IW_RESTRIC_ENUM
   /* Check if /proc/net/dev is available */
   fh = fopen(PROC_NET_DEV, "r");
@@ -464,11 +990,14 @@ iw_print_version_info(const char *	toolname)
 /*------------------------------------------------------------------*/
 /*
  * Get the range information out of the driver
+ * Reentrant : the version warnings are given once per *warned, which
+ * belongs to the caller, and not at all if warned is NULL.
  */
 int
-iw_get_range_info(int		skfd,
-		  const char *	ifname,
-		  iwrange *	range)
+iw_get_range_info_r(int			skfd,
+		    const char *	ifname,
+		    iwrange *		range,
+		    int *		warned)
 {
   struct iwreq		wrq;
   char			buffer[sizeof(iwrange) * 2];	/* Large enough */
@@ -543,7 +1072,7 @@ iw_get_range_info(int		skfd,
   /* We are now checking much less than we used to do, because we can
    * accomodate more WE version. But, there are still cases where things
    * will break... */
-  if(!iw_ignore_version)
+  if((warned != NULL) && !*warned)
     {
       /* We don't like very old version (unfortunately kernel 2.2.X) */
       if(range->we_version_compiled <= 10)
@@ -578,11 +1107,26 @@ iw_get_range_info(int		skfd,
   /* Don't complain twice.
    * In theory, the test apply to each individual driver, but usually
    * all drivers are compiled from the same kernel. */
-  iw_ignore_version = 1;
+  if(warned != NULL)
+    *warned = 1;
 
   return(0);
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Get the range information out of the driver
+ * Warns only once per process, through iw_ignore_version : threads
+ * should use iw_get_range_info_r() or an iw_context instead.
+ */
+int
+iw_get_range_info(int		skfd,
+		  const char *	ifname,
+		  iwrange *	range)
+{
+  return(iw_get_range_info_r(skfd, ifname, range, &iw_ignore_version));
+}
+
 /*------------------------------------------------------------------*/
 /*
  * Get information about what private ioctls are supported by the driver
@@ -652,6 +1196,23 @@ iw_get_priv_info(int		skfd,
   return(-1);
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Do a request of the basic config, through the capabilities of the
+ * interface if we have them.
+ */
+static int
+iw_config_ext(int		skfd,
+	      const char *	ifname,
+	      iw_capa *		capa,
+	      int		request,
+	      struct iwreq *	pwrq)
+{
+  if(capa != NULL)
+    return(iw_capa_ext(skfd, capa, request, pwrq));
+  return(iw_get_ext(skfd, ifname, request, pwrq));
+}
+
 /*------------------------------------------------------------------*/
 /*
  * Get essential wireless config from the device driver
@@ -659,18 +1220,22 @@ iw_get_priv_info(int		skfd,
  * the socket to know what is supported and to get the settings...
  * Note : compare to the version in iwconfig, we extract only
  * what's *really* needed to configure a device...
+ * With capa, the requests the driver doesn't support are skipped.
  */
-int
-iw_get_basic_config(int			skfd,
+static int
+iw_basic_config_get(int			skfd,
 		    const char *	ifname,
+		    iw_capa *		capa,
 		    wireless_config *	info)
 {
   struct iwreq		wrq;
 
   memset((char *) info, 0, sizeof(struct wireless_config));
 
-  /* Get wireless name */
-  if(iw_get_ext(skfd, ifname, SIOCGIWNAME, &wrq) < 0)
+  /* Get wireless name, the probe did it already */
+  if(capa != NULL)
+    strcpy(info->name, capa->protocol);
+  else if(iw_get_ext(skfd, ifname, SIOCGIWNAME, &wrq) < 0)
     /* If no wireless name : no wireless extensions */
     return(-1);
   else
@@ -680,14 +1245,14 @@ iw_get_basic_config(int			skfd,
     }
 
   /* Get network ID */
-  if(iw_get_ext(skfd, ifname, SIOCGIWNWID, &wrq) >= 0)
+  if(iw_config_ext(skfd, ifname, capa, SIOCGIWNWID, &wrq) >= 0)
     {
       info->has_nwid = 1;
       memcpy(&(info->nwid), &(wrq.u.nwid), sizeof(iwparam));
     }
 
   /* Get frequency / channel */
-  if(iw_get_ext(skfd, ifname, SIOCGIWFREQ, &wrq) >= 0)
+  if(iw_config_ext(skfd, ifname, capa, SIOCGIWFREQ, &wrq) >= 0)
     {
       info->has_freq = 1;
       info->freq = iw_freq2float(&(wrq.u.freq));
@@ -698,7 +1263,7 @@ iw_get_basic_config(int			skfd,
   wrq.u.data.pointer = (caddr_t) info->key;
   wrq.u.data.length = IW_ENCODING_TOKEN_MAX;
   wrq.u.data.flags = 0;
-  if(iw_get_ext(skfd, ifname, SIOCGIWENCODE, &wrq) >= 0)
+  if(iw_config_ext(skfd, ifname, capa, SIOCGIWENCODE, &wrq) >= 0)
     {
       info->has_key = 1;
       info->key_size = wrq.u.data.length;
@@ -709,14 +1274,14 @@ iw_get_basic_config(int			skfd,
   wrq.u.essid.pointer = (caddr_t) info->essid;
   wrq.u.essid.length = IW_ESSID_MAX_SIZE + 1;
   wrq.u.essid.flags = 0;
-  if(iw_get_ext(skfd, ifname, SIOCGIWESSID, &wrq) >= 0)
+  if(iw_config_ext(skfd, ifname, capa, SIOCGIWESSID, &wrq) >= 0)
     {
       info->has_essid = 1;
       info->essid_on = wrq.u.data.flags;
     }
 
   /* Get operation mode */
-  if(iw_get_ext(skfd, ifname, SIOCGIWMODE, &wrq) >= 0)
+  if(iw_config_ext(skfd, ifname, capa, SIOCGIWMODE, &wrq) >= 0)
     {
       info->has_mode = 1;
       /* Note : event->u.mode is unsigned, no need to check <= 0 */
@@ -726,27 +1291,50 @@ iw_get_basic_config(int			skfd,
 	info->mode = IW_NUM_OPER_MODE;	/* Unknown/bug */
     }
 
+  /* The interface went away after the probe */
+  if((capa != NULL) && !capa->probed)
+    return(-1);
   return(0);
 }
 
 /*------------------------------------------------------------------*/
 /*
- * Set essential wireless config in the device driver
- * We will call all the classical wireless ioctl on the driver through
- * the socket to know what is supported and to set the settings...
- * We support only the restricted set as above...
+ * Get essential wireless config from the device driver
  */
 int
-iw_set_basic_config(int			skfd,
+iw_get_basic_config(int			skfd,
 		    const char *	ifname,
 		    wireless_config *	info)
 {
-  struct iwreq		wrq;
-  int			ret = 0;
+  return(iw_basic_config_get(skfd, ifname, NULL, info));
+}
 
-  /* Get wireless name (check if interface is valid) */
-  if(iw_get_ext(skfd, ifname, SIOCGIWNAME, &wrq) < 0)
-    /* If no wireless name : no wireless extensions */
+/*------------------------------------------------------------------*/
+/*
+ * Set essential wireless config in the device driver
+ * We will call all the classical wireless ioctl on the driver through
+ * the socket to know what is supported and to set the settings...
+ * We support only the restricted set as above...
+ * With capa, the interface was checked by the probe, and the kernel
+ * version is read only once for the cache.
+ * The settings that failed are reported in failed (IW_CONFIG_XXX).
+ */
+static int
+iw_basic_config_set(int			skfd,
+		    const char *	ifname,
+		    iw_capa *		capa,
+		    iw_capa_cache *	cache,
+		    wireless_config *	info,
+		    unsigned int *	failed)
+{
+  struct iwreq		wrq;
+  int			ret = 0;
+
+  *failed = 0;
+
+  /* Get wireless name (check if interface is valid) */
+  if((capa == NULL) && (iw_get_ext(skfd, ifname, SIOCGIWNAME, &wrq) < 0))
+    /* If no wireless name : no wireless extensions */
     return(-2);
 
   /* Set the current mode of operation
@@ -758,9 +1346,10 @@ iw_set_basic_config(int			skfd,
       strncpy(wrq.ifr_name, ifname, IFNAMSIZ);
       wrq.u.mode = info->mode;
 
-      if(iw_get_ext(skfd, ifname, SIOCSIWMODE, &wrq) < 0)
+      if(iw_config_ext(skfd, ifname, capa, SIOCSIWMODE, &wrq) < 0)
 	{
 	  fprintf(stderr, "SIOCSIWMODE: %s\n", strerror(errno));
+	  *failed |= IW_CONFIG_MODE;
 	  ret = -1;
 	}
     }
@@ -770,9 +1359,10 @@ iw_set_basic_config(int			skfd,
     {
       iw_float2freq(info->freq, &(wrq.u.freq));
 
-      if(iw_set_ext(skfd, ifname, SIOCSIWFREQ, &wrq) < 0)
+      if(iw_config_ext(skfd, ifname, capa, SIOCSIWFREQ, &wrq) < 0)
 	{
 	  fprintf(stderr, "SIOCSIWFREQ: %s\n", strerror(errno));
+	  *failed |= IW_CONFIG_FREQ;
 	  ret = -1;
 	}
     }
@@ -790,10 +1380,11 @@ iw_set_basic_config(int			skfd,
 	  wrq.u.data.flags = (flags & (IW_ENCODE_INDEX)) | IW_ENCODE_NOKEY;
 	  wrq.u.data.length = 0;
 
-	  if(iw_set_ext(skfd, ifname, SIOCSIWENCODE, &wrq) < 0)
+	  if(iw_config_ext(skfd, ifname, capa, SIOCSIWENCODE, &wrq) < 0)
 	    {
 	      fprintf(stderr, "SIOCSIWENCODE(%d): %s\n",
 		      errno, strerror(errno));
+	      *failed |= IW_CONFIG_KEY;
 	      ret = -1;
 	    }
 	}
@@ -810,10 +1401,11 @@ iw_set_basic_config(int			skfd,
       if(flags & IW_ENCODE_NOKEY)
 	wrq.u.data.pointer = NULL;
 
-      if(iw_set_ext(skfd, ifname, SIOCSIWENCODE, &wrq) < 0)
+      if(iw_config_ext(skfd, ifname, capa, SIOCSIWENCODE, &wrq) < 0)
 	{
 	  fprintf(stderr, "SIOCSIWENCODE(%d): %s\n",
 		  errno, strerror(errno));
+	  *failed |= IW_CONFIG_KEY;
 	  ret = -1;
 	}
     }
@@ -824,9 +1416,10 @@ iw_set_basic_config(int			skfd,
       memcpy(&(wrq.u.nwid), &(info->nwid), sizeof(iwparam));
       wrq.u.nwid.fixed = 1;	/* Hum... When in Rome... */
 
-      if(iw_set_ext(skfd, ifname, SIOCSIWNWID, &wrq) < 0)
+      if(iw_config_ext(skfd, ifname, capa, SIOCSIWNWID, &wrq) < 0)
 	{
 	  fprintf(stderr, "SIOCSIWNWID: %s\n", strerror(errno));
+	  *failed |= IW_CONFIG_NWID;
 	  ret = -1;
 	}
     }
@@ -839,7 +1432,11 @@ iw_set_basic_config(int			skfd,
   if(info->has_essid)
     {
       int		we_kernel_version;
-      we_kernel_version = iw_get_kernel_we_version();
+
+      if(cache != NULL)
+	we_kernel_version = iw_capa_kernel_we_version(cache);
+      else
+	we_kernel_version = iw_get_kernel_we_version();
 
       wrq.u.essid.pointer = (caddr_t) info->essid;
       wrq.u.essid.length = strlen(info->essid);
@@ -847,9 +1444,10 @@ iw_set_basic_config(int			skfd,
       if(we_kernel_version < 21)
 	wrq.u.essid.length++;
 
-      if(iw_set_ext(skfd, ifname, SIOCSIWESSID, &wrq) < 0)
+      if(iw_config_ext(skfd, ifname, capa, SIOCSIWESSID, &wrq) < 0)
 	{
 	  fprintf(stderr, "SIOCSIWESSID: %s\n", strerror(errno));
+	  *failed |= IW_CONFIG_ESSID;
 	  ret = -1;
 	}
     }
@@ -857,6 +1455,517 @@ iw_set_basic_config(int			skfd,
   return(ret);
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Set essential wireless config in the device driver
+ */
+int
+iw_set_basic_config(int			skfd,
+		    const char *	ifname,
+		    wireless_config *	info)
+{
+  unsigned int	failed;
+
+  return(iw_basic_config_set(skfd, ifname, NULL, NULL, info, &failed));
+}
+
+/********************** CAPABILITY SUBROUTINES **********************/
+/*
+ * Drivers implement only part of the requests : mac80211 has no NWID
+ * for example. Trying them again and again, as periodic config audits
+ * do, only costs syscalls. The capabilities of an interface are
+ * probed once, and the requests that failed with EOPNOTSUPP are not
+ * tried anymore. Other errors (interface down...) are not recorded.
+ */
+
+/*------------------------------------------------------------------*/
+/*
+ * Forget the private ioctls of an interface.
+ */
+static void
+iw_capa_priv_free(iw_capa *	capa)
+{
+  free(capa->priv);
+  free(capa->priv_hash);
+  capa->priv = NULL;
+  capa->priv_hash = NULL;
+  capa->num_priv = 0;
+  capa->has_priv = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Probe an interface : its protocol name and its WE version.
+ */
+static int
+iw_capa_probe(int		skfd,
+	      iw_capa *		capa)
+{
+  struct iwreq		wrq;
+  iwrange		range;
+
+  memset(capa->unsupported, 0, sizeof(capa->unsupported));
+  iw_capa_priv_free(capa);
+  if(iw_get_ext(skfd, capa->name, SIOCGIWNAME, &wrq) < 0)
+    return(-1);
+  strncpy(capa->protocol, wrq.u.name, IFNAMSIZ);
+  capa->protocol[IFNAMSIZ] = '\0';
+
+  /* Drivers without range are pre WE-10 */
+  /* Quiet, the version is what we are after */
+  if(iw_get_range_info_r(skfd, capa->name, &range, NULL) >= 0)
+    capa->we_version = range.we_version_compiled;
+  else
+    capa->we_version = -1;
+  capa->probed = 1;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get the capabilities of an interface, probing it the first time.
+ * Return NULL if it has no Wireless Extensions.
+ */
+iw_capa *
+iw_capa_get(int			skfd,
+	    iw_capa_cache *	cache,
+	    const char *	ifname)
+{
+  iw_capa *	capa = NULL;
+  int		i;
+
+  for(i = 0; i < cache->num; i++)
+    if(!strncmp(cache->entries[i]->name, ifname, IFNAMSIZ))
+      {
+	capa = cache->entries[i];
+	break;
+      }
+
+  if(capa == NULL)
+    {
+      if(cache->num == cache->max)
+	{
+	  int		newmax = cache->max ? 2 * cache->max : 8;
+	  iw_capa **	entries = realloc(cache->entries,
+					  newmax * sizeof(iw_capa *));
+
+	  if(entries == NULL)
+	    {
+	      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	      return(NULL);
+	    }
+	  cache->entries = entries;
+	  cache->max = newmax;
+	}
+      capa = calloc(1, sizeof(iw_capa));
+      if(capa == NULL)
+	{
+	  fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	  return(NULL);
+	}
+      strncpy(capa->name, ifname, IFNAMSIZ);
+      cache->entries[cache->num++] = capa;
+    }
+
+  /* Failed probes are tried again, the interface may come later */
+  if(!capa->probed && (iw_capa_probe(skfd, capa) < 0))
+    return(NULL);
+  return(capa);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Do a request (get or set) on an interface, unless we know the
+ * driver doesn't support it in the current mode, in which case it
+ * fails with EOPNOTSUPP without asking the driver.
+ */
+int
+iw_capa_ext(int			skfd,
+	    iw_capa *		capa,
+	    int			request,
+	    struct iwreq *	pwrq)
+{
+  unsigned int	bit = request - SIOCIWFIRST;
+  int		ret;
+
+  if((bit <= SIOCIWLAST - SIOCIWFIRST)
+     && (capa->unsupported[bit / 32] & (1U << (bit % 32))))
+    {
+      errno = EOPNOTSUPP;
+      return(-1);
+    }
+
+  ret = iw_get_ext(skfd, capa->name, request, pwrq);
+  if(ret < 0)
+    {
+      if((errno == EOPNOTSUPP) && (bit <= SIOCIWLAST - SIOCIWFIRST))
+	capa->unsupported[bit / 32] |= 1U << (bit % 32);
+      /* Gone, it may be another driver when it comes back */
+      if(errno == ENODEV)
+	capa->probed = 0;
+    }
+  /* With cfg80211, what is supported depends on the mode (no key in
+   * master mode, no frequency in AP mode...), so start over */
+  else if(request == SIOCSIWMODE)
+    memset(capa->unsupported, 0, sizeof(capa->unsupported));
+  return(ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Hash of a private ioctl name (FNV-1a).
+ */
+static unsigned int
+iw_capa_priv_key(const char *	name)
+{
+  unsigned int	h = 2166136261U;
+  int		i;
+
+  for(i = 0; (i < IFNAMSIZ) && name[i]; i++)
+    h = (h ^ (unsigned char) name[i]) * 16777619U;
+  return(h);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get the private ioctls of an interface, from the driver only the
+ * first time, even if it has none. The table belongs to the cache :
+ * it is released when the interface is invalidated, or probed again
+ * after the driver went away (ENODEV in iw_capa_ext()), so get it
+ * again after either.
+ * Return the number of private ioctls, -1 if the driver has none.
+ */
+int
+iw_capa_priv(int			skfd,
+	     iw_capa *			capa,
+	     const iwprivargs **	ppriv)
+{
+  iwprivargs *	priv;
+  unsigned int	size = 1;
+  int		num;
+  int		i;
+
+  if(!capa->has_priv)
+    {
+      num = iw_get_priv_info(skfd, capa->name, &priv);
+      if(num < 0)
+	{
+	  /* mac80211 has none, don't ask every time */
+	  if(errno == ENODEV)
+	    capa->probed = 0;
+	  else
+	    {
+	      capa->num_priv = -1;
+	      capa->has_priv = 1;
+	    }
+	  return(-1);
+	}
+
+      /* Keep the hash at most half full */
+      while(size < 2 * (unsigned int) num)
+	size <<= 1;
+      capa->priv_hash = calloc(size, sizeof(int));
+      if(capa->priv_hash == NULL)
+	{
+	  fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	  free(priv);
+	  return(-1);
+	}
+      capa->priv = priv;
+      capa->num_priv = num;
+      capa->priv_mask = size - 1;
+      for(i = 0; i < num; i++)
+	{
+	  unsigned int	slot = iw_capa_priv_key(priv[i].name) & capa->priv_mask;
+
+	  /* The first of duplicates wins, like in iwpriv */
+	  while(capa->priv_hash[slot]
+		&& strncmp(priv[capa->priv_hash[slot] - 1].name, priv[i].name,
+			   IFNAMSIZ))
+	    slot = (slot + 1) & capa->priv_mask;
+	  if(!capa->priv_hash[slot])
+	    capa->priv_hash[slot] = i + 1;
+	}
+      capa->has_priv = 1;
+    }
+
+  if(ppriv != NULL)
+    *ppriv = capa->priv;
+  if(capa->num_priv < 0)
+    errno = EOPNOTSUPP;
+  return(capa->num_priv);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find a private ioctl of an interface by name, without asking the
+ * driver after the first time. NULL if the driver doesn't have it.
+ * Valid as long as the table, see iw_capa_priv().
+ */
+const iwprivargs *
+iw_capa_priv_find(int		skfd,
+		  iw_capa *	capa,
+		  const char *	name)
+{
+  unsigned int	slot;
+
+  if((iw_capa_priv(skfd, capa, NULL) <= 0) || (name == NULL))
+    return(NULL);
+
+  slot = iw_capa_priv_key(name) & capa->priv_mask;
+  while(capa->priv_hash[slot])
+    {
+      const iwprivargs *	priv = &capa->priv[capa->priv_hash[slot] - 1];
+
+      if(!strncmp(priv->name, name, IFNAMSIZ))
+	return(priv);
+      slot = (slot + 1) & capa->priv_mask;
+    }
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * WE version of the kernel, read from /proc/net/wireless only once.
+ */
+int
+iw_capa_kernel_we_version(iw_capa_cache *	cache)
+{
+  if(cache->we_kernel <= 0)
+    cache->we_kernel = iw_get_kernel_we_version();
+  return(cache->we_kernel);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Forget the capabilities of an interface, or of all of them (ifname
+ * NULL), for example when the driver was reloaded.
+ */
+void
+iw_capa_invalidate(iw_capa_cache *	cache,
+		   const char *		ifname)
+{
+  int		i = 0;
+
+  while(i < cache->num)
+    if((ifname == NULL)
+       || !strncmp(cache->entries[i]->name, ifname, IFNAMSIZ))
+      {
+	iw_capa_priv_free(cache->entries[i]);
+	free(cache->entries[i]);
+	cache->entries[i] = cache->entries[--cache->num];
+      }
+    else
+      i++;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the cache.
+ */
+void
+iw_capa_free(iw_capa_cache *	cache)
+{
+  iw_capa_invalidate(cache, NULL);
+  free(cache->entries);
+  memset(cache, 0, sizeof(iw_capa_cache));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Like iw_get_basic_config(), without the requests the driver doesn't
+ * support : after the first call, only the supported ones are done.
+ */
+int
+iw_capa_get_basic_config(int			skfd,
+			 iw_capa_cache *	cache,
+			 const char *		ifname,
+			 wireless_config *	info)
+{
+  iw_capa *	capa = iw_capa_get(skfd, cache, ifname);
+
+  if(capa == NULL)
+    {
+      memset((char *) info, 0, sizeof(struct wireless_config));
+      return(-1);
+    }
+  return(iw_basic_config_get(skfd, ifname, capa, info));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Like iw_set_basic_config(), without checking the interface or
+ * reading the kernel version each time. Settings the driver doesn't
+ * support fail right away.
+ */
+int
+iw_capa_set_basic_config(int			skfd,
+			 iw_capa_cache *	cache,
+			 const char *		ifname,
+			 wireless_config *	info)
+{
+  iw_capa *	capa = iw_capa_get(skfd, cache, ifname);
+  unsigned int	failed;
+
+  if(capa == NULL)
+    return(-2);
+  return(iw_basic_config_set(skfd, ifname, capa, cache, info, &failed));
+}
+
+/******************** BATCH CONFIG SUBROUTINES ********************/
+/*
+ * Pushing the same config to many interfaces, most of them already
+ * have it. Setting it again is not harmless : setting the ESSID makes
+ * most drivers scan and associate again, which is an outage of
+ * seconds. So the current config is read first, and only what differs
+ * is set, in the usual order (mode first, ESSID last).
+ */
+
+/*------------------------------------------------------------------*/
+/*
+ * Tell if the frequency of the driver is the one we want. Either may
+ * be a channel, in which case the 802.11 channels are used.
+ */
+static int
+iw_config_same_freq(double	want,
+		    double	cur)
+{
+  if((want < KILO) && (cur < KILO))
+    return((int) want == (int) cur);
+  if((want >= KILO) && (cur >= KILO))
+    return(fabs(want - cur) < KILO);
+  if(want < KILO)
+    return((int) want == iw_mhz_to_channel((int) ((cur + MEGA / 2) / MEGA)));
+  return((int) cur == iw_mhz_to_channel((int) ((want + MEGA / 2) / MEGA)));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Tell if the key of the driver is the one we want. When the driver
+ * doesn't give the key away, we can't know, so it's set.
+ */
+static int
+iw_config_same_key(const wireless_config *	want,
+		   const wireless_config *	cur)
+{
+  int		mask = IW_ENCODE_DISABLED | IW_ENCODE_RESTRICTED
+		       | IW_ENCODE_OPEN;
+
+  /* Index 0 is the current key, whatever it is */
+  if(want->key_flags & IW_ENCODE_INDEX)
+    mask |= IW_ENCODE_INDEX;
+  if((want->key_flags ^ cur->key_flags) & mask)
+    return(0);
+  if(want->key_flags & IW_ENCODE_DISABLED)
+    return(1);
+  if((want->key_flags & IW_ENCODE_NOKEY) || (cur->key_flags & IW_ENCODE_NOKEY))
+    return(0);
+  return((want->key_size == cur->key_size)
+	 && !memcmp(want->key, cur->key, want->key_size));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Settings of want that the driver doesn't have yet (IW_CONFIG_XXX).
+ */
+static unsigned int
+iw_config_diff(const wireless_config *	want,
+	       const wireless_config *	cur)
+{
+  unsigned int	diff = 0;
+
+  if(want->has_mode && (!cur->has_mode || (want->mode != cur->mode)))
+    diff |= IW_CONFIG_MODE;
+  if(want->has_freq
+     && (!cur->has_freq || !iw_config_same_freq(want->freq, cur->freq)))
+    diff |= IW_CONFIG_FREQ;
+  if(want->has_key && (!cur->has_key || !iw_config_same_key(want, cur)))
+    diff |= IW_CONFIG_KEY;
+  if(want->has_nwid
+     && (!cur->has_nwid || (want->nwid.disabled != cur->nwid.disabled)
+	 || (!want->nwid.disabled && (want->nwid.value != cur->nwid.value))))
+    diff |= IW_CONFIG_NWID;
+  if(want->has_essid
+     && (!cur->has_essid || (!want->essid_on != !cur->essid_on)
+	 || strncmp(want->essid, cur->essid, IW_ESSID_MAX_SIZE)))
+    diff |= IW_CONFIG_ESSID;
+  return(diff);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Apply a config to many interfaces, setting only what differs from
+ * their current config. The capabilities (cache) avoid probing the
+ * interfaces again from one push to the next, it may be NULL.
+ * For each interface, apply[i].changed tells what was set, and
+ * apply[i].failed what couldn't be.
+ * Return 0 if all the interfaces have their config, -1 otherwise.
+ */
+int
+iw_apply_basic_config(int			skfd,
+		      iw_capa_cache *		cache,
+		      iw_config_apply *		apply,
+		      int			num)
+{
+  wireless_config	cur;
+  wireless_config	delta;
+  iw_capa *		capa;
+  iw_capa		local;
+  int			ret = 0;
+  int			i;
+
+  for(i = 0; i < num; i++)
+    {
+      const char *	ifname = apply[i].ifname;
+      unsigned int	diff;
+
+      apply[i].changed = 0;
+      apply[i].failed = 0;
+
+      /* One read of the current config per interface */
+      capa = NULL;
+      if(cache != NULL)
+	capa = iw_capa_get(skfd, cache, ifname);
+      if(((cache != NULL) && (capa == NULL))
+	 || (iw_basic_config_get(skfd, ifname, capa, &cur) < 0))
+	{
+	  apply[i].status = -2;
+	  ret = -1;
+	  continue;
+	}
+
+      diff = iw_config_diff(apply[i].want, &cur);
+      if(diff == 0)
+	{
+	  apply[i].status = 0;
+	  continue;
+	}
+
+      /* Only the settings that differ */
+      delta = *apply[i].want;
+      delta.has_mode = (diff & IW_CONFIG_MODE) != 0;
+      delta.has_freq = (diff & IW_CONFIG_FREQ) != 0;
+      delta.has_key = (diff & IW_CONFIG_KEY) != 0;
+      delta.has_nwid = (diff & IW_CONFIG_NWID) != 0;
+      delta.has_essid = (diff & IW_CONFIG_ESSID) != 0;
+
+      /* The interface was just checked by the read */
+      if(capa == NULL)
+	{
+	  memset(&local, 0, sizeof(iw_capa));
+	  strncpy(local.name, ifname, IFNAMSIZ);
+	  local.probed = 1;
+	  capa = &local;
+	}
+      apply[i].status = iw_basic_config_set(skfd, ifname, capa, cache,
+					    &delta, &apply[i].failed);
+      apply[i].changed = diff & ~apply[i].failed;
+      if(apply[i].status < 0)
+	ret = -1;
+    }
+  return(ret);
+}
+
 /*********************** PROTOCOL SUBROUTINES ***********************/
 /*
  * Fun stuff with protocol identifiers (SIOCGIWNAME).
@@ -1120,6 +2229,36 @@ iw_channel_to_freq(int				channel,
   return(-2);
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Convert a frequency in MHz to an IEEE 802.11 channel, using the
+ * channel starting frequencies of the standard. For drivers whose
+ * range doesn't list the frequency, typically 6 GHz with older
+ * drivers.
+ * Return -1 if it's not a channel centre of 2.4, 4.9, 5 or 6 GHz.
+ */
+int
+iw_mhz_to_channel(int	mhz)
+{
+  /* 2.4 GHz, channel 14 is the odd one */
+  if(mhz == 2484)
+    return(14);
+  if((mhz >= 2412) && (mhz <= 2472) && !((mhz - 2407) % 5))
+    return((mhz - 2407) / 5);
+  /* 4.9 GHz, public safety and Japan */
+  if((mhz >= 4910) && (mhz <= 4980) && !(mhz % 5))
+    return((mhz - 4000) / 5);
+  /* 5 GHz */
+  if((mhz > 5000) && (mhz < 5925) && !(mhz % 5))
+    return((mhz - 5000) / 5);
+  /* 6 GHz (802.11ax), channel 2 is out of the grid */
+  if(mhz == 5935)
+    return(2);
+  if((mhz >= 5955) && (mhz <= 7115) && !((mhz - 5950) % 5))
+    return((mhz - 5950) / 5);
+  return(-1);
+}
+
 /*********************** BITRATE SUBROUTINES ***********************/
 
 /*------------------------------------------------------------------*/
@@ -1255,26 +2394,154 @@ iw_print_txpower(char *			buffer,
 
 /*------------------------------------------------------------------*/
 /*
- * Read /proc/net/wireless to get the latest statistics
- * Note : strtok not thread safe, not used in WE-12 and later.
+ * Parse a number of a /proc/net/wireless line, in base 10 or 16.
+ * The kernel prints a '.' after the quality values that were updated,
+ * it's reported in *dot.
+ * Return -1 if there is no number.
  */
-int
-iw_get_stats(int		skfd,
-	     const char *	ifname,
-	     iwstats *		stats,
-	     const iwrange *	range,
-	     int		has_range)
+static int
+iw_proc_number(char **		pp,
+	       const char *	end,
+	       int		base,
+	       int *		value,
+	       int *		dot)
 {
-  /* Fortunately, we can always detect this condition properly */
-  if((has_range) && (range->we_version_compiled > 11))
+  char *	p = *pp;
+  int		neg = 0;
+  int		digits = 0;
+  int		v = 0;
+
+  while((p < end) && (*p == ' '))
+    p++;
+  if((p < end) && (*p == '-'))
     {
-      struct iwreq		wrq;
-      wrq.u.data.pointer = (caddr_t) stats;
-      wrq.u.data.length = sizeof(struct iw_statistics);
-      wrq.u.data.flags = 1;		/* Clear updated flag */
-      strncpy(wrq.ifr_name, ifname, IFNAMSIZ);
-      if(iw_get_ext(skfd, ifname, SIOCGIWSTATS, &wrq) < 0)
-	return(-1);
+      neg = 1;
+      p++;
+    }
+  while(p < end)
+    {
+      int	d;
+
+      if((*p >= '0') && (*p <= '9'))
+	d = *p - '0';
+      else if((base == 16) && (*p >= 'a') && (*p <= 'f'))
+	d = *p - 'a' + 10;
+      else if((base == 16) && (*p >= 'A') && (*p <= 'F'))
+	d = *p - 'A' + 10;
+      else
+	break;
+      /* Saturate rather than overflow on garbage */
+      v = (v > (INT_MAX - d) / base) ? INT_MAX : v * base + d;
+      digits++;
+      p++;
+    }
+  if(!digits)
+    return(-1);
+  if(dot != NULL)
+    {
+      *dot = (p < end) && (*p == '.');
+      if(*dot)
+	p++;
+    }
+  *value = neg ? -v : v;
+  *pp = p;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Parse a line of /proc/net/wireless, in place, without strtok().
+ * line points to the start of the line, end to its '\n'.
+ * Return 0 and the interface name (in the line, not terminated) if
+ * it's an interface line, -1 for the headers.
+ */
+static int
+iw_proc_wireless_line(char *		line,
+		      char *		end,
+		      char **		pname,
+		      int *		namelen,
+		      iwstats *		stats)
+{
+  char *	p = line;
+  char *	colon;
+  int		disc[6];
+  int		num_disc;
+  int		t;
+  int		dot;
+
+  while((p < end) && (*p == ' '))
+    p++;
+  colon = memchr(p, ':', end - p);
+  if((colon == NULL) || (colon == p))
+    return(-1);
+  *pname = p;
+  *namelen = colon - p;
+  p = colon + 1;
+
+  memset(stats, 0, sizeof(iwstats));
+  /* -- status -- */
+  if(iw_proc_number(&p, end, 16, &t, NULL) < 0)
+    return(-1);
+  stats->status = (unsigned short) t;
+  /* -- link quality, signal and noise level -- */
+  if(iw_proc_number(&p, end, 10, &t, &dot) < 0)
+    return(-1);
+  stats->qual.qual = (unsigned char) t;
+  stats->qual.updated |= dot ? 1 : 0;
+  if(iw_proc_number(&p, end, 10, &t, &dot) < 0)
+    return(-1);
+  stats->qual.level = (unsigned char) t;
+  stats->qual.updated |= dot ? 2 : 0;
+  if(iw_proc_number(&p, end, 10, &t, &dot) < 0)
+    return(-1);
+  stats->qual.noise = (unsigned char) t;
+  stats->qual.updated |= dot ? 4 : 0;
+  /* -- discarded packets, missed beacons -- */
+  for(num_disc = 0; num_disc < 6; num_disc++)
+    if(iw_proc_number(&p, end, 10, &disc[num_disc], NULL) < 0)
+      break;
+  if(num_disc < 5)
+    {
+      /* Before WE-12 : nwid, crypt, misc */
+      stats->discard.nwid = (num_disc > 0) ? disc[0] : 0;
+      stats->discard.code = (num_disc > 1) ? disc[1] : 0;
+      stats->discard.misc = (num_disc > 2) ? disc[2] : 0;
+    }
+  else
+    {
+      stats->discard.nwid = disc[0];
+      stats->discard.code = disc[1];
+      stats->discard.fragment = disc[2];
+      stats->discard.retries = disc[3];
+      stats->discard.misc = disc[4];
+      stats->miss.beacon = (num_disc > 5) ? disc[5] : 0;
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Read /proc/net/wireless to get the latest statistics
+ * Note : only used before WE-12. To follow many interfaces, the
+ * sampler below reads all of them at once.
+ */
+int
+iw_get_stats(int		skfd,
+	     const char *	ifname,
+	     iwstats *		stats,
+	     const iwrange *	range,
+	     int		has_range)
+{
+  /* Fortunately, we can always detect this condition properly */
+  if((has_range) && (range->we_version_compiled > 11))
+    {
+      struct iwreq		wrq;
+      wrq.u.data.pointer = (caddr_t) stats;
+      wrq.u.data.length = sizeof(struct iw_statistics);
+      wrq.u.data.flags = 1;		/* Clear updated flag */
+      strncpy(wrq.ifr_name, ifname, IFNAMSIZ);
+      if(iw_get_ext(skfd, ifname, SIOCGIWSTATS, &wrq) < 0)
+	return(-1);
 
       /* Format has not changed since WE-12, no conversion */
       return(0);
@@ -1283,52 +2550,21 @@ iw_get_stats(int		skfd,
     {
       FILE *	f = fopen(PROC_NET_WIRELESS, "r");
       char	buf[256];
-      char *	bp;
-      int	t;
+      char *	name;
+      int	namelen;
+      int	len = strlen(ifname);
 
       if(f==NULL)
 	return -1;
       /* Loop on all devices */
       while(fgets(buf,255,f))
 	{
-	  bp=buf;
-	  while(*bp&&isspace(*bp))
-	    bp++;
+	  char *	end = buf + strlen(buf);
+
 	  /* Is it the good device ? */
-	  if(strncmp(bp,ifname,strlen(ifname))==0 && bp[strlen(ifname)]==':')
+	  if((iw_proc_wireless_line(buf, end, &name, &namelen, stats) == 0)
+	     && (namelen == len) && !strncmp(name, ifname, len))
 	    {
-	      /* Skip ethX: */
-	      bp=strchr(bp,':');
-	      bp++;
-	      /* -- status -- */
-	      bp = strtok(bp, " ");
-	      sscanf(bp, "%X", &t);
-	      stats->status = (unsigned short) t;
-	      /* -- link quality -- */
-	      bp = strtok(NULL, " ");
-	      if(strchr(bp,'.') != NULL)
-		stats->qual.updated |= 1;
-	      sscanf(bp, "%d", &t);
-	      stats->qual.qual = (unsigned char) t;
-	      /* -- signal level -- */
-	      bp = strtok(NULL, " ");
-	      if(strchr(bp,'.') != NULL)
-		stats->qual.updated |= 2;
-	      sscanf(bp, "%d", &t);
-	      stats->qual.level = (unsigned char) t;
-	      /* -- noise level -- */
-	      bp = strtok(NULL, " ");
-	      if(strchr(bp,'.') != NULL)
-		stats->qual.updated += 4;
-	      sscanf(bp, "%d", &t);
-	      stats->qual.noise = (unsigned char) t;
-	      /* -- discarded packets -- */
-	      bp = strtok(NULL, " ");
-	      sscanf(bp, "%d", &stats->discard.nwid);
-	      bp = strtok(NULL, " ");
-	      sscanf(bp, "%d", &stats->discard.code);
-	      bp = strtok(NULL, " ");
-	      sscanf(bp, "%d", &stats->discard.misc);
 	      fclose(f);
 	      /* No conversion needed */
 	      return 0;
@@ -1339,6 +2575,92 @@ iw_get_stats(int		skfd,
     }
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Start sampling /proc/net/wireless. The file is kept open, and each
+ * sample is a single pread() of the whole file.
+ */
+int
+iw_stats_sampler_open(iw_stats_sampler *	sampler)
+{
+  sampler->num = 0;
+  sampler->fd = open(PROC_NET_WIRELESS, O_RDONLY | O_CLOEXEC);
+  return((sampler->fd < 0) ? -1 : 0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Take a sample of the statistics of all the interfaces, in one pass.
+ * Interfaces that don't fit in the sampler are ignored.
+ * Return the number of interfaces, -1 on error.
+ */
+int
+iw_stats_sampler_read(iw_stats_sampler *	sampler)
+{
+  char *	p = sampler->buf;
+  char *	end;
+  ssize_t	len;
+
+  do
+    len = pread(sampler->fd, sampler->buf, sizeof(sampler->buf), 0);
+  while((len < 0) && (errno == EINTR));
+  if(len < 0)
+    return(-1);
+  end = sampler->buf + len;
+
+  sampler->num = 0;
+  while((p < end) && (sampler->num < IW_STATS_SAMPLER_MAX))
+    {
+      iw_stats_sample *	sample = &sampler->samples[sampler->num];
+      char *		eol = memchr(p, '\n', end - p);
+      char *		name;
+      int		namelen;
+
+      /* A line cut by the end of the buffer is dropped */
+      if(eol == NULL)
+	break;
+      if((iw_proc_wireless_line(p, eol, &name, &namelen,
+				&sample->stats) == 0)
+	 && (namelen <= IFNAMSIZ))
+	{
+	  memcpy(sample->name, name, namelen);
+	  sample->name[namelen] = '\0';
+	  sampler->num++;
+	}
+      p = eol + 1;
+    }
+  return(sampler->num);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find an interface in the last sample. NULL if not there.
+ */
+const iwstats *
+iw_stats_sampler_find(const iw_stats_sampler *	sampler,
+		      const char *		ifname)
+{
+  int		i;
+
+  for(i = 0; i < sampler->num; i++)
+    if(!strncmp(sampler->samples[i].name, ifname, IFNAMSIZ))
+      return(&sampler->samples[i].stats);
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Stop sampling.
+ */
+void
+iw_stats_sampler_close(iw_stats_sampler *	sampler)
+{
+  if(sampler->fd >= 0)
+    close(sampler->fd);
+  sampler->fd = -1;
+  sampler->num = 0;
+}
+
 /*------------------------------------------------------------------*/
 /*
  * Output the link statistics, taking care of formating
@@ -1351,6 +2673,9 @@ iw_print_stats(char *		buffer,
 	       int		has_range)
 {
   int		len;
+  int		mask;
+  int		dblevel;
+  int		dbnoise;
 
   /* People are very often confused by the 8 bit arithmetic happening
    * here.
@@ -1398,82 +2723,57 @@ iw_print_stats(char *		buffer,
 	  buflen -= len;
 	}
 
-      /* Check if the statistics are in RCPI (IEEE 802.11k) */
-      if(qual->updated & IW_QUAL_RCPI)
+      /* Signal and noise in dBm, RCPI (IEEE 802.11k) or not */
+      mask = iw_qual_dbm(qual, range, has_range, &dblevel, &dbnoise);
+
+      /* Deal with signal level in dBm (absolute power measurement) */
+      if(mask & IW_DBM_LEVEL)
+	{
+	  /* RCPI has half dB steps, iw_qual_dbm() rounds them down */
+	  if(qual->updated & IW_QUAL_RCPI)
+	    len = snprintf(buffer, buflen, "Signal level%c%g dBm  ",
+			   qual->updated & IW_QUAL_LEVEL_UPDATED ? '=' : ':',
+			   (qual->level / 2.0) - 110.0);
+	  else
+	    len = snprintf(buffer, buflen, "Signal level%c%d dBm  ",
+			   qual->updated & IW_QUAL_LEVEL_UPDATED ? '=' : ':',
+			   dblevel);
+	  buffer += len;
+	  buflen -= len;
+	}
+
+      /* Deal with noise level in dBm (absolute power measurement) */
+      if(mask & IW_DBM_NOISE)
+	{
+	  if(qual->updated & IW_QUAL_RCPI)
+	    snprintf(buffer, buflen, "Noise level%c%g dBm",
+		     qual->updated & IW_QUAL_NOISE_UPDATED ? '=' : ':',
+		     (qual->noise / 2.0) - 110.0);
+	  else
+	    snprintf(buffer, buflen, "Noise level%c%d dBm",
+		     qual->updated & IW_QUAL_NOISE_UPDATED ? '=' : ':',
+		     dbnoise);
+	}
+
+      /* Nothing in dBm : relative values (0 -> max). If both values
+       * are invalid, there is nothing to print either way. */
+      if(!mask)
 	{
-	  /* Deal with signal level in RCPI */
-	  /* RCPI = int{(Power in dBm +110)*2} for 0dbm > Power > -110dBm */
+	  /* Deal with signal level as relative value (0 -> max) */
 	  if(!(qual->updated & IW_QUAL_LEVEL_INVALID))
 	    {
-	      double	rcpilevel = (qual->level / 2.0) - 110.0;
-	      len = snprintf(buffer, buflen, "Signal level%c%g dBm  ",
+	      len = snprintf(buffer, buflen, "Signal level%c%d/%d  ",
 			     qual->updated & IW_QUAL_LEVEL_UPDATED ? '=' : ':',
-			     rcpilevel);
+			     qual->level, range->max_qual.level);
 	      buffer += len;
 	      buflen -= len;
 	    }
 
-	  /* Deal with noise level in dBm (absolute power measurement) */
+	  /* Deal with noise level as relative value (0 -> max) */
 	  if(!(qual->updated & IW_QUAL_NOISE_INVALID))
-	    {
-	      double	rcpinoise = (qual->noise / 2.0) - 110.0;
-	      len = snprintf(buffer, buflen, "Noise level%c%g dBm",
-			     qual->updated & IW_QUAL_NOISE_UPDATED ? '=' : ':',
-			     rcpinoise);
-	    }
-	}
-      else
-	{
-	  /* Check if the statistics are in dBm */
-	  if((qual->updated & IW_QUAL_DBM)
-	     || (qual->level > range->max_qual.level))
-	    {
-	      /* Deal with signal level in dBm  (absolute power measurement) */
-	      if(!(qual->updated & IW_QUAL_LEVEL_INVALID))
-		{
-		  int	dblevel = qual->level;
-		  /* Implement a range for dBm [-192; 63] */
-		  if(qual->level >= 64)
-		    dblevel -= 0x100;
-		  len = snprintf(buffer, buflen, "Signal level%c%d dBm  ",
-				 qual->updated & IW_QUAL_LEVEL_UPDATED ? '=' : ':',
-				 dblevel);
-		  buffer += len;
-		  buflen -= len;
-		}
-
-	      /* Deal with noise level in dBm (absolute power measurement) */
-	      if(!(qual->updated & IW_QUAL_NOISE_INVALID))
-		{
-		  int	dbnoise = qual->noise;
-		  /* Implement a range for dBm [-192; 63] */
-		  if(qual->noise >= 64)
-		    dbnoise -= 0x100;
-		  len = snprintf(buffer, buflen, "Noise level%c%d dBm",
-				 qual->updated & IW_QUAL_NOISE_UPDATED ? '=' : ':',
-				 dbnoise);
-		}
-	    }
-	  else
-	    {
-	      /* Deal with signal level as relative value (0 -> max) */
-	      if(!(qual->updated & IW_QUAL_LEVEL_INVALID))
-		{
-		  len = snprintf(buffer, buflen, "Signal level%c%d/%d  ",
-				 qual->updated & IW_QUAL_LEVEL_UPDATED ? '=' : ':',
-				 qual->level, range->max_qual.level);
-		  buffer += len;
-		  buflen -= len;
-		}
-
-	      /* Deal with noise level as relative value (0 -> max) */
-	      if(!(qual->updated & IW_QUAL_NOISE_INVALID))
-		{
-		  len = snprintf(buffer, buflen, "Noise level%c%d/%d",
-				 qual->updated & IW_QUAL_NOISE_UPDATED ? '=' : ':',
-				 qual->noise, range->max_qual.noise);
-		}
-	    }
+	    snprintf(buffer, buflen, "Noise level%c%d/%d",
+		     qual->updated & IW_QUAL_NOISE_UPDATED ? '=' : ':',
+		     qual->noise, range->max_qual.noise);
 	}
     }
   else
@@ -1485,6 +2785,60 @@ iw_print_stats(char *		buffer,
     }
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Convert the signal and noise levels to dBm, following the same rules
+ * as iw_print_stats() above.
+ * Return a mask of IW_DBM_LEVEL and IW_DBM_NOISE telling which values
+ * could be converted, 0 if the values are relative or unknown.
+ */
+int
+iw_qual_dbm(const iwqual *	qual,
+	    const iwrange *	range,
+	    int			has_range,
+	    int *		plevel,
+	    int *		pnoise)
+{
+  int		mask = 0;
+
+  /* Same detection as iw_print_stats() */
+  if(!has_range || ((qual->level == 0)
+		    && !(qual->updated & (IW_QUAL_DBM | IW_QUAL_RCPI))))
+    return(0);
+
+  if(qual->updated & IW_QUAL_RCPI)
+    {
+      /* RCPI = int{(Power in dBm +110)*2}, round down to the dB */
+      if(!(qual->updated & IW_QUAL_LEVEL_INVALID))
+	{
+	  *plevel = (qual->level >> 1) - 110;
+	  mask |= IW_DBM_LEVEL;
+	}
+      if(!(qual->updated & IW_QUAL_NOISE_INVALID))
+	{
+	  *pnoise = (qual->noise >> 1) - 110;
+	  mask |= IW_DBM_NOISE;
+	}
+    }
+  else if((qual->updated & IW_QUAL_DBM)
+	  || (qual->level > range->max_qual.level))
+    {
+      /* Implement a range for dBm [-192; 63] */
+      if(!(qual->updated & IW_QUAL_LEVEL_INVALID))
+	{
+	  *plevel = (qual->level >= 64) ? qual->level - 0x100 : qual->level;
+	  mask |= IW_DBM_LEVEL;
+	}
+      if(!(qual->updated & IW_QUAL_NOISE_INVALID))
+	{
+	  *pnoise = (qual->noise >= 64) ? qual->noise - 0x100 : qual->noise;
+	  mask |= IW_DBM_NOISE;
+	}
+    }
+
+  return(mask);
+}
+
 /*********************** ENCODING SUBROUTINES ***********************/
 
 /*------------------------------------------------------------------*/
@@ -1684,7 +3038,7 @@ iw_in_key_full(int		skfd,
       *p = '\0';
 
       /* Extract range info */
-      if(iw_get_range_info(skfd, ifname, &range) < 0)
+      if(iw_get_range_info_r(skfd, ifname, &range, NULL) < 0)
 	/* Hum... Maybe we should return an error ??? */
 	memset(&range, 0, sizeof(range));
 
@@ -1696,7 +3050,7 @@ iw_in_key_full(int		skfd,
 	  if((*flags & IW_ENCODE_INDEX) == 0)
 	    {
 	      /* Extract range info */
-	      if(iw_get_range_info(skfd, ifname, &range) < 0)
+	      if(iw_get_range_info_r(skfd, ifname, &range, NULL) < 0)
 		memset(&range, 0, sizeof(range));
 	      printf("flags = %X, index = %X\n", *flags, range.encoding_login_index);
 	      /* Set the index the driver expects */
@@ -2185,12 +3539,18 @@ iw_ether_aton(const char *orig, struct ether_addr *eth)
 /*------------------------------------------------------------------*/
 /*
  * Input an Internet address and convert to binary.
+ * Reentrant, the resolver results are not shared between threads.
  */
 int
 iw_in_inet(char *name, struct sockaddr *sap)
 {
-  struct hostent *hp;
+  struct netent net;
   struct netent *np;
+  struct addrinfo hints;
+  struct addrinfo *ai;
+  char buf[1024];
+  int herr;
+  int ret;
   struct sockaddr_in *sain = (struct sockaddr_in *) sap;
 
   /* Grmpf. -FvK */
@@ -2204,19 +3564,29 @@ iw_in_inet(char *name, struct sockaddr *sap)
   }
 
   /* Try the NETWORKS database to see if this is a known network. */
-  if ((np = getnetbyname(name)) != (struct netent *)NULL) {
+  if ((getnetbyname_r(name, &net, buf, sizeof(buf), &np, &herr) == 0)
+      && (np != (struct netent *)NULL)) {
 	sain->sin_addr.s_addr = htonl(np->n_net);
 	strcpy(name, np->n_name);
 	return(1);
   }
 
   /* Always use the resolver (DNS name + IP addresses) */
-  if ((hp = gethostbyname(name)) == (struct hostent *)NULL) {
-	errno = h_errno;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_CANONNAME;
+  if ((ret = getaddrinfo(name, NULL, &hints, &ai)) != 0) {
+	if (ret != EAI_SYSTEM)
+	  errno = (ret == EAI_NONAME) ? HOST_NOT_FOUND : TRY_AGAIN;
 	return(-1);
   }
-  memcpy((char *) &sain->sin_addr, (char *) hp->h_addr_list[0], hp->h_length);
-  strcpy(name, hp->h_name);
+  memcpy((char *) &sain->sin_addr,
+	 (char *) &((struct sockaddr_in *) ai->ai_addr)->sin_addr,
+	 sizeof(struct in_addr));
+  if (ai->ai_canonname != NULL)
+	strcpy(name, ai->ai_canonname);
+  freeaddrinfo(ai);
   return(0);
 }
 
@@ -2334,6 +3704,109 @@ iw_get_priv_size(int	args)
   return(num * priv_type_size[type]);
 }
 
+/************************ ARENA SUBROUTINES ************************/
+/*
+ * A simple bump allocator, for objects that live and die together,
+ * such as the results of a scan. Allocating is just moving a pointer,
+ * and everything is released in one go, so we don't fragment the heap
+ * of long running programs with many small objects.
+ * The arena can be reset and reused : after a reset, all the memory
+ * ends up in a single block, so that a similar workload doesn't need
+ * to touch the heap at all.
+ */
+
+/* Size of the block header, keeping allocations aligned */
+#define IW_ARENA_HDR	((sizeof(iw_arena_block) + IW_ARENA_ALIGN - 1) \
+			 & ~(IW_ARENA_ALIGN - 1))
+
+/*------------------------------------------------------------------*/
+/*
+ * Allocate size bytes from the arena.
+ * The memory is not zeroed. Return NULL on failure.
+ */
+void *
+iw_arena_alloc(iw_arena *	arena,
+	       size_t		size)
+{
+  iw_arena_block *	block = arena->blocks;
+  void *		ptr;
+
+  size = (size + IW_ARENA_ALIGN - 1) & ~(IW_ARENA_ALIGN - 1);
+
+  /* Need a new block ? Make them bigger and bigger */
+  if((block == NULL) || (block->used + size > block->size))
+    {
+      size_t	bsize = block ? 2 * block->size : IW_ARENA_MIN_BLOCK;
+
+      if(bsize < size)
+	bsize = size;
+      block = malloc(IW_ARENA_HDR + bsize);
+      if(block == NULL)
+	return(NULL);
+      block->next = arena->blocks;
+      block->size = bsize;
+      block->used = 0;
+      arena->blocks = block;
+      arena->total += bsize;
+    }
+
+  ptr = (char *) block + IW_ARENA_HDR + block->used;
+  block->used += size;
+  return(ptr);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Forget all allocations, but keep the memory for reuse.
+ * If the last use needed several blocks, replace them by a single
+ * block large enough for all of them.
+ */
+void
+iw_arena_reset(iw_arena *	arena)
+{
+  iw_arena_block *	block = arena->blocks;
+
+  if(block == NULL)
+    return;
+
+  if(block->next != NULL)
+    {
+      size_t	total = arena->total;
+
+      iw_arena_release(arena);
+      block = malloc(IW_ARENA_HDR + total);
+      /* Not fatal, blocks are allocated on demand */
+      if(block == NULL)
+	return;
+      block->next = NULL;
+      block->size = total;
+      arena->blocks = block;
+      arena->total = total;
+    }
+  block->used = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release all the memory of the arena.
+ * The arena is empty and can be used again afterwards.
+ */
+void
+iw_arena_release(iw_arena *	arena)
+{
+  iw_arena_block *	block = arena->blocks;
+  iw_arena_block *	next;
+
+  while(block != NULL)
+    {
+      next = block->next;
+      free(block);
+      block = next;
+    }
+  arena->blocks = NULL;
+  arena->total = 0;
+}
+
 /************************ EVENT SUBROUTINES ************************/
 /*
  * The Wireless Extension API 14 and greater define Wireless Events,
@@ -2940,26 +4413,15 @@ iw_extract_event_stream(struct stream_descr *	stream,	/* Stream of events */
 /*
  * Process/store one element from the scanning results in wireless_scan
  */
-static inline struct wireless_scan *
+static inline void
 iw_process_scanning_token(struct iw_event *		event,
 			  struct wireless_scan *	wscan)
 {
-  struct wireless_scan *	oldwscan;
-
   /* Now, let's decode the event */
   switch(event->cmd)
     {
     case SIOCGIWAP:
-      /* New cell description. Allocate new cell descriptor, zero it. */
-      oldwscan = wscan;
-      wscan = (struct wireless_scan *) malloc(sizeof(struct wireless_scan));
-      if(wscan == NULL)
-	return(wscan);
-      /* Link at the end of the list */
-      if(oldwscan != NULL)
-	oldwscan->next = wscan;
-
-      /* Reset it */
+      /* New cell description. Reset the cell descriptor. */
       bzero(wscan, sizeof(struct wireless_scan));
 
       /* Save cell identifier */
@@ -3015,40 +4477,32 @@ iw_process_scanning_token(struct iw_event *		event,
     default:
       break;
    }	/* switch(event->cmd) */
-
-  return(wscan);
 }
 
 /*------------------------------------------------------------------*/
 /*
- * Initiate the scan procedure, and process results.
- * This is a non-blocking procedure and it will return each time
- * it would block, returning the amount of time the caller should wait
- * before calling again.
- * Return -1 for error, delay to wait for (in ms), or 0 for success.
- * Error code is in errno
+ * Common start of the non-blocking scan procedures : initiate the
+ * scan on the first call, give up after too many retries.
+ * Return a delay to wait for (in ms), -1 for error, or 0 if it's time
+ * to read the results.
  */
-int
-iw_process_scan(int			skfd,
-		char *			ifname,
-		int			we_version,
-		wireless_scan_head *	context)
+static int
+iw_scan_start(int		skfd,
+	      char *		ifname,
+	      int *		retry)
 {
   struct iwreq		wrq;
-  unsigned char *	buffer = NULL;		/* Results */
-  int			buflen = IW_SCAN_MAX_DATA; /* Min for compat WE<17 */
-  unsigned char *	newbuf;
 
   /* Don't waste too much time on interfaces (150 * 100 = 15s) */
-  context->retry++;
-  if(context->retry > 150)
+  (*retry)++;
+  if(*retry > 150)
     {
       errno = ETIME;
       return(-1);
     }
 
   /* If we have not yet initiated scanning on the interface */
-  if(context->retry == 1)
+  if(*retry == 1)
     {
       /* Initiate Scan */
       wrq.u.data.pointer = NULL;		/* Later */
@@ -3061,51 +4515,155 @@ iw_process_scan(int			skfd,
       /* Success : now, just wait for event or results */
       return(250);	/* Wait 250 ms */
     }
+  return(0);
+}
 
- realloc:
-  /* (Re)allocate the buffer - realloc(NULL, len) == malloc(len) */
-  newbuf = realloc(buffer, buflen);
-  if(newbuf == NULL)
-    {
-      /* man says : If realloc() fails the original block is left untouched */
-      if(buffer)
-	free(buffer);
-      errno = ENOMEM;
-      return(-1);
-    }
-  buffer = newbuf;
+/*------------------------------------------------------------------*/
+/*
+ * Decode the raw scan results into at most max_cells cells.
+ * Elements before the first cell are ignored.
+ * Return the number of cells in the results, which may be more
+ * than max_cells.
+ */
+static int
+iw_scan_decode(unsigned char *		buffer,
+	       int			buflen,
+	       int			we_version,
+	       struct wireless_scan *	cells,
+	       int			max_cells)
+{
+  struct iw_event		iwe;
+  struct stream_descr	stream;
+  struct wireless_scan *	wscan = NULL;
+  int			n = 0;
 
-  /* Try to read the results */
-  wrq.u.data.pointer = buffer;
-  wrq.u.data.flags = 0;
-  wrq.u.data.length = buflen;
-  if(iw_get_ext(skfd, ifname, SIOCGIWSCAN, &wrq) < 0)
+  iw_init_event_stream(&stream, (char *) buffer, buflen);
+  while(iw_extract_event_stream(&stream, &iwe, we_version) > 0)
     {
-      /* Check if buffer was too small (WE-17 only) */
-      if((errno == E2BIG) && (we_version > 16))
-	{
-	  /* Some driver may return very large scan results, either
-	   * because there are many cells, or because they have many
-	   * large elements in cells (like IWEVCUSTOM). Most will
-	   * only need the regular sized buffer. We now use a dynamic
-	   * allocation of the buffer to satisfy everybody. Of course,
-	   * as we don't know in advance the size of the array, we try
-	   * various increasing sizes. Jean II */
+      /* New cell, if we have room for it */
+      if(iwe.cmd == SIOCGIWAP)
+	wscan = (n++ < max_cells) ? &cells[n - 1] : NULL;
+      /* Convert to wireless_scan struct */
+      if(wscan != NULL)
+	iw_process_scanning_token(&iwe, wscan);
+    }
+  return(n);
+}
 
-	  /* Check if the driver gave us any hints. */
-	  if(wrq.u.data.length > buflen)
-	    buflen = wrq.u.data.length;
-	  else
-	    buflen *= 2;
+/*------------------------------------------------------------------*/
+/*
+ * Chain the cells in array order, for users of the linked list.
+ * Return the head of the list.
+ */
+static struct wireless_scan *
+iw_scan_chain(struct wireless_scan *	cells,
+	      int			num)
+{
+  int		i;
 
-	  /* Try again */
-	  goto realloc;
-	}
+  for(i = 0; i < num; i++)
+    cells[i].next = (i + 1 < num) ? &cells[i + 1] : NULL;
+  return(num ? cells : NULL);
+}
 
-      /* Check if results not available yet */
-      if(errno == EAGAIN)
-	{
-	  free(buffer);
+/*------------------------------------------------------------------*/
+/*
+ * Prepare a scan context for first use.
+ * Must not be called on a context holding results, they would leak.
+ */
+void
+iw_scan_init(wireless_scan_head *	context)
+{
+  memset(context, 0, sizeof(wireless_scan_head));
+  context->magic = IW_SCAN_HEAD_MAGIC;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Make sure a scan context was initialised before touching its arena.
+ * Callers written before the arena only set the fields they used, so
+ * a context without the magic is stack garbage (or zeroed) : start it
+ * afresh.
+ */
+static inline void
+iw_scan_check(wireless_scan_head *	context)
+{
+  if(context->magic != IW_SCAN_HEAD_MAGIC)
+    iw_scan_init(context);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Initiate the scan procedure, and process results.
+ * This is a non-blocking procedure and it will return each time
+ * it would block, returning the amount of time the caller should wait
+ * before calling again.
+ * Return -1 for error, delay to wait for (in ms), or 0 for success.
+ * Error code is in errno
+ */
+int
+iw_process_scan(int			skfd,
+		char *			ifname,
+		int			we_version,
+		wireless_scan_head *	context)
+{
+  struct iwreq		wrq;
+  unsigned char *	buffer = NULL;		/* Results */
+  int			buflen = IW_SCAN_MAX_DATA; /* Min for compat WE<17 */
+  unsigned char *	newbuf;
+  int			delay;
+
+  iw_scan_check(context);
+
+  /* Initiate the scan, or wait for it */
+  delay = iw_scan_start(skfd, ifname, &context->retry);
+  if(delay != 0)
+    return(delay);
+
+ realloc:
+  /* (Re)allocate the buffer - realloc(NULL, len) == malloc(len) */
+  newbuf = realloc(buffer, buflen);
+  if(newbuf == NULL)
+    {
+      /* man says : If realloc() fails the original block is left untouched */
+      if(buffer)
+	free(buffer);
+      errno = ENOMEM;
+      return(-1);
+    }
+  buffer = newbuf;
+
+  /* Try to read the results */
+  wrq.u.data.pointer = buffer;
+  wrq.u.data.flags = 0;
+  wrq.u.data.length = buflen;
+  if(iw_get_ext(skfd, ifname, SIOCGIWSCAN, &wrq) < 0)
+    {
+      /* Check if buffer was too small (WE-17 only) */
+      if((errno == E2BIG) && (we_version > 16))
+	{
+	  /* Some driver may return very large scan results, either
+	   * because there are many cells, or because they have many
+	   * large elements in cells (like IWEVCUSTOM). Most will
+	   * only need the regular sized buffer. We now use a dynamic
+	   * allocation of the buffer to satisfy everybody. Of course,
+	   * as we don't know in advance the size of the array, we try
+	   * various increasing sizes. Jean II */
+
+	  /* Check if the driver gave us any hints. */
+	  if(wrq.u.data.length > buflen)
+	    buflen = wrq.u.data.length;
+	  else
+	    buflen *= 2;
+
+	  /* Try again */
+	  goto realloc;
+	}
+
+      /* Check if results not available yet */
+      if(errno == EAGAIN)
+	{
+	  free(buffer);
 	  /* Wait for only 100ms from now on */
 	  return(100);	/* Wait 100 ms */
 	}
@@ -3115,13 +4673,17 @@ iw_process_scan(int			skfd,
       return(-1);
     }
 
+  /* Recycle the storage of the previous results */
+  iw_arena_reset(&context->arena);
+  context->result = NULL;
+  context->cells = NULL;
+  context->num_cells = 0;
+  context->sorted = IW_SCAN_SORT_NONE;
+
   /* We have the results, process them */
   if(wrq.u.data.length)
     {
-      struct iw_event		iwe;
-      struct stream_descr	stream;
-      struct wireless_scan *	wscan = NULL;
-      int			ret;
+      int	count;
 #ifdef DEBUG
       /* Debugging code. In theory useless, because it's debugged ;-) */
       int	i;
@@ -3131,33 +4693,22 @@ iw_process_scan(int			skfd,
       printf("]\n");
 #endif
 
-      /* Init */
-      iw_init_event_stream(&stream, (char *) buffer, wrq.u.data.length);
-      /* This is dangerous, we may leak user data... */
-      context->result = NULL;
-
-      /* Look every token */
-      do
+      /* Count the cells, so that they can be stored contiguously */
+      count = iw_scan_decode(buffer, wrq.u.data.length, we_version, NULL, 0);
+      if(count > 0)
 	{
-	  /* Extract an event and print it */
-	  ret = iw_extract_event_stream(&stream, &iwe, we_version);
-	  if(ret > 0)
+	  context->cells = iw_arena_alloc(&context->arena,
+					  count * sizeof(struct wireless_scan));
+	  if(context->cells == NULL)
 	    {
-	      /* Convert to wireless_scan struct */
-	      wscan = iw_process_scanning_token(&iwe, wscan);
-	      /* Check problems */
-	      if(wscan == NULL)
-		{
-		  free(buffer);
-		  errno = ENOMEM;
-		  return(-1);
-		}
-	      /* Save head of list */
-	      if(context->result == NULL)
-		context->result = wscan;
+	      free(buffer);
+	      errno = ENOMEM;
+	      return(-1);
 	    }
 	}
-      while(ret > 0);
+      context->num_cells = iw_scan_decode(buffer, wrq.u.data.length,
+					  we_version, context->cells, count);
+      context->result = iw_scan_chain(context->cells, context->num_cells);
     }
 
   /* Done with this interface - return success */
@@ -3171,8 +4722,13 @@ iw_process_scan(int			skfd,
  * This is a blocking procedure and it will when the scan is completed
  * or when an error occur.
  *
- * The scan results are given in a linked list of wireless_scan objects.
- * The caller *must* free the result himself (by walking the list).
+ * The scan results are given as an array of wireless_scan objects
+ * (context->cells, context->num_cells). For compatibility, they are
+ * also chained in a linked list starting at context->result.
+ * They are allocated in the context and remain valid until the next
+ * scan with the same context. Set the context up with iw_scan_init()
+ * before first use, and release it with iw_scan_free() when done.
+ * Don't free() the cells, they belong to the context.
  * If there is an error, -1 is returned and the error code is available
  * in errno.
  *
@@ -3191,8 +4747,12 @@ iw_scan(int			skfd,
 {
   int		delay;		/* in ms */
 
-  /* Clean up context. Potential memory leak if(context.result != NULL) */
+  iw_scan_check(context);
+
+  /* Clean up context. Previous results are recycled by the next scan */
   context->result = NULL;
+  context->cells = NULL;
+  context->num_cells = 0;
   context->retry = 0;
 
   /* Wait until we get results or error */
@@ -3212,3 +4772,1110 @@ iw_scan(int			skfd,
   /* End - return -1 or 0 */
   return(delay);
 }
+
+/*------------------------------------------------------------------*/
+/*
+ * Same as iw_process_scan(), but using only the storage provided by
+ * the caller in the context, so that memory use is bounded and known
+ * in advance.
+ * If the raw buffer is too small, -1 is returned with errno set to
+ * E2BIG, and raw_needed is set to the size requested by the driver
+ * (0 if it didn't say). If there are more cells than max_cells, only
+ * the first ones are decoded, and total_cells tells how many there are.
+ * Return -1 for error, delay to wait for (in ms), or 0 for success.
+ */
+int
+iw_process_scan_static(int			skfd,
+		       char *			ifname,
+		       int			we_version,
+		       wireless_scan_static *	context)
+{
+  struct iwreq		wrq;
+  int			delay;
+
+  /* Initiate the scan, or wait for it */
+  delay = iw_scan_start(skfd, ifname, &context->retry);
+  if(delay != 0)
+    return(delay);
+
+  context->result = NULL;
+  context->num_cells = 0;
+  context->total_cells = 0;
+  context->raw_used = 0;
+  context->raw_needed = 0;
+  context->truncated = 0;
+
+  /* Try to read the results */
+  wrq.u.data.pointer = context->raw;
+  wrq.u.data.flags = 0;
+  wrq.u.data.length = context->raw_len;
+  if(iw_get_ext(skfd, ifname, SIOCGIWSCAN, &wrq) < 0)
+    {
+      /* Check if results not available yet */
+      if(errno == EAGAIN)
+	return(100);	/* Wait 100 ms */
+
+      /* Buffer too small (WE-17 only), we can't grow it */
+      if((errno == E2BIG) && (we_version > 16))
+	{
+	  context->truncated |= IW_SCAN_TRUNC_RAW;
+	  if(wrq.u.data.length > context->raw_len)
+	    context->raw_needed = wrq.u.data.length;
+	}
+      return(-1);
+    }
+
+  /* Decode what fits */
+  context->raw_used = wrq.u.data.length;
+  context->total_cells = iw_scan_decode(context->raw, wrq.u.data.length,
+					we_version, context->cells,
+					context->max_cells);
+  context->num_cells = context->total_cells;
+  if(context->total_cells > context->max_cells)
+    {
+      context->num_cells = context->max_cells;
+      context->truncated |= IW_SCAN_TRUNC_CELLS;
+    }
+  context->result = iw_scan_chain(context->cells, context->num_cells);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Blocking version of iw_process_scan_static(), see iw_scan().
+ * Nothing is allocated, there is nothing to free.
+ * Return -1 for error and 0 for success.
+ */
+int
+iw_scan_static(int			skfd,
+	       char *			ifname,
+	       int			we_version,
+	       wireless_scan_static *	context)
+{
+  int		delay;		/* in ms */
+
+  context->retry = 0;
+
+  /* Wait until we get results or error */
+  while(1)
+    {
+      delay = iw_process_scan_static(skfd, ifname, we_version, context);
+      if(delay <= 0)
+	break;
+      usleep(delay * 1000);
+    }
+  return(delay);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the results of the scans done with this context.
+ * The context can be used for another scan afterwards.
+ */
+void
+iw_scan_free(wireless_scan_head *	context)
+{
+  iw_scan_check(context);
+  iw_arena_release(&context->arena);
+  context->result = NULL;
+  context->cells = NULL;
+  context->num_cells = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Signal of a cell, for sorting. Units are whatever the driver uses,
+ * but they are consistent within a scan.
+ */
+static int
+iw_scan_signal(const struct wireless_scan *	wscan)
+{
+  const iwqual *	qual = &wscan->stats.qual;
+
+  if(!wscan->has_stats || (qual->updated & IW_QUAL_LEVEL_INVALID))
+    return(INT_MIN);
+  if(qual->updated & IW_QUAL_RCPI)
+    return((qual->level >> 1) - 110);
+  if(qual->updated & IW_QUAL_DBM)
+    return((qual->level >= 64) ? qual->level - 0x100 : qual->level);
+  return(qual->level);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * qsort() helpers
+ */
+static int
+iw_scan_cmp_signal(const void *	a,
+		   const void *	b)
+{
+  int		sa = iw_scan_signal(a);
+  int		sb = iw_scan_signal(b);
+
+  /* Strongest first */
+  return((sa < sb) - (sa > sb));
+}
+
+static int
+iw_scan_cmp_bssid(const void *	a,
+		  const void *	b)
+{
+  return(memcmp(((const struct wireless_scan *) a)->ap_addr.sa_data,
+		((const struct wireless_scan *) b)->ap_addr.sa_data,
+		ETH_ALEN));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Sort the results of the last scan, strongest signal first
+ * (IW_SCAN_SORT_SIGNAL) or by ascending BSSID (IW_SCAN_SORT_BSSID).
+ * The linked list follows the new order.
+ */
+void
+iw_scan_sort(wireless_scan_head *	context,
+	     int			order)
+{
+  if(order == context->sorted)
+    return;
+
+  switch(order)
+    {
+    case IW_SCAN_SORT_SIGNAL:
+      qsort(context->cells, context->num_cells,
+	    sizeof(struct wireless_scan), iw_scan_cmp_signal);
+      break;
+    case IW_SCAN_SORT_BSSID:
+      qsort(context->cells, context->num_cells,
+	    sizeof(struct wireless_scan), iw_scan_cmp_bssid);
+      break;
+    default:
+      return;
+    }
+  context->sorted = order;
+  context->result = iw_scan_chain(context->cells, context->num_cells);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Find a cell in the results of the last scan.
+ * This is a binary search if the results are sorted by BSSID.
+ * Return NULL if not found.
+ */
+struct wireless_scan *
+iw_scan_find(wireless_scan_head *	context,
+	     const struct ether_addr *	bssid)
+{
+  struct wireless_scan	key;
+  int			i;
+
+  memcpy(key.ap_addr.sa_data, bssid, ETH_ALEN);
+  if(context->sorted == IW_SCAN_SORT_BSSID)
+    return(bsearch(&key, context->cells, context->num_cells,
+		   sizeof(struct wireless_scan), iw_scan_cmp_bssid));
+
+  for(i = 0; i < context->num_cells; i++)
+    if(!iw_scan_cmp_bssid(&key, &context->cells[i]))
+      return(&context->cells[i]);
+  return(NULL);
+}
+
+/********************* ESSID POOL SUBROUTINES *********************/
+/*
+ * The same few networks are advertised by many access points, scan
+ * after scan. Interning the ESSIDs means each of them is stored once,
+ * and that cells can be compared or grouped by network with a simple
+ * integer comparison. IDs are stable for the life of the pool.
+ */
+
+/*------------------------------------------------------------------*/
+/*
+ * FNV-1a of the ESSID bytes.
+ */
+static __u32
+iw_essid_hash(const char *	essid,
+	      int		len)
+{
+  __u32		hash = 2166136261U;
+  int		i;
+
+  for(i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char) essid[i]) * 16777619U;
+  return(hash);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for one more ESSID of len bytes.
+ */
+static int
+iw_essid_grow(iw_essid_pool *	pool,
+	      int		len)
+{
+  if(pool->data_len + len > pool->data_max)
+    {
+      size_t	max = pool->data_max ? 2 * pool->data_max : 1024;
+      char *	data;
+
+      while(max < pool->data_len + len)
+	max *= 2;
+      data = realloc(pool->data, max);
+      if(data == NULL)
+	return(-1);
+      pool->data = data;
+      pool->data_max = max;
+    }
+
+  /* IDs start at 1 */
+  if(pool->num + 1 >= pool->max)
+    {
+      int		max = pool->max ? 2 * pool->max : 64;
+      iw_essid_entry *	entries;
+      __u32 *		hash;
+      __u32		mask = 2 * max - 1;
+      int		id;
+
+      entries = realloc(pool->entries, max * sizeof(iw_essid_entry));
+      if(entries == NULL)
+	return(-1);
+      pool->entries = entries;
+      hash = calloc(mask + 1, sizeof(__u32));
+      if(hash == NULL)
+	return(-1);
+
+      /* Rehash, at most half full */
+      for(id = 1; id <= pool->num; id++)
+	{
+	  __u32	slot = entries[id].hash & mask;
+
+	  while(hash[slot])
+	    slot = (slot + 1) & mask;
+	  hash[slot] = id;
+	}
+      free(pool->hash);
+      pool->hash = hash;
+      pool->hash_mask = mask;
+      pool->max = max;
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Intern an ESSID of len bytes (it doesn't need to be terminated).
+ * Return its ID, 0 for an empty ESSID, or -1 on failure.
+ */
+int
+iw_essid_intern(iw_essid_pool *	pool,
+		const char *	essid,
+		int		len)
+{
+  __u32		hash;
+  __u32		slot;
+  int		id;
+
+  if(len <= 0)
+    return(0);
+  if(len > IW_ESSID_MAX_SIZE)
+    len = IW_ESSID_MAX_SIZE;
+
+  if(iw_essid_grow(pool, len) < 0)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      return(-1);
+    }
+
+  /* Linear probing */
+  hash = iw_essid_hash(essid, len);
+  for(slot = hash & pool->hash_mask; pool->hash[slot];
+      slot = (slot + 1) & pool->hash_mask)
+    {
+      iw_essid_entry *	entry = &pool->entries[pool->hash[slot]];
+
+      if((entry->hash == hash) && (entry->len == len)
+	 && !memcmp(pool->data + entry->offset, essid, len))
+	return(pool->hash[slot]);
+    }
+
+  /* New one */
+  id = ++pool->num;
+  pool->entries[id].offset = pool->data_len;
+  pool->entries[id].hash = hash;
+  pool->entries[id].len = len;
+  memcpy(pool->data + pool->data_len, essid, len);
+  pool->data_len += len;
+  pool->hash[slot] = id;
+  return(id);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get the bytes of an interned ESSID (not terminated), and their
+ * number in *len. Return NULL for ID 0 or an unknown ID.
+ */
+const char *
+iw_essid_get(const iw_essid_pool *	pool,
+	     int			id,
+	     int *			len)
+{
+  if((id <= 0) || (id > pool->num))
+    {
+      *len = 0;
+      return(NULL);
+    }
+  *len = pool->entries[id].len;
+  return(pool->data + pool->entries[id].offset);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the pool. It can be used again afterwards.
+ */
+void
+iw_essid_free(iw_essid_pool *	pool)
+{
+  free(pool->entries);
+  free(pool->data);
+  free(pool->hash);
+  memset(pool, 0, sizeof(iw_essid_pool));
+}
+
+/******************** COMPACT CELL SUBROUTINES ********************/
+/*
+ * A wireless_scan is several hundred bytes, mostly a wireless_config
+ * that is meant for configuring the local interface (key, name...).
+ * When keeping the history of many cells, we only want the part that
+ * is looked at all the time in a small record, so that many of them
+ * fit in the cache. The rest goes in a parallel cold table, which is
+ * only touched when needed.
+ */
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for one more cell and clear it. It's only counted in the
+ * table once iw_cell_add() or iw_cell_add_basic() succeeds.
+ */
+static iw_cell *
+iw_cell_new(iw_cell_table *		table,
+	    __u32			time,
+	    const struct sockaddr *	ap_addr)
+{
+  iw_cell *	cell;
+
+  if(table->num == table->max)
+    {
+      int		max = table->max ? 2 * table->max : 64;
+      iw_cell *		hot = realloc(table->hot, max * sizeof(iw_cell));
+      iw_cell_cold *	newcold;
+
+      if(hot == NULL)
+	return(NULL);
+      table->hot = hot;
+      newcold = realloc(table->cold, max * sizeof(iw_cell_cold));
+      if(newcold == NULL)
+	return(NULL);
+      table->cold = newcold;
+      table->max = max;
+    }
+
+  cell = &table->hot[table->num];
+  memset(cell, 0, sizeof(iw_cell));
+  memset(&table->cold[table->num], 0, sizeof(iw_cell_cold));
+  cell->time = time;
+  cell->bssid = iw_ether_key((const unsigned char *) ap_addr->sa_data);
+  return(cell);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Set the frequency of a cell. freq may be a channel, as some drivers
+ * report. Otherwise the channel is looked up in the range, unless the
+ * caller already knows it (channel >= 0).
+ */
+static void
+iw_cell_set_freq(iw_cell *		cell,
+		 double			freq,
+		 int			channel,
+		 const iw_range_entry *	entry)
+{
+  if(freq < KILO)
+    {
+      /* Driver gave us the channel */
+      cell->flags |= IW_CELL_CHANNEL;
+      cell->channel = freq;
+      return;
+    }
+
+  cell->flags |= IW_CELL_FREQ;
+  cell->freq = (freq + MEGA / 2) / MEGA;
+  if(channel < 0)
+    {
+      /* Falls back on the 802.11 channel when not in the range */
+      if(entry != NULL)
+	channel = iw_range_freq_to_channel(entry, freq);
+      else
+	channel = iw_mhz_to_channel(cell->freq);
+    }
+  if((channel >= 0) && (channel <= 255))
+    {
+      cell->flags |= IW_CELL_CHANNEL;
+      cell->channel = channel;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Set the ESSID of a cell, interned in the table.
+ * Return -1 on failure.
+ */
+static int
+iw_cell_set_essid(iw_cell_table *	table,
+		  iw_cell *		cell,
+		  const char *		essid)
+{
+  int	id = iw_essid_intern(&table->essids, essid,
+			     strnlen(essid, IW_ESSID_MAX_SIZE));
+
+  if(id < 0)
+    return(-1);
+  if(id > 0)
+    {
+      cell->flags |= IW_CELL_ESSID;
+      cell->essid = id;
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Set the signal, noise and quality of a cell, in dBm when possible.
+ */
+static void
+iw_cell_set_qual(iw_cell *		cell,
+		 iw_cell_cold *		cold,
+		 const iwqual *		qual,
+		 const iw_range_entry *	entry)
+{
+  int		level;
+  int		noise;
+  int		dbm;
+
+  cold->qual = *qual;
+  dbm = iw_qual_dbm(qual, entry ? &entry->range : NULL, entry != NULL,
+		    &level, &noise);
+  if(dbm & IW_DBM_LEVEL)
+    {
+      cell->flags |= IW_CELL_SIGNAL;
+      cell->signal = level;
+    }
+  if(dbm & IW_DBM_NOISE)
+    {
+      cell->flags |= IW_CELL_NOISE;
+      cell->noise = noise;
+    }
+  if(!(qual->updated & IW_QUAL_QUAL_INVALID))
+    {
+      cell->flags |= IW_CELL_QUALITY;
+      cell->quality = qual->qual;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a cell to the table, time is the caller's clock.
+ * entry is the range of the interface (see iw_range_cache_get()), or
+ * NULL if unknown.
+ * Signal and noise are converted to dBm when possible.
+ * Return the index of the cell, or -1 on failure.
+ */
+int
+iw_cell_add(iw_cell_table *		table,
+	    const struct wireless_scan *	wscan,
+	    __u32				time,
+	    const iw_range_entry *		entry)
+{
+  iw_cell *		cell;
+  iw_cell_cold *	cold;
+
+  cell = iw_cell_new(table, time, &wscan->ap_addr);
+  if(cell == NULL)
+    return(-1);
+  cold = &table->cold[table->num];
+
+  if(wscan->b.has_freq)
+    {
+      cold->freq = wscan->b.freq;
+      cold->freq_flags = wscan->b.freq_flags;
+      iw_cell_set_freq(cell, wscan->b.freq, -1, entry);
+    }
+  if(wscan->b.has_mode)
+    {
+      cell->flags |= IW_CELL_MODE;
+      cell->mode = wscan->b.mode;
+    }
+  if(wscan->b.has_essid)
+    {
+      if(iw_cell_set_essid(table, cell, wscan->b.essid) < 0)
+	return(-1);
+      cold->essid_on = wscan->b.essid_on;
+    }
+  if(wscan->has_stats)
+    iw_cell_set_qual(cell, cold, &wscan->stats.qual, entry);
+  if(wscan->b.has_key)
+    {
+      cold->key_flags = wscan->b.key_flags;
+      cold->key_size = wscan->b.key_size;
+      if(!(wscan->b.key_flags & IW_ENCODE_DISABLED))
+	cell->flags |= IW_CELL_ENCRYPTED;
+    }
+  if(wscan->b.has_nwid)
+    {
+      cell->flags |= IW_CELL_NWID;
+      cold->nwid = wscan->b.nwid;
+    }
+  if(wscan->has_maxbitrate)
+    {
+      cell->flags |= IW_CELL_BITRATE;
+      cold->maxbitrate = wscan->maxbitrate;
+    }
+
+  return(table->num++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a cell from its most common parts, for callers decoding the
+ * scan events themselves, so they don't build a wireless_scan.
+ * freq is 0 if unknown, channel and mode -1 if unknown, qual NULL if
+ * unknown. A known channel saves looking it up in the range.
+ * Return the index of the cell, or -1 on failure.
+ */
+int
+iw_cell_add_basic(iw_cell_table *		table,
+		  __u32				time,
+		  const struct sockaddr *	ap_addr,
+		  double			freq,
+		  int				channel,
+		  int				mode,
+		  const char *			essid,
+		  const iwqual *		qual,
+		  const iw_range_entry *	entry)
+{
+  iw_cell *		cell;
+  iw_cell_cold *	cold;
+
+  cell = iw_cell_new(table, time, ap_addr);
+  if(cell == NULL)
+    return(-1);
+  cold = &table->cold[table->num];
+
+  if((freq > 0) || (channel >= 0))
+    {
+      /* Like wireless_scan, a channel alone goes in the frequency */
+      if(freq <= 0)
+	freq = channel;
+      cold->freq = freq;
+      iw_cell_set_freq(cell, freq, channel, entry);
+    }
+  if(mode >= 0)
+    {
+      cell->flags |= IW_CELL_MODE;
+      cell->mode = mode;
+    }
+  if((essid != NULL) && (iw_cell_set_essid(table, cell, essid) < 0))
+    return(-1);
+  if(qual != NULL)
+    iw_cell_set_qual(cell, cold, qual, entry);
+
+  return(table->num++);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Copy the ESSID of a cell in buf (IW_ESSID_MAX_SIZE + 1 bytes).
+ * Return buf, empty if the cell has no ESSID.
+ */
+char *
+iw_cell_essid(const iw_cell_table *	table,
+	      const iw_cell *		cell,
+	      char *			buf)
+{
+  const char *	essid;
+  int		len = 0;
+
+  essid = iw_essid_get(&table->essids, cell->essid, &len);
+  if(essid != NULL)
+    memcpy(buf, essid, len);
+  buf[len] = '\0';
+  return(buf);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Forget all the cells, but keep the memory. ESSID IDs are kept, so
+ * that they remain comparable with the previous cells.
+ */
+void
+iw_cell_reset(iw_cell_table *	table)
+{
+  table->num = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the memory of the table.
+ */
+void
+iw_cell_free(iw_cell_table *	table)
+{
+  free(table->hot);
+  free(table->cold);
+  iw_essid_free(&table->essids);
+  memset(table, 0, sizeof(iw_cell_table));
+}
+
+/********************* CELL MERGE SUBROUTINES *********************/
+/*
+ * When several interfaces scan at the same time, most access points
+ * are seen by all of them. Merging the tables gives one record per
+ * BSS, with what each interface saw of it. This is a hash join on the
+ * BSSID, linear in the number of cells, and the tables don't need to
+ * be sorted.
+ */
+
+/*------------------------------------------------------------------*/
+/*
+ * Make room for num merged cells, and a hash twice as large.
+ */
+static int
+iw_cell_merge_grow(iw_cell_merge_result *	result,
+		   int				num)
+{
+  iw_cell_merged *	cells;
+  int *			sums;
+  __u32 *		hash;
+  __u32			size = 64;
+
+  if(num <= result->max)
+    return(0);
+
+  while(size < 2 * (__u32) num)
+    size <<= 1;
+  cells = realloc(result->cells, num * sizeof(iw_cell_merged));
+  if(cells == NULL)
+    return(-1);
+  result->cells = cells;
+  sums = realloc(result->sums, num * sizeof(int));
+  if(sums == NULL)
+    return(-1);
+  result->sums = sums;
+  hash = malloc(size * sizeof(__u32));
+  if(hash == NULL)
+    return(-1);
+  free(result->hash);
+  result->hash = hash;
+  result->hash_mask = size - 1;
+  result->max = num;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Merge the cells of several tables by BSSID. Table n of the array
+ * is bit n of iw_cell_merged.tables.
+ * Return the number of merged cells, or -1 on failure.
+ */
+int
+iw_cell_merge(iw_cell_table * const	tables[],
+	      int			num_tables,
+	      iw_cell_merge_result *	result)
+{
+  iw_cell_merged *	merged;
+  int			total = 0;
+  int			t;
+  int			i;
+
+  if((num_tables < 0) || (num_tables > IW_CELL_MERGE_MAX))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+  for(t = 0; t < num_tables; t++)
+    total += tables[t]->num;
+  if(iw_cell_merge_grow(result, total) < 0)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      return(-1);
+    }
+
+  result->num = 0;
+  if(total == 0)
+    return(0);
+  memset(result->hash, 0, (result->hash_mask + 1) * sizeof(__u32));
+
+  for(t = 0; t < num_tables; t++)
+    for(i = 0; i < tables[t]->num; i++)
+      {
+	const iw_cell *	cell = &tables[t]->hot[i];
+	__u32		slot;
+	int		idx;
+
+	/* Fibonacci hashing, the low octets of BSSIDs are the random ones */
+	slot = (__u32) ((cell->bssid * 0x9E3779B97F4A7C15ULL) >> 32);
+	slot &= result->hash_mask;
+	while(result->hash[slot]
+	      && (result->cells[result->hash[slot] - 1].bssid != cell->bssid))
+	  slot = (slot + 1) & result->hash_mask;
+
+	if(result->hash[slot] == 0)
+	  {
+	    /* First time we see it */
+	    idx = result->num++;
+	    result->hash[slot] = idx + 1;
+	    merged = &result->cells[idx];
+	    memset(merged, 0, sizeof(iw_cell_merged));
+	    merged->bssid = cell->bssid;
+	    merged->time = cell->time;
+	    merged->best_table = t;
+	    merged->best_cell = i;
+	    result->sums[idx] = 0;
+	  }
+	else
+	  {
+	    idx = result->hash[slot] - 1;
+	    merged = &result->cells[idx];
+	    if(cell->time > merged->time)
+	      merged->time = cell->time;
+	  }
+	merged->tables |= 1U << t;
+
+	if(cell->flags & IW_CELL_SIGNAL)
+	  {
+	    if((merged->num_signal == 0)
+	       || (cell->signal > merged->best_signal))
+	      {
+		merged->best_signal = cell->signal;
+		merged->best_table = t;
+		merged->best_cell = i;
+	      }
+	    merged->num_signal++;
+	    result->sums[idx] += cell->signal;
+	  }
+      }
+
+  /* Means, rounded to the nearest */
+  for(i = 0; i < result->num; i++)
+    {
+      int	n = result->cells[i].num_signal;
+      int	sum = result->sums[i];
+
+      if(n)
+	result->cells[i].mean_signal = (2 * sum + ((sum < 0) ? -n : n))
+				       / (2 * n);
+    }
+  return(result->num);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the memory of a merge result.
+ */
+void
+iw_cell_merge_free(iw_cell_merge_result *	result)
+{
+  free(result->cells);
+  free(result->sums);
+  free(result->hash);
+  memset(result, 0, sizeof(iw_cell_merge_result));
+}
+
+/********************* RANGE CACHE SUBROUTINES *********************/
+/*
+ * The range is the largest thing we get from the driver, and it's
+ * needed for every scan, to decode the quality and the channels. But
+ * it only changes with the driver. So we get it once per interface,
+ * and drop it when the link events say the interface went away, was
+ * renamed, or was taken down or up (the driver may have been
+ * reloaded or reconfigured).
+ */
+
+/*------------------------------------------------------------------*/
+/*
+ * Slot of a frequency in the channel table. The table is never more
+ * than half full, so the probe always ends on the frequency or on a
+ * free slot.
+ */
+static int
+iw_range_chan_slot(const iw_range_entry *	entry,
+		   int				mhz)
+{
+  unsigned int	slot;
+
+  slot = (((unsigned int) mhz * 0x9E3779B1U) >> 16) & (IW_RANGE_CHAN_HASH - 1);
+
+  while(entry->chan_mhz[slot] && (entry->chan_mhz[slot] != mhz))
+    slot = (slot + 1) & (IW_RANGE_CHAN_HASH - 1);
+  return(slot);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Derive the lookup tables of a range.
+ */
+static void
+iw_range_entry_derive(iw_range_entry *	entry)
+{
+  const iwrange *	range = &entry->range;
+  int			num = range->num_frequency;
+  int			slot;
+  int			k;
+
+  if(num > IW_MAX_FREQUENCIES)
+    num = IW_MAX_FREQUENCIES;
+
+  memset(entry->chan_mhz, 0, sizeof(entry->chan_mhz));
+  for(k = 0; k < num; k++)
+    {
+      double	freq = iw_freq2float(&range->freq[k]);
+      int	mhz;
+
+      /* Channel only drivers have nothing to look up */
+      if((freq < KILO) || (freq >= (double) INT_MAX * MEGA))
+	continue;
+      mhz = (int) ((freq + MEGA / 2) / MEGA);
+      if(mhz <= 0)
+	continue;
+      /* The first of duplicates wins, like in iw_freq_to_channel() */
+      slot = iw_range_chan_slot(entry, mhz);
+      if(!entry->chan_mhz[slot])
+	{
+	  entry->chan_mhz[slot] = mhz;
+	  entry->chan_num[slot] = range->freq[k].i;
+	}
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get the range of an interface, from the driver only if it's not in
+ * the cache. The entry stays valid until it's invalidated.
+ * Return NULL if the interface has no range.
+ */
+iw_range_entry *
+iw_range_cache_get(int			skfd,
+		   iw_range_cache *	cache,
+		   const char *		ifname)
+{
+  iw_range_entry *	entry;
+  int			i;
+
+  for(i = 0; i < cache->num; i++)
+    if(!strncmp(cache->entries[i]->name, ifname, IFNAMSIZ))
+      return(cache->entries[i]);
+
+  if(cache->num == cache->max)
+    {
+      int		newmax = cache->max ? 2 * cache->max : 8;
+      iw_range_entry **	entries = realloc(cache->entries,
+					  newmax * sizeof(iw_range_entry *));
+
+      if(entries == NULL)
+	{
+	  fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	  return(NULL);
+	}
+      cache->entries = entries;
+      cache->max = newmax;
+    }
+
+  entry = calloc(1, sizeof(iw_range_entry));
+  if(entry == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      return(NULL);
+    }
+  /* Failures are not cached, the driver may not be ready yet */
+  if(iw_get_range_info_r(skfd, ifname, &entry->range, &cache->warned) < 0)
+    {
+      free(entry);
+      return(NULL);
+    }
+  strncpy(entry->name, ifname, IFNAMSIZ);
+  iw_range_entry_derive(entry);
+  cache->entries[cache->num++] = entry;
+  return(entry);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Drop an entry of the cache.
+ */
+static void
+iw_range_cache_drop(iw_range_cache *	cache,
+		    int			i)
+{
+  free(cache->entries[i]);
+  cache->entries[i] = cache->entries[--cache->num];
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Forget the range of an interface, or of all of them (ifname NULL).
+ * The next iw_range_cache_get() asks the driver again.
+ */
+void
+iw_range_cache_invalidate(iw_range_cache *	cache,
+			  const char *		ifname)
+{
+  int		i = 0;
+
+  while(i < cache->num)
+    if((ifname == NULL)
+       || !strncmp(cache->entries[i]->name, ifname, IFNAMSIZ))
+      iw_range_cache_drop(cache, i);
+    else
+      i++;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Apply the link changes seen by the tracker, after
+ * iw_iftracker_update(). Interfaces are matched by index, the name
+ * is only used the first time. No ioctl is done.
+ */
+void
+iw_range_cache_sync(iw_range_cache *		cache,
+		    const iw_iftracker *	tracker)
+{
+  const iw_ifinfo *	info;
+  int			i = 0;
+  int			j;
+
+  while(i < cache->num)
+    {
+      iw_range_entry *	entry = cache->entries[i];
+
+      info = NULL;
+      for(j = 0; (j < tracker->num) && (info == NULL); j++)
+	if(entry->ifindex
+	   ? (tracker->ifaces[j].ifindex == entry->ifindex)
+	   : !strncmp(tracker->ifaces[j].name, entry->name, IFNAMSIZ))
+	  info = &tracker->ifaces[j];
+
+      if((info != NULL) && !entry->ifindex)
+	{
+	  /* First time the tracker sees it */
+	  entry->ifindex = info->ifindex;
+	  entry->changed = info->changed;
+	}
+      if((info == NULL) || (info->changed != entry->changed))
+	iw_range_cache_drop(cache, i);
+      else
+	i++;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the cache.
+ */
+void
+iw_range_cache_free(iw_range_cache *	cache)
+{
+  iw_range_cache_invalidate(cache, NULL);
+  free(cache->entries);
+  memset(cache, 0, sizeof(iw_range_cache));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Convert a frequency to a channel, like iw_freq_to_channel(), but in
+ * constant time : frequencies are rounded to the MHz and hashed. The
+ * frequencies the driver doesn't list get their 802.11 channel.
+ * Return -1 if freq is already a channel, -2 if not found.
+ */
+int
+iw_range_freq_to_channel(const iw_range_entry *	entry,
+			 double			freq)
+{
+  int		mhz;
+  int		slot;
+  int		channel;
+
+  if(freq < KILO)
+    return(-1);
+  if(freq >= (double) INT_MAX * MEGA)
+    return(-2);
+  mhz = (int) ((freq + MEGA / 2) / MEGA);
+  if(mhz <= 0)
+    return(-2);
+
+  slot = iw_range_chan_slot(entry, mhz);
+  if(entry->chan_mhz[slot])
+    return(entry->chan_num[slot]);
+  channel = iw_mhz_to_channel(mhz);
+  return((channel < 0) ? -2 : channel);
+}
+
+/************************ CONTEXT SUBROUTINES ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Open a context : a socket and empty caches.
+ * Return -1 if the socket can't be opened.
+ */
+int
+iw_context_open(iw_context *	ctx)
+{
+  memset(ctx, 0, sizeof(iw_context));
+  ctx->skfd = iw_sockets_open();
+  return((ctx->skfd < 0) ? -1 : 0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get the range of an interface, see iw_range_cache_get().
+ */
+iw_range_entry *
+iw_context_range(iw_context *	ctx,
+		 const char *	ifname)
+{
+  return(iw_range_cache_get(ctx->skfd, &ctx->ranges, ifname));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get the capabilities of an interface, see iw_capa_get().
+ */
+iw_capa *
+iw_context_capa(iw_context *	ctx,
+		const char *	ifname)
+{
+  return(iw_capa_get(ctx->skfd, &ctx->capa, ifname));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Forget what is known of an interface (or of all of them if ifname
+ * is NULL), when its driver went away or was reconfigured.
+ */
+void
+iw_context_invalidate(iw_context *	ctx,
+		      const char *	ifname)
+{
+  iw_range_cache_invalidate(&ctx->ranges, ifname);
+  iw_capa_invalidate(&ctx->capa, ifname);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Release the caches and close the socket.
+ */
+void
+iw_context_close(iw_context *	ctx)
+{
+  iw_range_cache_free(&ctx->ranges);
+  iw_capa_free(&ctx->capa);
+  if(ctx->skfd >= 0)
+    iw_sockets_close(ctx->skfd);
+  ctx->skfd = -1;
+}
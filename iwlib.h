@@ -27,7 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <netdb.h>		/* gethostbyname, getnetbyname */
+#include <netdb.h>		/* getaddrinfo, getnetbyname_r */
 #include <net/ethernet.h>	/* struct ether_addr */
 #include <sys/time.h>		/* struct timeval */
 #include <unistd.h>
@@ -116,9 +116,56 @@ extern "C" {
 #define KILO	1e3
 #define MEGA	1e6
 #define GIGA	1e9
+
+/* Size of the /proc/net/wireless sampler */
+#define IW_STATS_SAMPLER_BUF	16384	/* Bytes read at once */
+#define IW_STATS_SAMPLER_MAX	128	/* Interfaces */
+
+/* Settings of iw_apply_basic_config() */
+#define IW_CONFIG_MODE		0x01
+#define IW_CONFIG_FREQ		0x02
+#define IW_CONFIG_KEY		0x04
+#define IW_CONFIG_NWID		0x08
+#define IW_CONFIG_ESSID		0x10
+
+/* Slots of the channel table of a cached range, power of 2 */
+#define IW_RANGE_CHAN_HASH	(2 * IW_MAX_FREQUENCIES)
+
 /* For doing log10/exp10 without libm */
 #define LOG10_MAGIC	1.25892541179
 
+/* Values returned by iw_qual_dbm() */
+#define IW_DBM_LEVEL	0x01		/* Signal level converted */
+#define IW_DBM_NOISE	0x02		/* Noise level converted */
+
+/* Order of the scan results (see iw_scan_sort()) */
+#define IW_SCAN_SORT_NONE	0	/* As returned by the driver */
+#define IW_SCAN_SORT_SIGNAL	1	/* Strongest signal first */
+#define IW_SCAN_SORT_BSSID	2	/* Ascending BSSID */
+
+/* Marks a scan context set up by iw_scan_init() */
+#define IW_SCAN_HEAD_MAGIC	0x5343414EU
+
+/* What a compact cell holds (iw_cell.flags) */
+#define IW_CELL_FREQ		0x0001
+#define IW_CELL_CHANNEL		0x0002
+#define IW_CELL_MODE		0x0004
+#define IW_CELL_ESSID		0x0008
+#define IW_CELL_SIGNAL		0x0010	/* In dBm */
+#define IW_CELL_NOISE		0x0020	/* In dBm */
+#define IW_CELL_QUALITY		0x0040
+#define IW_CELL_ENCRYPTED	0x0080
+#define IW_CELL_NWID		0x0100	/* In the cold record */
+#define IW_CELL_BITRATE		0x0200	/* In the cold record */
+
+/* What didn't fit in a static scan (wireless_scan_static.truncated) */
+#define IW_SCAN_TRUNC_CELLS	0x01	/* More cells than max_cells */
+#define IW_SCAN_TRUNC_RAW	0x02	/* Raw results larger than raw_len */
+
+/* Arena allocator (scan results) */
+#define IW_ARENA_MIN_BLOCK	4096	/* Size of the first block */
+#define IW_ARENA_ALIGN		16	/* Alignment of allocations */
+
 /* Backward compatibility for network headers */
 #ifndef ARPHRD_IEEE80211
 #define ARPHRD_IEEE80211 801		/* IEEE 802.11			*/
@@ -249,15 +296,157 @@ typedef struct wireless_scan
   int		has_maxbitrate;
 } wireless_scan;
 
+/* An interned ESSID */
+typedef struct iw_essid_entry
+{
+  __u32		offset;		/* In iw_essid_pool.data */
+  __u32		hash;
+  __u8		len;
+} iw_essid_entry;
+
+/*
+ * ESSID interning pool : each distinct ESSID is stored once and
+ * identified by a small integer. Must be zeroed before first use.
+ */
+typedef struct iw_essid_pool
+{
+  int			num;		/* IDs 1 to num are in use */
+  int			max;
+  iw_essid_entry *	entries;	/* Indexed by ID */
+  char *		data;		/* ESSID bytes, not terminated */
+  size_t		data_len;
+  size_t		data_max;
+  __u32			hash_mask;
+  __u32 *		hash;		/* ID, 0 if free */
+} iw_essid_pool;
+
+/*
+ * Compact record of a cell, for keeping many of them around.
+ * Only what's commonly used is here (32 bytes), the rest is in the
+ * matching iw_cell_cold record, and the ESSID in the table.
+ */
+typedef struct iw_cell
+{
+  __u64		bssid;		/* First octet most significant */
+  __u32		time;		/* Caller's clock */
+  __u32		essid;		/* ID in iw_cell_table.essids, 0 if none */
+  __u16		flags;		/* IW_CELL_XXX */
+  __u16		freq;		/* MHz */
+  __s16		signal;		/* dBm */
+  __s16		noise;		/* dBm */
+  __u8		quality;
+  __u8		channel;
+  __u8		mode;
+} iw_cell;
+
+/* Rarely used data of a cell, same index as the iw_cell */
+typedef struct iw_cell_cold
+{
+  double	freq;		/* Exact frequency, Hz */
+  int		freq_flags;
+  iwqual	qual;		/* As reported by the driver */
+  iwparam	nwid;
+  iwparam	maxbitrate;	/* bps */
+  int		key_flags;
+  int		key_size;
+  int		essid_on;
+} iw_cell_cold;
+
+/* A growable table of compact cells. Must be zeroed before first use */
+typedef struct iw_cell_table
+{
+  int		num;
+  int		max;
+  iw_cell *	hot;		/* Contiguous, num entries */
+  iw_cell_cold *	cold;		/* Contiguous, num entries */
+  iw_essid_pool	essids;		/* Kept across iw_cell_reset() */
+} iw_cell_table;
+
+/* Max number of tables merged at once (see iw_cell_merge()) */
+#define IW_CELL_MERGE_MAX	32
+
+/* One BSS, as seen by all the tables merged */
+typedef struct iw_cell_merged
+{
+  __u64		bssid;
+  __u32		time;		/* Latest observation */
+  __u32		tables;		/* Bit n : seen in table n */
+  __s16		best_signal;	/* dBm, if num_signal */
+  __s16		mean_signal;	/* dBm, if num_signal */
+  __u16		num_signal;	/* Observations with a signal */
+  __u16		best_table;	/* Strongest observation, for the */
+  int		best_cell;	/* other fields (ESSID, frequency...) */
+} iw_cell_merged;
+
+/* Result of iw_cell_merge(). Must be zeroed before first use */
+typedef struct iw_cell_merge_result
+{
+  int			num;
+  int			max;
+  iw_cell_merged *	cells;		/* In order of first observation */
+  int *			sums;		/* Scratch : signal sums */
+  __u32			hash_mask;
+  __u32 *		hash;		/* Scratch : index + 1, 0 if free */
+} iw_cell_merge_result;
+
+/* One block of an arena, the allocations follow the header */
+typedef struct iw_arena_block
+{
+  struct iw_arena_block *	next;		/* Older block */
+  size_t			size;		/* Usable bytes */
+  size_t			used;
+} iw_arena_block;
+
+/*
+ * Bump allocator : memory is carved out of large blocks, and only
+ * released all at once. Must be zeroed before first use.
+ */
+typedef struct iw_arena
+{
+  iw_arena_block *	blocks;		/* Current block first */
+  size_t		total;		/* Usable bytes, all blocks */
+} iw_arena;
+
 /*
  * Context used for non-blocking scan.
+ * Note : the results now belong to the context. They are recycled by
+ * the next scan, and released with iw_scan_free(), never with free().
+ * Start with iw_scan_init() (or zero it). A context that was never
+ * initialised is detected by its magic, so older callers passing a
+ * fresh one from the stack still work, but leak it when done.
  */
 typedef struct wireless_scan_head
 {
-  wireless_scan *	result;		/* Result of the scan */
+  wireless_scan *	result;		/* Result of the scan, as a list */
   int			retry;		/* Retry level */
+  wireless_scan *	cells;		/* Result of the scan, as an array */
+  int			num_cells;
+  int			sorted;		/* IW_SCAN_SORT_XXX */
+  iw_arena		arena;		/* Storage of the results */
+  unsigned int		magic;		/* IW_SCAN_HEAD_MAGIC once in use */
 } wireless_scan_head;
 
+/*
+ * Context used for scanning without memory allocation : all the
+ * storage is provided by the caller (see iw_process_scan_static()).
+ */
+typedef struct wireless_scan_static
+{
+  /* Provided by the caller */
+  unsigned char *	raw;		/* Buffer for the raw results */
+  int			raw_len;	/* IW_SCAN_MAX_DATA at least */
+  wireless_scan *	cells;		/* Array for the decoded cells */
+  int			max_cells;
+  /* Result of the scan */
+  int			retry;		/* Retry level */
+  wireless_scan *	result;		/* Cells, as a list */
+  int			num_cells;	/* Cells decoded */
+  int			total_cells;	/* Cells in the results */
+  int			raw_used;	/* Size of the results in raw */
+  int			raw_needed;	/* Size of the results, if too large */
+  int			truncated;	/* IW_SCAN_TRUNC_XXX */
+} wireless_scan_static;
+
 /* Structure used for parsing event streams, such as Wireless Events
  * and scan results */
 typedef struct stream_descr
@@ -267,6 +456,136 @@ typedef struct stream_descr
   char *	value;		/* Current value in event */
 } stream_descr;
 
+/* An interface, as listed by iw_get_ifaces() */
+typedef struct iw_ifinfo
+{
+  int			ifindex;
+  char			name[IFNAMSIZ + 1];
+  unsigned short	type;		/* ARPHRD_XXX */
+  unsigned int		flags;		/* IFF_XXX */
+  int			wireless;	/* Has Wireless Extensions */
+  unsigned int		changed;	/* Tracker generation of the last
+					 * add, rename, up or down */
+} iw_ifinfo;
+
+/*
+ * Set of wireless interfaces, kept up to date with the rtnetlink link
+ * events (see iw_iftracker_open()). Must be zeroed before first use.
+ */
+typedef struct iw_iftracker
+{
+  int		fd;		/* rtnetlink socket, poll() it */
+  int		skfd;		/* To probe new interfaces */
+  int		num;
+  int		max;
+  iw_ifinfo *	ifaces;		/* In order of appearance */
+  unsigned int	generation;	/* Changes with the set or a link */
+  int		num_wired;
+  int		max_wired;
+  int *		wired;		/* Indexes of links that are not wireless */
+} iw_iftracker;
+
+/*
+ * Range of an interface, with tables derived from it.
+ */
+typedef struct iw_range_entry
+{
+  char		name[IFNAMSIZ + 1];
+  int		ifindex;	/* 0 until seen by the tracker */
+  unsigned int	changed;	/* iw_ifinfo.changed when seen */
+  iwrange	range;
+  /* Channels of range by MHz, for iw_range_freq_to_channel() */
+  int		chan_mhz[IW_RANGE_CHAN_HASH];	/* 0 if free */
+  int		chan_num[IW_RANGE_CHAN_HASH];
+} iw_range_entry;
+
+/*
+ * Cache of the range of interfaces. The range only changes when the
+ * driver is reloaded or reconfigured, which the link events tell.
+ * Must be zeroed before first use.
+ */
+typedef struct iw_range_cache
+{
+  int			warned;		/* About the WE version */
+  int			num;
+  int			max;
+  iw_range_entry **	entries;	/* They don't move */
+} iw_range_cache;
+
+/* Statistics of an interface, from /proc/net/wireless */
+typedef struct iw_stats_sample
+{
+  char		name[IFNAMSIZ + 1];
+  iwstats	stats;
+} iw_stats_sample;
+
+/*
+ * Statistics of all the interfaces, sampled in one read of
+ * /proc/net/wireless (see iw_stats_sampler_open()).
+ */
+typedef struct iw_stats_sampler
+{
+  int			fd;		/* Kept open */
+  int			num;		/* Interfaces in the last sample */
+  iw_stats_sample	samples[IW_STATS_SAMPLER_MAX];
+  char			buf[IW_STATS_SAMPLER_BUF];
+} iw_stats_sampler;
+
+/*
+ * What the driver of an interface supports, see iw_capa_get().
+ */
+typedef struct iw_capa
+{
+  char		name[IFNAMSIZ + 1];
+  char		protocol[IFNAMSIZ + 1];	/* SIOCGIWNAME */
+  int		probed;
+  int		we_version;	/* Of the driver, -1 if unknown */
+  __u32		unsupported[8];	/* Bit (request - SIOCIWFIRST) */
+  /* Private ioctls, read once by iw_capa_priv() */
+  int		has_priv;
+  int		num_priv;	/* -1 if the driver has none */
+  iwprivargs *	priv;
+  unsigned int	priv_mask;	/* Of the hash */
+  int *		priv_hash;	/* By name : index + 1, 0 if free */
+} iw_capa;
+
+/*
+ * Capabilities of the interfaces, and of the kernel.
+ * Must be zeroed before first use.
+ */
+typedef struct iw_capa_cache
+{
+  int		we_kernel;	/* 0 until read */
+  int		num;
+  int		max;
+  iw_capa **	entries;	/* They don't move */
+} iw_capa_cache;
+
+/*
+ * What a thread knows : its socket and its caches. Nothing in there is
+ * shared, so each thread (or each radio) can have its own context and
+ * use the library without any lock. See iw_context_open().
+ */
+typedef struct iw_context
+{
+  int			skfd;
+  iw_range_cache	ranges;		/* Warns about the WE version once */
+  iw_capa_cache		capa;		/* And the private ioctls */
+} iw_context;
+
+/*
+ * An interface of iw_apply_basic_config(), and what was done to it.
+ */
+typedef struct iw_config_apply
+{
+  const char *			ifname;
+  const wireless_config *	want;	/* May be shared */
+  unsigned int			changed;	/* IW_CONFIG_XXX set */
+  unsigned int			failed;		/* IW_CONFIG_XXX not set */
+  int				status;	/* 0, -1 if failed, -2 if not
+					 * wireless */
+} iw_config_apply;
+
 /* Prototype for handling display of each single interface on the
  * system - see iw_enum_devices() */
 typedef int (*iw_enum_handler)(int	skfd,
@@ -290,6 +609,20 @@ typedef struct iw_modul_descr
 /* ---------------------- SOCKET SUBROUTINES -----------------------*/
 int
 	iw_sockets_open(void);
+int
+	iw_get_ifaces(int		skfd,
+		      int		wireless_only,
+		      iw_ifinfo **	plist);
+int
+	iw_iftracker_open(iw_iftracker *	tracker,
+			  int			skfd);
+int
+	iw_iftracker_update(iw_iftracker *	tracker);
+iw_ifinfo *
+	iw_iftracker_find(iw_iftracker *	tracker,
+			  int			ifindex);
+void
+	iw_iftracker_close(iw_iftracker *	tracker);
 void
 	iw_enum_devices(int		skfd,
 			iw_enum_handler fn,
@@ -300,6 +633,11 @@ int
 	iw_get_kernel_we_version(void);
 int
 	iw_print_version_info(const char *	toolname);
+int
+	iw_get_range_info_r(int			skfd,
+			    const char *	ifname,
+			    iwrange *		range,
+			    int *		warned);
 int
 	iw_get_range_info(int		skfd,
 			  const char *	ifname,
@@ -316,6 +654,47 @@ int
 	iw_set_basic_config(int			skfd,
 			    const char *	ifname,
 			    wireless_config *	info);
+/* -------------------- CAPABILITY SUBROUTINES -------------------- */
+iw_capa *
+	iw_capa_get(int			skfd,
+		    iw_capa_cache *	cache,
+		    const char *	ifname);
+int
+	iw_capa_ext(int			skfd,
+		    iw_capa *		capa,
+		    int			request,
+		    struct iwreq *	pwrq);
+int
+	iw_capa_priv(int			skfd,
+		     iw_capa *			capa,
+		     const iwprivargs **	ppriv);
+const iwprivargs *
+	iw_capa_priv_find(int		skfd,
+			  iw_capa *	capa,
+			  const char *	name);
+int
+	iw_capa_kernel_we_version(iw_capa_cache *	cache);
+void
+	iw_capa_invalidate(iw_capa_cache *	cache,
+			   const char *		ifname);
+void
+	iw_capa_free(iw_capa_cache *	cache);
+int
+	iw_capa_get_basic_config(int			skfd,
+				 iw_capa_cache *	cache,
+				 const char *		ifname,
+				 wireless_config *	info);
+int
+	iw_capa_set_basic_config(int			skfd,
+				 iw_capa_cache *	cache,
+				 const char *		ifname,
+				 wireless_config *	info);
+/* ------------------- BATCH CONFIG SUBROUTINES ------------------- */
+int
+	iw_apply_basic_config(int			skfd,
+			      iw_capa_cache *		cache,
+			      iw_config_apply *		apply,
+			      int			num);
 /* --------------------- PROTOCOL SUBROUTINES --------------------- */
 int
 	iw_protocol_compare(const char *	protocol1,
@@ -343,6 +722,8 @@ int
 	iw_channel_to_freq(int				channel,
 			   double *			pfreq,
 			   const struct iw_range *	range);
+int
+	iw_mhz_to_channel(int	mhz);
 void
 	iw_print_bitrate(char *	buffer,
 			 int	buflen,
@@ -363,12 +744,27 @@ int
 		     iwstats *		stats,
 		     const iwrange *	range,
 		     int		has_range);
+int
+	iw_stats_sampler_open(iw_stats_sampler *	sampler);
+int
+	iw_stats_sampler_read(iw_stats_sampler *	sampler);
+const iwstats *
+	iw_stats_sampler_find(const iw_stats_sampler *	sampler,
+			      const char *		ifname);
+void
+	iw_stats_sampler_close(iw_stats_sampler *	sampler);
 void
 	iw_print_stats(char *		buffer,
 		       int		buflen,
 		       const iwqual *	qual,
 		       const iwrange *	range,
 		       int		has_range);
+int
+	iw_qual_dbm(const iwqual *	qual,
+		    const iwrange *	range,
+		    int			has_range,
+		    int *		plevel,
+		    int *		pnoise);
 /* --------------------- ENCODING SUBROUTINES --------------------- */
 void
 	iw_print_key(char *			buffer,
@@ -456,6 +852,15 @@ int
 int
 	iw_get_priv_size(int		args);
 
+/* ---------------------- ARENA SUBROUTINES ---------------------- */
+void *
+	iw_arena_alloc(iw_arena *	arena,
+		       size_t		size);
+void
+	iw_arena_reset(iw_arena *	arena);
+void
+	iw_arena_release(iw_arena *	arena);
+
 /* ---------------------- EVENT SUBROUTINES ---------------------- */
 void
 	iw_init_event_stream(struct stream_descr *	stream,
@@ -471,11 +876,106 @@ int
 			char *			ifname,
 			int			we_version,
 			wireless_scan_head *	context);
+void
+	iw_scan_init(wireless_scan_head *	context);
 int
 	iw_scan(int			skfd,
 		char *			ifname,
 		int			we_version,
 		wireless_scan_head *	context);
+int
+	iw_process_scan_static(int			skfd,
+			       char *			ifname,
+			       int			we_version,
+			       wireless_scan_static *	context);
+int
+	iw_scan_static(int			skfd,
+		       char *			ifname,
+		       int			we_version,
+		       wireless_scan_static *	context);
+void
+	iw_scan_free(wireless_scan_head *	context);
+void
+	iw_scan_sort(wireless_scan_head *	context,
+		     int			order);
+struct wireless_scan *
+	iw_scan_find(wireless_scan_head *	context,
+		     const struct ether_addr *	bssid);
+
+/* --------------------- ESSID POOL SUBROUTINES --------------------- */
+int
+	iw_essid_intern(iw_essid_pool *	pool,
+			const char *	essid,
+			int		len);
+const char *
+	iw_essid_get(const iw_essid_pool *	pool,
+		     int			id,
+		     int *			len);
+void
+	iw_essid_free(iw_essid_pool *	pool);
+
+/* -------------------- COMPACT CELL SUBROUTINES -------------------- */
+int
+	iw_cell_add(iw_cell_table *		table,
+		    const struct wireless_scan *	wscan,
+		    __u32				time,
+		    const iw_range_entry *		entry);
+int
+	iw_cell_add_basic(iw_cell_table *		table,
+			  __u32				time,
+			  const struct sockaddr *	ap_addr,
+			  double			freq,
+			  int				channel,
+			  int				mode,
+			  const char *			essid,
+			  const iwqual *		qual,
+			  const iw_range_entry *	entry);
+char *
+	iw_cell_essid(const iw_cell_table *	table,
+		      const iw_cell *		cell,
+		      char *			buf);
+void
+	iw_cell_reset(iw_cell_table *	table);
+void
+	iw_cell_free(iw_cell_table *	table);
+int
+	iw_cell_merge(iw_cell_table * const	tables[],
+		      int			num_tables,
+		      iw_cell_merge_result *	result);
+void
+	iw_cell_merge_free(iw_cell_merge_result *	result);
+
+/* -------------------- RANGE CACHE SUBROUTINES -------------------- */
+iw_range_entry *
+	iw_range_cache_get(int			skfd,
+			   iw_range_cache *	cache,
+			   const char *		ifname);
+void
+	iw_range_cache_invalidate(iw_range_cache *	cache,
+				  const char *		ifname);
+void
+	iw_range_cache_sync(iw_range_cache *	cache,
+			    const iw_iftracker *	tracker);
+void
+	iw_range_cache_free(iw_range_cache *	cache);
+int
+	iw_range_freq_to_channel(const iw_range_entry *	entry,
+				 double			freq);
+
+/* ---------------------- CONTEXT SUBROUTINES ---------------------- */
+int
+	iw_context_open(iw_context *	ctx);
+iw_range_entry *
+	iw_context_range(iw_context *	ctx,
+			 const char *	ifname);
+iw_capa *
+	iw_context_capa(iw_context *	ctx,
+			const char *	ifname);
+void
+	iw_context_invalidate(iw_context *	ctx,
+			      const char *	ifname);
+void
+	iw_context_close(iw_context *	ctx);
 
 /**************************** VARIABLES ****************************/
 
@@ -593,6 +1093,21 @@ iw_ether_cmp(const struct ether_addr* eth1, const struct ether_addr* eth2)
   return memcmp(eth1, eth2, sizeof(*eth1));
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Pack an ethernet address in an integer, first octet most significant
+ */
+static inline __u64
+iw_ether_key(const unsigned char *	mac)
+{
+  __u64		key = 0;
+  int		i;
+
+  for(i = 0; i < ETH_ALEN; i++)
+    key = (key << 8) | mac[i];
+  return(key);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,401 @@
+/*
+ *	Wireless Tools
+ *
+ * C++17 interface to the Wireless Extension library...
+ *
+ * Thin, header-only wrappers : sockets and scan storage are released
+ * by their destructors, results are move-only, and ESSIDs and events
+ * are views into the library's own buffers. Everything is inline and
+ * forwards to the C functions, there is no extra copy or allocation.
+ *
+ * Constructors throw std::system_error when they can't acquire their
+ * resource. Other calls return the status of the C function they
+ * wrap (-1 and errno on error, or a delay in ms to wait for).
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWLIB_HPP
+#define IWLIB_HPP
+
+/***************************** INCLUDES *****************************/
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "iwlib.h"
+
+namespace iw {
+
+/****************************** SOCKET ******************************/
+
+/*
+ * The socket used for all the ioctls.
+ */
+class socket
+{
+public:
+  socket()
+    : fd_(iw_sockets_open())
+  {
+    if(fd_ < 0)
+      throw std::system_error(errno, std::system_category(),
+			      "iw_sockets_open");
+  }
+  /* Adopt an already open socket */
+  explicit socket(int fd) noexcept
+    : fd_(fd)
+  {}
+  socket(socket &&other) noexcept
+    : fd_(std::exchange(other.fd_, -1))
+  {}
+  socket &operator=(socket &&other) noexcept
+  {
+    if(this != &other)
+      {
+	reset();
+	fd_ = std::exchange(other.fd_, -1);
+      }
+    return *this;
+  }
+  socket(const socket &) = delete;
+  socket &operator=(const socket &) = delete;
+  ~socket()
+  {
+    reset();
+  }
+
+  int get() const noexcept { return fd_; }
+  int release() noexcept { return std::exchange(fd_, -1); }
+  void reset() noexcept
+  {
+    if(fd_ >= 0)
+      iw_sockets_close(fd_);
+    fd_ = -1;
+  }
+
+private:
+  int	fd_;
+};
+
+/****************************** RANGE ******************************/
+
+/*
+ * The range of an interface. It's large and doesn't change, so get
+ * it once and keep it around.
+ */
+class range
+{
+public:
+  /* Empty if the interface doesn't support Wireless Extensions.
+   * Quiet and reentrant, check we_version() if it matters. */
+  static std::optional<range> query(const socket &sock,
+				    const char *ifname) noexcept
+  {
+    std::optional<range>	r(std::in_place);
+
+    if(iw_get_range_info_r(sock.get(), ifname, &r->range_, nullptr) < 0)
+      return std::nullopt;
+    return r;
+  }
+
+  const iwrange &get() const noexcept { return range_; }
+  const iwrange *operator->() const noexcept { return &range_; }
+  int we_version() const noexcept { return range_.we_version_compiled; }
+
+  /* -1 if unknown */
+  int freq_to_channel(double freq) const noexcept
+  {
+    return iw_freq_to_channel(freq, &range_);
+  }
+  /* Signal and noise in dBm, see iw_qual_dbm() */
+  int qual_dbm(const iwqual &qual, int *level, int *noise) const noexcept
+  {
+    return iw_qual_dbm(&qual, &range_, 1, level, noise);
+  }
+
+  range() noexcept
+  {
+    std::memset(&range_, 0, sizeof(range_));
+  }
+
+private:
+  iwrange	range_;
+};
+
+/****************************** VIEWS ******************************/
+
+/*
+ * ESSID of a scanned cell, empty if hidden or unknown.
+ */
+inline std::string_view
+essid(const wireless_scan &cell) noexcept
+{
+  if(!cell.b.has_essid)
+    return std::string_view();
+  return std::string_view(cell.b.essid,
+			  strnlen(cell.b.essid, IW_ESSID_MAX_SIZE));
+}
+
+/*
+ * ESSID carried by a SIOCGIWESSID event, pointing in the raw results.
+ */
+inline std::string_view
+essid(const iw_event &event) noexcept
+{
+  if((event.u.essid.pointer == nullptr) || !event.u.essid.flags)
+    return std::string_view();
+  return std::string_view(static_cast<const char *>(event.u.essid.pointer),
+			  (event.u.essid.length > IW_ESSID_MAX_SIZE)
+			  ? IW_ESSID_MAX_SIZE : event.u.essid.length);
+}
+
+/*
+ * Contiguous cells, owned by someone else.
+ */
+class cell_span
+{
+public:
+  cell_span(const wireless_scan *cells, int num) noexcept
+    : cells_(cells), num_(cells ? num : 0)
+  {}
+
+  const wireless_scan *begin() const noexcept { return cells_; }
+  const wireless_scan *end() const noexcept { return cells_ + num_; }
+  std::size_t size() const noexcept { return num_; }
+  bool empty() const noexcept { return num_ == 0; }
+  const wireless_scan &operator[](std::size_t i) const noexcept
+  {
+    return cells_[i];
+  }
+
+private:
+  const wireless_scan *	cells_;
+  std::size_t		num_;
+};
+
+/*
+ * The events of raw scan results, decoded one at a time as the view
+ * is iterated. Pointers in the events (ESSID, custom data...) point
+ * in the raw results, which must outlive the iteration.
+ */
+class event_view
+{
+public:
+  class iterator
+  {
+  public:
+    using value_type = iw_event;
+    using reference = const iw_event &;
+    using pointer = const iw_event *;
+    using difference_type = std::ptrdiff_t;
+    using iterator_category = std::input_iterator_tag;
+
+    /* End of the events */
+    iterator() noexcept
+      : done_(true)
+    {}
+    iterator(unsigned char *data, int len, int we_version) noexcept
+      : we_version_(we_version), done_(false)
+    {
+      iw_init_event_stream(&stream_, reinterpret_cast<char *>(data), len);
+      ++*this;
+    }
+
+    reference operator*() const noexcept { return event_; }
+    pointer operator->() const noexcept { return &event_; }
+    iterator &operator++() noexcept
+    {
+      done_ = (iw_extract_event_stream(&stream_, &event_, we_version_) <= 0);
+      return *this;
+    }
+    /* Only comparing to the end makes sense */
+    bool operator==(const iterator &other) const noexcept
+    {
+      return done_ && other.done_;
+    }
+    bool operator!=(const iterator &other) const noexcept
+    {
+      return !(*this == other);
+    }
+
+  private:
+    stream_descr	stream_;
+    iw_event		event_;
+    int			we_version_ = 0;
+    bool		done_;
+  };
+
+  event_view(unsigned char *data, int len, int we_version) noexcept
+    : data_(data), len_(len), we_version_(we_version)
+  {}
+
+  iterator begin() const noexcept
+  {
+    return iterator(data_, len_, we_version_);
+  }
+  iterator end() const noexcept { return iterator(); }
+
+private:
+  unsigned char *	data_;
+  int			len_;
+  int			we_version_;
+};
+
+/***************************** SCANNING *****************************/
+
+/*
+ * Results of iw_scan()/iw_process_scan(). The storage is kept and
+ * reused from scan to scan, and released with the object.
+ */
+class scan_results
+{
+public:
+  scan_results() noexcept
+  {
+    iw_scan_init(&head_);
+  }
+  scan_results(scan_results &&other) noexcept
+    : head_(other.head_)
+  {
+    iw_scan_init(&other.head_);
+  }
+  scan_results &operator=(scan_results &&other) noexcept
+  {
+    if(this != &other)
+      {
+	iw_scan_free(&head_);
+	head_ = other.head_;
+	iw_scan_init(&other.head_);
+      }
+    return *this;
+  }
+  scan_results(const scan_results &) = delete;
+  scan_results &operator=(const scan_results &) = delete;
+  ~scan_results()
+  {
+    iw_scan_free(&head_);
+  }
+
+  /* Blocking, -1 on error */
+  int scan(const socket &sock, const char *ifname, int we_version) noexcept
+  {
+    return iw_scan(sock.get(), const_cast<char *>(ifname), we_version,
+		   &head_);
+  }
+  /* Non blocking, delay to wait for in ms, 0 when done, -1 on error */
+  int process(const socket &sock, const char *ifname,
+	      int we_version) noexcept
+  {
+    return iw_process_scan(sock.get(), const_cast<char *>(ifname),
+			   we_version, &head_);
+  }
+
+  void sort(int order) noexcept { iw_scan_sort(&head_, order); }
+  /* nullptr if not found */
+  const wireless_scan *find(const struct ether_addr &bssid) noexcept
+  {
+    return iw_scan_find(&head_, &bssid);
+  }
+
+  cell_span cells() const noexcept
+  {
+    return cell_span(head_.cells, head_.num_cells);
+  }
+  const wireless_scan *begin() const noexcept { return cells().begin(); }
+  const wireless_scan *end() const noexcept { return cells().end(); }
+  std::size_t size() const noexcept { return cells().size(); }
+
+  wireless_scan_head &get() noexcept { return head_; }
+
+private:
+  wireless_scan_head	head_;
+};
+
+/*
+ * Fixed storage for iw_scan_static()/iw_process_scan_static() : the
+ * raw results and the decoded cells are allocated once, with the
+ * object, and scanning never allocates.
+ */
+class scan_buffer
+{
+public:
+  explicit scan_buffer(int raw_len = IW_SCAN_MAX_DATA, int max_cells = 64)
+    : raw_(new unsigned char[raw_len]),
+      cells_(new wireless_scan[max_cells])
+  {
+    std::memset(&context_, 0, sizeof(context_));
+    context_.raw = raw_.get();
+    context_.raw_len = raw_len;
+    context_.cells = cells_.get();
+    context_.max_cells = max_cells;
+  }
+  scan_buffer(scan_buffer &&other) noexcept
+    : raw_(std::move(other.raw_)), cells_(std::move(other.cells_)),
+      context_(other.context_), we_version_(other.we_version_)
+  {
+    std::memset(&other.context_, 0, sizeof(other.context_));
+  }
+  scan_buffer &operator=(scan_buffer &&other) noexcept
+  {
+    if(this != &other)
+      {
+	raw_ = std::move(other.raw_);
+	cells_ = std::move(other.cells_);
+	context_ = other.context_;
+	we_version_ = other.we_version_;
+	std::memset(&other.context_, 0, sizeof(other.context_));
+      }
+    return *this;
+  }
+  scan_buffer(const scan_buffer &) = delete;
+  scan_buffer &operator=(const scan_buffer &) = delete;
+
+  /* Blocking, -1 on error */
+  int scan(const socket &sock, const char *ifname, int we_version) noexcept
+  {
+    we_version_ = we_version;
+    return iw_scan_static(sock.get(), const_cast<char *>(ifname),
+			  we_version, &context_);
+  }
+  /* Non blocking, delay to wait for in ms, 0 when done, -1 on error */
+  int process(const socket &sock, const char *ifname,
+	      int we_version) noexcept
+  {
+    we_version_ = we_version;
+    return iw_process_scan_static(sock.get(), const_cast<char *>(ifname),
+				  we_version, &context_);
+  }
+
+  /* Decoded cells of the last scan */
+  cell_span cells() const noexcept
+  {
+    return cell_span(context_.cells, context_.num_cells);
+  }
+  /* All the events of the last scan, undecoded */
+  event_view events() const noexcept
+  {
+    return event_view(context_.raw, context_.raw_used, we_version_);
+  }
+  /* IW_SCAN_TRUNC_XXX */
+  int truncated() const noexcept { return context_.truncated; }
+
+  const wireless_scan_static &get() const noexcept { return context_; }
+
+private:
+  std::unique_ptr<unsigned char[]>	raw_;
+  std::unique_ptr<wireless_scan[]>	cells_;
+  wireless_scan_static			context_;
+  int					we_version_ = 0;
+};
+
+} /* namespace iw */
+
+#endif	/* IWLIB_HPP */
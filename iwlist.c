@@ -1,10 +1,66 @@
 
 
 #include "iwlib.h" /* Header */
+#include "iwsink.h"
+#include "iwmetrics.h"
+#include "iwarrow.h"
+#include "iwhist.h"
+#include "iwqstat.h"
 #include <sys/time.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
 
 /****************************** TYPES ******************************/
 
+/* Output formats */
+#define IWLIST_FORMAT_NONE 0 /* Metrics only */
+#define IWLIST_FORMAT_JSON 1
+#define IWLIST_FORMAT_CSV 2  /* One row per cell, RFC 4180 quoting */
+#define IWLIST_FORMAT_TSV 3  /* One row per cell, backslash escapes */
+#define IWLIST_FORMAT_ARROW 4 /* Arrow IPC stream, typed columns */
+
+/* Flat formats have a fixed set of columns */
+#define IWLIST_COLUMNS "timestamp", "interface", "bssid", "essid", \
+                       "channel", "frequency_mhz", "mode", "signal_dbm", \
+                       "noise_dbm", "quality"
+
+/* Columns of the merged records (-M) */
+#define IWLIST_MERGE_COLUMNS "timestamp", "bssid", "essid", "frequency_mhz", \
+                             "signal_best_dbm", "signal_mean_dbm", \
+                             "interfaces"
+
+/* Stdio buffer for the flat formats, bulk loads produce a lot of rows */
+#define IWLIST_ROW_BUFSIZE (1024 * 1024)
+
+/*
+ * The cell being decoded, for consumers that need a whole cell
+ * at once rather than individual events.
+ */
+typedef struct iwscan_cell
+{
+  int valid;                           /* A cell is being decoded */
+  struct sockaddr ap_addr;             /* BSSID */
+  char essid[IW_ESSID_MAX_SIZE + 1];   /* Empty if hidden */
+  double freq;                         /* Hz, 0 if unknown */
+  int channel;                         /* -1 if unknown */
+  int mode;                            /* -1 if unknown */
+  int has_qual;
+  iwqual qual;
+} iwscan_cell;
+
+/*
+ * A cell kept by the top-K selection. The cell is not decoded, only
+ * the position of its events in the raw results is remembered.
+ */
+typedef struct iwscan_top
+{
+  int signal; /* dBm, INT_MIN if unknown */
+  int start;  /* Events of the cell in the raw results */
+  int end;
+} iwscan_top;
+
 /*
  * Scan state and meta-information, used to decode events...
  */
@@ -13,8 +69,60 @@ typedef struct iwscan_state
   /* State */
   int ap_num;    /* Access Point number 1->N */
   int val_index; /* Value in table 0->(N-1) */
+  iwscan_cell cell; /* Current cell */
+  /* Output */
+  FILE *out;     /* Where the results are formatted */
+  int format;    /* IWLIST_FORMAT_XXX */
+  char timestamp[32];  /* Scan time, pre-rendered for the flat formats */
+  char ifname[2 * IFNAMSIZ + 3]; /* Interface, pre-escaped */
+  iw_metrics *metrics; /* Exporter, or NULL */
+  int metrics_if;      /* Interface index in the exporter */
+  iw_arrow *arrow;     /* Arrow batch being accumulated */
+  int64_t time_ms;     /* Scan time, for Arrow and the history */
+  iw_hist *hist;       /* History log, or NULL */
+  iw_cell_table *table; /* Cells kept for merging, or NULL */
+  int64_t round_ms;     /* Start of the round, base of their time */
+  /* Top-K selection, a min-heap on the signal */
+  int top_k;         /* Max cells per scan, 0 = all */
+  iwscan_top *top;   /* top_k entries */
+  int top_num;
+  /* Raw results, kept across scans */
+  unsigned char *raw;
+  int raw_len;
+  /* Range of the interfaces, kept across scans */
+  iw_range_cache ranges;
+  iw_range_entry *range; /* Of the interface being scanned */
+  /* Scan health */
+  struct timespec start; /* Scan trigger */
+  unsigned int e2big;    /* Buffer too small retries */
+  unsigned int eagain;   /* Results not ready retries */
 } iwscan_state;
 
+/*
+ * Scanning loop options
+ */
+typedef struct iwlist_opts
+{
+  char *ifname[IW_CELL_MERGE_MAX]; /* Interfaces to scan */
+  int num_ifname;
+  int count;         /* Number of scans, 0 = forever */
+  int period;        /* Seconds between scan triggers */
+  char *sink;        /* Output sink spec, NULL = stdout */
+  iw_sink_opts sink_opts;
+  int format;        /* IWLIST_FORMAT_XXX */
+  char *metrics;     /* Metrics endpoint spec, or NULL */
+  int arrow_scans;   /* Scans per Arrow record batch */
+  char *history;     /* History log to append to, or NULL */
+  char *replay;      /* History log to dump, or NULL */
+  int64_t from;      /* Dump range, ms */
+  int64_t until;
+  int top_k;         /* Strongest cells per scan, 0 = all */
+  int merge;         /* One record per BSS, for all interfaces */
+  int qstat_rate;    /* Link quality samples per second, 0 = scan */
+  iw_iftracker *tracker; /* Interfaces come and go (-i any), or NULL */
+  char any_ifname[IW_CELL_MERGE_MAX][IFNAMSIZ + 1];
+} iwlist_opts;
+
 
 
 static void
@@ -193,29 +301,30 @@ print_scanning_token(struct stream_descr *stream, /* Stream of events */
   switch (event->cmd)
   {
   case SIOCGIWAP:
-    printf("{\n\"cell\":%02d,\n\"address\": \"%s\",\n", state->ap_num,
-           iw_saether_ntop(&event->u.ap_addr, buffer));
+    fprintf(state->out, "{\n\"cell\":%02d,\n\"address\": \"%s\",\n",
+            state->ap_num, iw_saether_ntop(&event->u.ap_addr, buffer));
     state->ap_num++;
     break;
   /*case SIOCGIWNWID:
     if (event->u.nwid.disabled)
-      printf("                    NWID:off/any\n");
+      fprintf(state->out, "                    NWID:off/any\n");
     else
-      printf("                    NWID:%X\n", event->u.nwid.value);
+      fprintf(state->out, "                    NWID:%X\n", event->u.nwid.value);
     break;*/
   case SIOCGIWFREQ:
   {
     double freq;      /* Frequency/channel */
     int channel = -1; /* Converted to channel */
     freq = iw_freq2float(&(event->u.freq));
-    /* Convert to channel if possible */
-    if (has_range)
-      channel = iw_freq_to_channel(freq, iw_range);
-    if(channel != -1)
-    {
-      printf("\"channel\":%d,\n", channel);
-      printf("\"frequency\": %lf,\n", freq);
-    }
+    /* Convert to channel if possible, the cell is kept either way */
+    if (freq < KILO)
+      channel = (int)freq;
+    else if (has_range)
+      channel = iw_range_freq_to_channel(state->range, freq);
+    if (channel >= 0)
+      fprintf(state->out, "\"channel\":%d,\n", channel);
+    if (freq >= KILO)
+      fprintf(state->out, "\"frequency\": %lf,\n", freq);
     //iw_print_freq(buffer, sizeof(buffer),
     //              freq, channel, event->u.freq.flags);
     //printf("                    %s\n", buffer);
@@ -225,11 +334,11 @@ print_scanning_token(struct stream_descr *stream, /* Stream of events */
     /* Note : event->u.mode is unsigned, no need to check <= 0 */
     if (event->u.mode >= IW_NUM_OPER_MODE)
       event->u.mode = IW_NUM_OPER_MODE;
-    printf("\"mode\":%d,\n\"modename\":\"%s\",\n}\n",
+    fprintf(state->out, "\"mode\":%d,\n\"modename\":\"%s\",\n}\n",
            event->u.mode, iw_operation_mode[event->u.mode]);
     break;
   /*case SIOCGIWNAME:
-    printf("                    Protocol:%-1.16s\n", event->u.name);
+    fprintf(state->out, "                    Protocol:%-1.16s\n", event->u.name);
     break;*/
   case SIOCGIWESSID:
   {
@@ -241,28 +350,28 @@ print_scanning_token(struct stream_descr *stream, /* Stream of events */
     {
       /* Does it have an ESSID index ? */
       if ((event->u.essid.flags & IW_ENCODE_INDEX) > 1)
-        printf("\"ESSID\":\"'%s' [%d]\",\n", essid,
+        fprintf(state->out, "\"ESSID\":\"'%s' [%d]\",\n", essid,
                (event->u.essid.flags & IW_ENCODE_INDEX));
       else
-        printf("\"ESSID\":\"%s\",\n", essid);
+        fprintf(state->out, "\"ESSID\":\"%s\",\n", essid);
     }
     else
-      printf("\"ESSID\":\"off/any/hidden\",\n");
+      fprintf(state->out, "\"ESSID\":\"off/any/hidden\",\n");
   }
   break;
   
   /*case SIOCGIWRATE:
     if (state->val_index == 0)
-      printf("                    Bit Rates:");
+      fprintf(state->out, "                    Bit Rates:");
     else if ((state->val_index % 5) == 0)
-      printf("\n                              ");
+      fprintf(state->out, "\n                              ");
     else
-      printf("; ");
+      fprintf(state->out, "; ");
     iw_print_bitrate(buffer, sizeof(buffer), event->u.bitrate.value);
-    printf("%s", buffer);
+    fprintf(state->out, "%s", buffer);
     if (stream->value == NULL)
     {
-      printf("\n");
+      fprintf(state->out, "\n");
       state->val_index = 0;
     }
     else
@@ -272,7 +381,7 @@ print_scanning_token(struct stream_descr *stream, /* Stream of events */
   case IWEVQUAL:
     iw_print_json_stats(buffer, sizeof(buffer),
                    &event->u.qual, iw_range, has_range);
-    printf("%s\n", buffer);
+    fprintf(state->out, "%s\n", buffer);
     break;
   /*case IWEVCUSTOM:
   {
@@ -280,7 +389,7 @@ print_scanning_token(struct stream_descr *stream, /* Stream of events */
     if ((event->u.data.pointer) && (event->u.data.length))
       memcpy(custom, event->u.data.pointer, event->u.data.length);
     custom[event->u.data.length] = '\0';
-    printf("                    Extra:%s\n", custom);
+    fprintf(state->out, "                    Extra:%s\n", custom);
   }*/
   break;
   default:
@@ -288,6 +397,610 @@ print_scanning_token(struct stream_descr *stream, /* Stream of events */
   } /* switch(event->cmd) */
 }
 
+/*------------------------------------------------------------------*/
+/*
+ * Escape a field for the flat formats.
+ * CSV : quote the field if needed, and double the quotes (RFC 4180).
+ * TSV : escape backslash, tab and end of lines with a backslash.
+ * Return the number of bytes written, buf must hold 2 * len + 2.
+ */
+static int
+iw_escape_field(char *buf,
+                const char *field,
+                int len,
+                int format)
+{
+  char *p = buf;
+  int i;
+
+  if (format == IWLIST_FORMAT_TSV)
+  {
+    for (i = 0; i < len; i++)
+      switch (field[i])
+      {
+      case '\\':
+        *p++ = '\\';
+        *p++ = '\\';
+        break;
+      case '\t':
+        *p++ = '\\';
+        *p++ = 't';
+        break;
+      case '\n':
+        *p++ = '\\';
+        *p++ = 'n';
+        break;
+      case '\r':
+        *p++ = '\\';
+        *p++ = 'r';
+        break;
+      default:
+        *p++ = field[i];
+      }
+    return (p - buf);
+  }
+
+  /* Only quote when needed, most fields don't */
+  if (strpbrk(field, ",\"\r\n") == NULL)
+  {
+    memcpy(buf, field, len);
+    return (len);
+  }
+  *p++ = '"';
+  for (i = 0; i < len; i++)
+  {
+    if (field[i] == '"')
+      *p++ = '"';
+    *p++ = field[i];
+  }
+  *p++ = '"';
+  return (p - buf);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Print the column names of the flat formats
+ */
+static int
+print_scanning_header(char *buf,
+                      int buflen,
+                      int format,
+                      int merge)
+{
+  static const char *const columns[] = {IWLIST_COLUMNS};
+  static const char *const merge_columns[] = {IWLIST_MERGE_COLUMNS};
+  const char *const *names = merge ? merge_columns : columns;
+  int num = merge ? sizeof(merge_columns) / sizeof(merge_columns[0])
+                  : sizeof(columns) / sizeof(columns[0]);
+  char sep = (format == IWLIST_FORMAT_TSV) ? '\t' : ',';
+  int len = 0;
+  int i;
+
+  for (i = 0; i < num; i++)
+    len += snprintf(buf + len, buflen - len, "%s%c", names[i],
+                    (i + 1 < num) ? sep : '\n');
+  return (len);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Render a time (ms since the epoch) as RFC 3339, UTC
+ */
+static void
+print_scanning_time(char *buf,
+                    int buflen,
+                    int64_t time_ms)
+{
+  time_t sec = time_ms / 1000;
+  struct tm tm;
+  int len;
+
+  gmtime_r(&sec, &tm);
+  len = strftime(buf, buflen, "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(buf + len, buflen - len, ".%03dZ", (int)(time_ms % 1000));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Prepare the per scan fields of the flat formats, so that rows
+ * only have to copy them
+ */
+static void
+print_scanning_prepare(struct iwscan_state *state,
+                       char *ifname)
+{
+  struct timespec now;
+  int len;
+
+  /* RFC 3339, UTC, millisecond resolution */
+  clock_gettime(CLOCK_REALTIME, &now);
+  state->time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  print_scanning_time(state->timestamp, sizeof(state->timestamp),
+                      state->time_ms);
+
+  len = iw_escape_field(state->ifname, ifname, strnlen(ifname, IFNAMSIZ),
+                        state->format);
+  state->ifname[len] = '\0';
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Print one cell as a row of the flat formats. Missing values are
+ * left empty.
+ */
+static void
+print_scanning_row(struct iwscan_state *state,
+                   struct iw_range *iw_range, /* Range info */
+                   int has_range)
+{
+  iwscan_cell *cell = &state->cell;
+  char sep = (state->format == IWLIST_FORMAT_TSV) ? '\t' : ',';
+  char row[256 + 2 * IW_ESSID_MAX_SIZE];
+  char *p = row;
+  int level;
+  int noise;
+  int dbm = 0;
+
+  p += sprintf(p, "%s%c%s%c", state->timestamp, sep, state->ifname, sep);
+  iw_saether_ntop(&cell->ap_addr, p);
+  p += strlen(p);
+  *p++ = sep;
+  p += iw_escape_field(p, cell->essid, strlen(cell->essid), state->format);
+  *p++ = sep;
+  if (cell->channel >= 0)
+    p += sprintf(p, "%d", cell->channel);
+  *p++ = sep;
+  if (cell->freq > 0)
+    p += sprintf(p, "%d", (int)((cell->freq + MEGA / 2) / MEGA));
+  *p++ = sep;
+  if (cell->mode >= 0)
+    p += sprintf(p, "%s", iw_operation_mode[cell->mode]);
+  *p++ = sep;
+  if (cell->has_qual)
+    dbm = iw_qual_dbm(&cell->qual, iw_range, has_range, &level, &noise);
+  if (dbm & IW_DBM_LEVEL)
+    p += sprintf(p, "%d", level);
+  *p++ = sep;
+  if (dbm & IW_DBM_NOISE)
+    p += sprintf(p, "%d", noise);
+  *p++ = sep;
+  if (cell->has_qual && !(cell->qual.updated & IW_QUAL_QUAL_INVALID))
+    p += sprintf(p, "%d", cell->qual.qual);
+  *p++ = '\n';
+
+  fwrite(row, 1, p - row, state->out);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Arrow wants valid UTF-8, ESSIDs are just bytes. Copy the ESSID,
+ * escaping invalid bytes as \xHH. Return the length.
+ */
+static int
+arrow_scanning_essid(char *buf,
+                     const char *essid)
+{
+  const unsigned char *s = (const unsigned char *)essid;
+  char *p = buf;
+  int n;
+  int i;
+
+  while (*s != '\0')
+  {
+    /* Length of the sequence, from the lead byte */
+    if (*s < 0x80)
+      n = 1;
+    else if ((*s >= 0xC2) && (*s <= 0xDF))
+      n = 2;
+    else if ((*s >= 0xE0) && (*s <= 0xEF))
+      n = 3;
+    else if ((*s >= 0xF0) && (*s <= 0xF4))
+      n = 4;
+    else
+      n = 0;
+    for (i = 1; i < n; i++)
+      if ((s[i] & 0xC0) != 0x80)
+        n = 0;
+
+    if (n == 0)
+    {
+      p += sprintf(p, "\\x%02X", *s++);
+      continue;
+    }
+    memcpy(p, s, n);
+    p += n;
+    s += n;
+  }
+  return (p - buf);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add one cell to the Arrow batch. Missing values are null.
+ */
+static void
+arrow_scanning_row(struct iwscan_state *state,
+                   struct iw_range *iw_range, /* Range info */
+                   int has_range)
+{
+  iwscan_cell *cell = &state->cell;
+  iw_arrow_row row;
+  char essid[4 * IW_ESSID_MAX_SIZE + 1];
+  int level;
+  int noise;
+  int dbm = 0;
+
+  memset(&row, 0, sizeof(row));
+  row.time = state->time_ms;
+  row.bssid = iw_ether_key((const unsigned char *)cell->ap_addr.sa_data);
+  if (cell->essid[0] != '\0')
+  {
+    row.has |= IW_ARROW_HAS(IW_ARROW_COL_ESSID);
+    row.essid = essid;
+    row.essid_len = arrow_scanning_essid(essid, cell->essid);
+  }
+  if (cell->freq > 0)
+  {
+    row.has |= IW_ARROW_HAS(IW_ARROW_COL_FREQ);
+    row.freq = (cell->freq + MEGA / 2) / MEGA;
+  }
+  if ((cell->channel >= 0) && (cell->channel <= 255))
+  {
+    row.has |= IW_ARROW_HAS(IW_ARROW_COL_CHANNEL);
+    row.channel = cell->channel;
+  }
+  if (cell->mode >= 0)
+  {
+    row.has |= IW_ARROW_HAS(IW_ARROW_COL_MODE);
+    row.mode = cell->mode;
+  }
+  if (cell->has_qual)
+    dbm = iw_qual_dbm(&cell->qual, iw_range, has_range, &level, &noise);
+  if (dbm & IW_DBM_LEVEL)
+  {
+    row.has |= IW_ARROW_HAS(IW_ARROW_COL_SIGNAL);
+    row.signal = level;
+  }
+  if (dbm & IW_DBM_NOISE)
+  {
+    row.has |= IW_ARROW_HAS(IW_ARROW_COL_NOISE);
+    row.noise = noise;
+  }
+  if (cell->has_qual && !(cell->qual.updated & IW_QUAL_QUAL_INVALID))
+  {
+    row.has |= IW_ARROW_HAS(IW_ARROW_COL_QUALITY);
+    row.quality = cell->qual.qual;
+  }
+
+  if (iw_arrow_append(state->arrow, &row) < 0)
+    fprintf(stderr, "Failed to add cell to Arrow batch\n");
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Add one cell to the history log
+ */
+static void
+hist_scanning_cell(struct iwscan_state *state,
+                   struct iw_range *iw_range, /* Range info */
+                   int has_range)
+{
+  iwscan_cell *cell = &state->cell;
+  iw_hist_cell hcell;
+  int level;
+  int noise;
+
+  memset(&hcell, 0, sizeof(hcell));
+  hcell.bssid = iw_ether_key((const unsigned char *)cell->ap_addr.sa_data);
+  if (cell->freq > 0)
+    hcell.freq = (cell->freq + MEGA / 2) / MEGA;
+  hcell.essid = cell->essid;
+  hcell.essid_len = strlen(cell->essid);
+  if (cell->has_qual &&
+      (iw_qual_dbm(&cell->qual, iw_range, has_range, &level, &noise) &
+       IW_DBM_LEVEL))
+  {
+    hcell.has_signal = 1;
+    hcell.signal = level;
+  }
+  iw_hist_add(state->hist, &hcell);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Keep one cell for merging with the other interfaces
+ */
+static void
+merge_scanning_cell(struct iwscan_state *state,
+                    int has_range)
+{
+  iwscan_cell *cell = &state->cell;
+
+  /* The channel was already looked up when decoding the frequency */
+  if (iw_cell_add_basic(state->table, state->time_ms - state->round_ms,
+                        &cell->ap_addr, cell->freq, cell->channel,
+                        cell->mode, cell->essid,
+                        cell->has_qual ? &cell->qual : NULL,
+                        has_range ? state->range : NULL) < 0)
+    fprintf(stderr, "Failed to keep cell for merging\n");
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * A complete cell has been decoded, pass it to whoever needs it
+ */
+static void
+scanning_cell_done(struct iwscan_state *state,
+                   struct iw_range *iw_range, /* Range info */
+                   int has_range)
+{
+  iwscan_cell *cell = &state->cell;
+
+  if (!cell->valid)
+    return;
+  if ((state->format == IWLIST_FORMAT_CSV) ||
+      (state->format == IWLIST_FORMAT_TSV))
+    print_scanning_row(state, iw_range, has_range);
+  else if (state->format == IWLIST_FORMAT_ARROW)
+    arrow_scanning_row(state, iw_range, has_range);
+  if (state->hist != NULL)
+    hist_scanning_cell(state, iw_range, has_range);
+  if (state->table != NULL)
+    merge_scanning_cell(state, has_range);
+  if (state->metrics_if >= 0)
+    iw_metrics_cell(state->metrics, state->metrics_if, &cell->ap_addr,
+                    cell->essid, cell->channel,
+                    cell->has_qual ? &cell->qual : NULL,
+                    iw_range, has_range);
+  cell->valid = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Store one element from the scanning results in the current cell
+ */
+static inline void
+record_scanning_token(struct iw_event *event, /* Extracted token */
+                      struct iwscan_state *state,
+                      struct iw_range *iw_range, /* Range info */
+                      int has_range)
+{
+  iwscan_cell *cell = &state->cell;
+
+  switch (event->cmd)
+  {
+  case SIOCGIWAP:
+    /* New cell, done with the previous one */
+    scanning_cell_done(state, iw_range, has_range);
+    memset(cell, 0, sizeof(iwscan_cell));
+    cell->valid = 1;
+    cell->channel = -1;
+    cell->mode = -1;
+    memcpy(&cell->ap_addr, &event->u.ap_addr, sizeof(struct sockaddr));
+    break;
+  case SIOCGIWFREQ:
+    cell->freq = iw_freq2float(&(event->u.freq));
+    if (cell->freq < KILO)
+    {
+      /* Driver gave us the channel */
+      cell->channel = (int)cell->freq;
+      cell->freq = 0;
+    }
+    else if (has_range)
+      cell->channel = iw_range_freq_to_channel(state->range, cell->freq);
+    if (cell->channel < 0)
+      cell->channel = -1;
+    break;
+  case SIOCGIWMODE:
+    cell->mode = (event->u.mode < IW_NUM_OPER_MODE) ? (int)event->u.mode
+                                                     : IW_NUM_OPER_MODE;
+    break;
+  case SIOCGIWESSID:
+    memset(cell->essid, '\0', sizeof(cell->essid));
+    if ((event->u.essid.flags) && (event->u.essid.pointer) &&
+        (event->u.essid.length))
+      memcpy(cell->essid, event->u.essid.pointer,
+             (event->u.essid.length > IW_ESSID_MAX_SIZE)
+                 ? IW_ESSID_MAX_SIZE
+                 : event->u.essid.length);
+    break;
+  case IWEVQUAL:
+    cell->has_qual = 1;
+    memcpy(&cell->qual, &event->u.qual, sizeof(iwqual));
+    break;
+  default:
+    break;
+  }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Decode a stream of events, and pass them to the outputs
+ */
+static void
+scanning_decode(struct iwscan_state *state,
+                unsigned char *data,
+                int len,
+                struct iw_range *iw_range, /* Range info */
+                int has_range,
+                int cells) /* Cells are needed */
+{
+  struct iw_event iwe;
+  struct stream_descr stream;
+  int ret;
+
+  iw_init_event_stream(&stream, (char *)data, len);
+  do
+  {
+    /* Extract an event and print it */
+    ret = iw_extract_event_stream(&stream, &iwe,
+                                  iw_range->we_version_compiled);
+    if (ret > 0)
+    {
+      if (cells)
+        record_scanning_token(&iwe, state, iw_range, has_range);
+      if (state->format == IWLIST_FORMAT_JSON)
+        print_scanning_token(&stream, &iwe, state, iw_range, has_range);
+    }
+  } while (ret > 0);
+  scanning_cell_done(state, iw_range, has_range);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Restore the heap property from the top down
+ */
+static void
+top_scanning_sift(iwscan_top *top,
+                  int num,
+                  int i)
+{
+  iwscan_top entry = top[i];
+  int child;
+
+  while ((child = 2 * i + 1) < num)
+  {
+    if ((child + 1 < num) && (top[child + 1].signal < top[child].signal))
+      child++;
+    if (entry.signal <= top[child].signal)
+      break;
+    top[i] = top[child];
+    i = child;
+  }
+  top[i] = entry;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Offer a cell to the top-K heap
+ */
+static void
+top_scanning_offer(struct iwscan_state *state,
+                   const iwscan_top *cell)
+{
+  iwscan_top *top = state->top;
+  int i;
+
+  if (state->top_num == state->top_k)
+  {
+    /* Replace the weakest */
+    if (cell->signal <= top[0].signal)
+      return;
+    top[0] = *cell;
+    top_scanning_sift(top, state->top_num, 0);
+    return;
+  }
+
+  /* Sift up */
+  i = state->top_num++;
+  while ((i > 0) && (top[(i - 1) / 2].signal > cell->signal))
+  {
+    top[i] = top[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  top[i] = *cell;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Keep the K strongest cells, without decoding them. A cell is
+ * dropped as soon as its signal shows it can't make it.
+ * The heap is then sorted, strongest first.
+ */
+static void
+top_scanning_select(struct iwscan_state *state,
+                    unsigned char *data,
+                    int len,
+                    struct iw_range *iw_range, /* Range info */
+                    int has_range)
+{
+  struct iw_event iwe;
+  struct stream_descr stream;
+  iwscan_top cell;
+  int in_cell = 0;
+  int pos = 0;
+  int level;
+  int noise;
+  int ret;
+  int i;
+
+  state->top_num = 0;
+  iw_init_event_stream(&stream, (char *)data, len);
+  while (1)
+  {
+    /* Where the next event starts, unless we are within one */
+    if (stream.value == NULL)
+      pos = stream.current - (char *)data;
+    ret = iw_extract_event_stream(&stream, &iwe,
+                                  iw_range->we_version_compiled);
+    if ((ret <= 0) || (iwe.cmd == SIOCGIWAP))
+    {
+      /* Done with the previous cell */
+      if (in_cell)
+      {
+        cell.end = (ret > 0) ? pos : len;
+        top_scanning_offer(state, &cell);
+      }
+      if (ret <= 0)
+        break;
+      in_cell = 1;
+      cell.signal = INT_MIN;
+      cell.start = pos;
+    }
+    else if ((iwe.cmd == IWEVQUAL) && in_cell)
+    {
+      /* Drivers without dBm are ranked on their own scale, the same
+       * for all cells */
+      if (iw_qual_dbm(&iwe.u.qual, iw_range, has_range, &level, &noise) &
+          IW_DBM_LEVEL)
+        cell.signal = level;
+      else if (!(iwe.u.qual.updated & IW_QUAL_LEVEL_INVALID))
+        cell.signal = iwe.u.qual.level;
+      else if (!(iwe.u.qual.updated & IW_QUAL_QUAL_INVALID))
+        cell.signal = iwe.u.qual.qual;
+      /* Can't make it, skip the rest of the cell */
+      if ((state->top_num == state->top_k) &&
+          (cell.signal <= state->top[0].signal))
+        in_cell = 0;
+    }
+  }
+
+  /* Heap sort, the weakest goes to the end */
+  for (i = state->top_num - 1; i > 0; i--)
+  {
+    cell = state->top[0];
+    state->top[0] = state->top[i];
+    state->top[i] = cell;
+    top_scanning_sift(state->top, i, 0);
+  }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Account for a scan in the metrics exporter
+ */
+static void
+scanning_health(struct iwscan_state *state,
+                char *ifname,
+                int status)
+{
+  iw_metrics_scan health;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  health.status = status;
+  health.duration = (now.tv_sec - state->start.tv_sec) +
+                    (now.tv_nsec - state->start.tv_nsec) / 1e9;
+  health.e2big = state->e2big;
+  health.eagain = state->eagain;
+
+  /* Failed scans don't go through the results */
+  if (status < 0)
+    state->metrics_if = iw_metrics_begin(state->metrics, ifname);
+  if (state->metrics_if >= 0)
+    iw_metrics_end(state->metrics, state->metrics_if, &health);
+}
+
 /*------------------------------------------------------------------*/
 /*
  * Perform a scanning on one device
@@ -296,15 +1009,15 @@ static int
 print_scanning_info(int skfd,
                     char *ifname,
                     char *args[], /* Command line args */
-                    int count)    /* Args count */
+                    int count,    /* Args count */
+                    struct iwscan_state *state)
 {
   struct iwreq wrq;
   struct iw_scan_req scanopt;    /* Options for 'set' */
   int scanflags = 0;             /* Flags for scan */
-  unsigned char *buffer = NULL;  /* Results */
-  int buflen = IW_SCAN_MAX_DATA; /* Min for compat WE<17 */
-  struct iw_range range;
-  int has_range;
+  unsigned char *buffer = state->raw; /* Results, reused across scans */
+  int buflen = state->raw_len ? state->raw_len : IW_SCAN_MAX_DATA;
+  struct iw_range *range;
   struct timeval tv;      /* Select timeout */
   int timeout = 15000000; /* 15s */
 
@@ -312,16 +1025,26 @@ print_scanning_info(int skfd,
   args = args;
   count = count;
 
-  /* Get range stuff */
-  has_range = (iw_get_range_info(skfd, ifname, &range) >= 0);
+  /* Reset the state, but keep the output settings */
+  state->ap_num = 1;
+  state->val_index = 0;
+  state->cell.valid = 0;
+  state->e2big = 0;
+  state->eagain = 0;
+  state->metrics_if = -1;
+  clock_gettime(CLOCK_MONOTONIC, &state->start);
+
+  /* Get range stuff, from the driver only the first time */
+  state->range = iw_range_cache_get(skfd, &state->ranges, ifname);
 
   /* Check if the interface could support scanning. */
-  if ((!has_range) || (range.we_version_compiled < 14))
+  if ((state->range == NULL) || (state->range->range.we_version_compiled < 14))
   {
     fprintf(stderr, "%-8.16s  Interface doesn't support scanning.\n\n",
             ifname);
     return (-1);
   }
+  range = &state->range->range;
 
   /* Init timeout value -> 250ms between set and first get */
   tv.tv_sec = 0;
@@ -341,6 +1064,8 @@ print_scanning_info(int skfd,
     {
       fprintf(stderr, "%-8.16s  Interface doesn't support scanning : %s\n\n",
               ifname, strerror(errno));
+      /* It may be another driver next time */
+      iw_range_cache_invalidate(&state->ranges, ifname);
       return (-1);
     }
     /* If we don't have the permission to initiate the scan, we may
@@ -381,16 +1106,19 @@ print_scanning_info(int skfd,
       unsigned char *newbuf;
 
     realloc:
-      /* (Re)allocate the buffer - realloc(NULL, len) == malloc(len) */
-      newbuf = realloc(buffer, buflen);
-      if (newbuf == NULL)
+      /* Grow the buffer - realloc(NULL, len) == malloc(len).
+       * It's kept for the next scans, so this settles quickly */
+      if (buflen > state->raw_len)
       {
-        if (buffer)
-          free(buffer);
-        fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
-        return (-1);
+        newbuf = realloc(buffer, buflen);
+        if (newbuf == NULL)
+        {
+          fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+          return (-1);
+        }
+        buffer = state->raw = newbuf;
+        state->raw_len = buflen;
       }
-      buffer = newbuf;
 
       /* Try to read the results */
       wrq.u.data.pointer = buffer;
@@ -399,7 +1127,7 @@ print_scanning_info(int skfd,
       if (iw_get_ext(skfd, ifname, SIOCGIWSCAN, &wrq) < 0)
       {
         /* Check if buffer was too small (WE-17 only) */
-        if ((errno == E2BIG) && (range.we_version_compiled > 16))
+        if ((errno == E2BIG) && (range->we_version_compiled > 16))
         {
           /* Some driver may return very large scan results, either
 		   * because there are many cells, or because they have many
@@ -409,6 +1137,8 @@ print_scanning_info(int skfd,
 		   * as we don't know in advance the size of the array, we try
 		   * various increasing sizes. Jean II */
 
+          state->e2big++;
+
           /* Check if the driver gave us any hints. */
           if (wrq.u.data.length > buflen)
             buflen = wrq.u.data.length;
@@ -422,6 +1152,7 @@ print_scanning_info(int skfd,
         /* Check if results not available yet */
         if (errno == EAGAIN)
         {
+          state->eagain++;
           /* Restart timer for only 100ms*/
           tv.tv_sec = 0;
           tv.tv_usec = 100000;
@@ -431,9 +1162,9 @@ print_scanning_info(int skfd,
         }
 
         /* Bad error */
-        free(buffer);
         fprintf(stderr, "%-8.16s  Failed to read scan data : %s\n\n",
                 ifname, strerror(errno));
+        iw_range_cache_invalidate(&state->ranges, ifname);
         return (-2);
       }
       else
@@ -445,57 +1176,1041 @@ print_scanning_info(int skfd,
        * if scan event, read results. All errors bad & no reset timeout */
   }
  
+  /* Results are here, the exporter wants them in one go */
+  if (state->metrics != NULL)
+    state->metrics_if = iw_metrics_begin(state->metrics, ifname);
+
   if (wrq.u.data.length)
   {
-    struct iw_event iwe;
-    struct stream_descr stream;
-    struct iwscan_state state = {.ap_num = 1, .val_index = 0};
-    int ret;
+    int cells = ((state->metrics_if >= 0) ||
+                 (state->format == IWLIST_FORMAT_CSV) ||
+                 (state->format == IWLIST_FORMAT_TSV) ||
+                 (state->format == IWLIST_FORMAT_ARROW) ||
+                 (state->hist != NULL) || (state->table != NULL));
+    int i;
+
+    if (cells)
+      print_scanning_prepare(state, ifname);
+    if (state->hist != NULL)
+      iw_hist_begin(state->hist, state->time_ms);
 
     //printf("%-8.16s  Scan completed :\n", ifname);
-    iw_init_event_stream(&stream, (char *)buffer, wrq.u.data.length);
-    do
+    if (state->top_k > 0)
     {
-      /* Extract an event and print it */
-      ret = iw_extract_event_stream(&stream, &iwe,
-                                    range.we_version_compiled);
-      if (ret > 0)
-        {
-          //printf("%s\n",",{");
-          print_scanning_token(&stream, &iwe, &state,
-                             &range, has_range);
-           //printf("%s\n","}");
-        }
-    } while (ret > 0);
+      /* Only the strongest cells are decoded, strongest first */
+      top_scanning_select(state, buffer, wrq.u.data.length, range, 1);
+      for (i = 0; i < state->top_num; i++)
+        scanning_decode(state, buffer + state->top[i].start,
+                        state->top[i].end - state->top[i].start,
+                        range, 1, cells);
+    }
+    else
+      scanning_decode(state, buffer, wrq.u.data.length, range, 1, cells);
+    if (state->hist != NULL)
+      iw_hist_end(state->hist);
   }
-  else
-    printf("{\"error\": \"%-8.16s  No scan results\"}\n", ifname);
-  free(buffer);
+  else if (state->format == IWLIST_FORMAT_JSON)
+    fprintf(state->out, "{\"error\": \"%-8.16s  No scan results\"}\n",
+            ifname);
+
+  if (state->metrics != NULL)
+    scanning_health(state, ifname, 0);
   return (0);
 }
 
-/******************************* MAIN ********************************/
-
 /*------------------------------------------------------------------*/
 /*
- * The main !
+ * Scan once and hand the results over to the sink.
+ * The results are formatted in memory, the sink thread does the
+ * actual (and possibly slow) delivery.
  */
-int main(int argc,
-         char **argv)
+static int
+sink_scanning_info(int skfd,
+                   char *ifname,
+                   struct iwscan_state *state,
+                   iw_sink *sink)
 {
-  int skfd; /* generic raw socket desc.	*/
+  char *data = NULL;
+  size_t len = 0;
+  FILE *out;
+  int ret;
 
-  /* Create a channel to the NET kernel. */
-  if ((skfd = iw_sockets_open()) < 0)
+  out = open_memstream(&data, &len);
+  if (out == NULL)
   {
-    perror("socket");
-    return -1;
+    fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+    return (-1);
+  }
+  state->out = out;
+  ret = print_scanning_info(skfd, ifname, NULL, 0, state);
+  state->out = NULL;
+  fclose(out);
+
+  /* Nothing worth sending */
+  if ((ret < 0) || (len == 0))
+  {
+    free(data);
+    return (ret);
+  }
+  /* The sink owns data from now on, even if it drops it */
+  iw_sink_submit(sink, data, len);
+  return (ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Write out the Arrow rows accumulated so far, as a dictionary batch
+ * and a record batch. Datagrams get the schema in front of each record,
+ * so there each record also ends the stream.
+ */
+static int
+arrow_scanning_flush(struct iwscan_state *state,
+                     iw_sink *sink,
+                     int standalone)
+{
+  iw_arrow_buf buf;
+  int ret = 0;
+
+  if (state->arrow->rows == 0)
+    return (0);
+
+  memset(&buf, 0, sizeof(buf));
+  /* Always flush, so that the batch starts over */
+  if (iw_arrow_flush(state->arrow, &buf) < 0)
+    ret = -1;
+  if (standalone && (ret == 0))
+    ret = iw_arrow_eos(&buf);
+  if (ret < 0)
+  {
+    fprintf(stderr, "Failed to build Arrow batch, rows lost\n");
+    free(buf.data);
+    return (-1);
+  }
+
+  if (sink != NULL)
+    iw_sink_submit(sink, (char *)buf.data, buf.len);
+  else
+  {
+    fwrite(buf.data, 1, buf.len, stdout);
+    free(buf.data);
+  }
+  return (0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Escape a JSON string. buf must hold 6 * len + 1.
+ */
+static int
+iw_escape_json(char *buf,
+               const char *field,
+               int len)
+{
+  char *p = buf;
+  int i;
+
+  for (i = 0; i < len; i++)
+  {
+    unsigned char c = field[i];
+
+    if ((c == '"') || (c == '\\'))
+    {
+      *p++ = '\\';
+      *p++ = c;
+    }
+    else if (c < 0x20)
+      p += sprintf(p, "\\u%04x", c);
+    else
+      *p++ = c;
+  }
+  *p = '\0';
+  return (p - buf);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Print the merged cells of a round, one record per BSS
+ */
+static void
+merge_scanning_print(struct iwscan_state *state,
+                     iwlist_opts *opts,
+                     iw_cell_table *tables,
+                     iw_cell_merge_result *result,
+                     FILE *out)
+{
+  char sep = (opts->format == IWLIST_FORMAT_TSV) ? '\t' : ',';
+  int json = (opts->format == IWLIST_FORMAT_JSON);
+  char essid[IW_ESSID_MAX_SIZE + 1];
+  char escaped[6 * IW_ESSID_MAX_SIZE + 1];
+  char timestamp[32];
+  int i;
+  int t;
+
+  for (i = 0; i < result->num; i++)
+  {
+    iw_cell_merged *merged = &result->cells[i];
+    iw_cell_table *table = &tables[merged->best_table];
+    iw_cell *best = &table->hot[merged->best_cell];
+    int first = 1;
+    int len;
+
+    print_scanning_time(timestamp, sizeof(timestamp),
+                        state->round_ms + merged->time);
+    iw_cell_essid(table, best, essid);
+    if (json)
+    {
+      iw_escape_json(escaped, essid, strlen(essid));
+      fprintf(out, "{\"timestamp\":\"%s\",\"bssid\":\"%02X:%02X:%02X:%02X:"
+                   "%02X:%02X\",\"essid\":\"%s\"",
+              timestamp,
+              (int)(merged->bssid >> 40) & 0xFF,
+              (int)(merged->bssid >> 32) & 0xFF,
+              (int)(merged->bssid >> 24) & 0xFF,
+              (int)(merged->bssid >> 16) & 0xFF,
+              (int)(merged->bssid >> 8) & 0xFF, (int)merged->bssid & 0xFF,
+              escaped);
+      if (best->flags & IW_CELL_FREQ)
+        fprintf(out, ",\"frequency_mhz\":%d", best->freq);
+      if (merged->num_signal)
+        fprintf(out, ",\"signal_best_dbm\":%d,\"signal_mean_dbm\":%d",
+                merged->best_signal, merged->mean_signal);
+      fprintf(out, ",\"interfaces\":[");
+      for (t = 0; t < opts->num_ifname; t++)
+        if (merged->tables & (1U << t))
+        {
+          iw_escape_json(escaped, opts->ifname[t],
+                         strnlen(opts->ifname[t], IFNAMSIZ));
+          fprintf(out, "%s\"%s\"", first ? "" : ",", escaped);
+          first = 0;
+        }
+      fprintf(out, "]}\n");
+      continue;
+    }
+
+    len = iw_escape_field(escaped, essid, strlen(essid), opts->format);
+    escaped[len] = '\0';
+    fprintf(out, "%s%c%02X:%02X:%02X:%02X:%02X:%02X%c%s%c",
+            timestamp, sep,
+            (int)(merged->bssid >> 40) & 0xFF,
+            (int)(merged->bssid >> 32) & 0xFF,
+            (int)(merged->bssid >> 24) & 0xFF,
+            (int)(merged->bssid >> 16) & 0xFF,
+            (int)(merged->bssid >> 8) & 0xFF, (int)merged->bssid & 0xFF,
+            sep, escaped, sep);
+    if (best->flags & IW_CELL_FREQ)
+      fprintf(out, "%d", best->freq);
+    fputc(sep, out);
+    if (merged->num_signal)
+      fprintf(out, "%d%c%d", merged->best_signal, sep, merged->mean_signal);
+    else
+      fputc(sep, out);
+    fputc(sep, out);
+    /* Interface names can't contain the separators */
+    for (t = 0; t < opts->num_ifname; t++)
+      if (merged->tables & (1U << t))
+      {
+        fprintf(out, "%s%s", first ? "" : "+", opts->ifname[t]);
+        first = 0;
+      }
+    fputc('\n', out);
+  }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Scan all the interfaces, keep their cells, and output one record
+ * per BSS
+ */
+static void
+merge_scanning_round(int skfd,
+                     iwlist_opts *opts,
+                     struct iwscan_state *state,
+                     iw_cell_table *tables,
+                     iw_cell_merge_result *result,
+                     iw_sink *sink)
+{
+  iw_cell_table *list[IW_CELL_MERGE_MAX];
+  struct timespec now;
+  char *data = NULL;
+  size_t len = 0;
+  FILE *out = stdout;
+  int i;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  state->round_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+  /* Cells only, the output comes after the merge */
+  state->format = IWLIST_FORMAT_NONE;
+  state->out = stdout;
+  for (i = 0; i < opts->num_ifname; i++)
+  {
+    iw_cell_reset(&tables[i]);
+    state->table = &tables[i];
+    list[i] = &tables[i];
+    if ((print_scanning_info(skfd, opts->ifname[i], NULL, 0, state) < 0) &&
+        (state->metrics != NULL))
+      scanning_health(state, opts->ifname[i], -1);
+  }
+  state->table = NULL;
+  state->format = opts->format;
+
+  if ((iw_cell_merge(list, opts->num_ifname, result) <= 0) ||
+      (opts->format == IWLIST_FORMAT_NONE))
+    return;
+
+  if (sink != NULL)
+  {
+    out = open_memstream(&data, &len);
+    if (out == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      return;
+    }
+  }
+  merge_scanning_print(state, opts, tables, result, out);
+  if (sink != NULL)
+  {
+    fclose(out);
+    iw_sink_submit(sink, data, len);
+  }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Set when we are asked to terminate, so that buffered output and
+ * queued scans are not lost
+ */
+static volatile sig_atomic_t scanning_stop = 0;
+
+/*------------------------------------------------------------------*/
+/*
+ * Take the list of interfaces from the tracker.
+ * Return the mask of those that weren't in the list before.
+ */
+static unsigned int
+scanning_track(iwlist_opts *opts)
+{
+  iw_iftracker *tracker = opts->tracker;
+  char old[IW_CELL_MERGE_MAX][IFNAMSIZ + 1];
+  int num_old = opts->num_ifname;
+  unsigned int added = 0;
+  int i;
+  int j;
+
+  memcpy(old, opts->any_ifname, sizeof(old));
+  for (i = 0; (i < tracker->num) && (i < IW_CELL_MERGE_MAX); i++)
+  {
+    strcpy(opts->any_ifname[i], tracker->ifaces[i].name);
+    opts->ifname[i] = opts->any_ifname[i];
+    for (j = 0; j < num_old; j++)
+      if (!strcmp(old[j], opts->any_ifname[i]))
+        break;
+    if (j == num_old)
+      added |= 1U << i;
+  }
+  opts->num_ifname = i;
+  return (added);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Scan one interface, and deliver the results
+ */
+static void
+scanning_one(int skfd,
+             char *ifname,
+             struct iwscan_state *state,
+             iw_sink *sink,
+             int bulk)
+{
+  int ret;
+
+  if (sink != NULL)
+    ret = sink_scanning_info(skfd, ifname, state, sink);
+  else
+  {
+    state->out = stdout;
+    ret = print_scanning_info(skfd, ifname, NULL, 0, state);
+    /* Bulk formats are flushed when the buffer is full */
+    if (!bulk)
+      fflush(stdout);
+  }
+
+  /* Failed scans never reach the results, account for them here */
+  if ((ret < 0) && (state->metrics != NULL))
+    scanning_health(state, ifname, ret);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Wait for the next trigger, absolute so that we don't drift.
+ * When tracking interfaces, the new ones are scanned right away
+ * rather than at the next trigger (merged results wait for it).
+ */
+static void
+scanning_wait(int skfd,
+              iwlist_opts *opts,
+              struct iwscan_state *state,
+              iw_sink *sink,
+              int bulk,
+              struct timespec *next)
+{
+  struct pollfd pfd;
+  struct timespec now;
+  unsigned int added;
+  int ret;
+  int timeout;
+  int i;
+
+  if (opts->tracker == NULL)
+  {
+    while ((clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                            next, NULL) == EINTR) &&
+           !scanning_stop)
+      ;
+    return;
+  }
+
+  while (!scanning_stop)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout = (next->tv_sec - now.tv_sec) * 1000 +
+              (next->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    if (timeout <= 0)
+      break;
+
+    pfd.fd = opts->tracker->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout) <= 0)
+      continue;
+    ret = iw_iftracker_update(opts->tracker);
+    /* Ranges of interfaces reloaded or gone are read again */
+    iw_range_cache_sync(&state->ranges, opts->tracker);
+    if (ret <= 0)
+      continue;
+
+    added = scanning_track(opts);
+    if (opts->merge)
+      continue;
+    for (i = 0; i < opts->num_ifname; i++)
+      if (added & (1U << i))
+        scanning_one(skfd, opts->ifname[i], state, sink, bulk);
+  }
+}
+
+static void
+scanning_sighandler(int signum)
+{
+  signum = signum;
+  scanning_stop = 1;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Scan periodically. Scans are triggered at a fixed rate, whatever
+ * the time it takes to deliver the results.
+ */
+static int
+scanning_loop(int skfd,
+              iwlist_opts *opts)
+{
+  struct iwscan_state state;
+  iw_sink *sink = NULL;
+  iw_metrics *metrics = NULL;
+  struct timespec next;
+  struct sigaction sa;
+  iw_arrow *arrow = NULL;
+  iw_arrow_buf schema;
+  int flat = ((opts->format == IWLIST_FORMAT_CSV) ||
+              (opts->format == IWLIST_FORMAT_TSV));
+  int bulk = (flat || (opts->format == IWLIST_FORMAT_ARROW));
+  int standalone = 0;
+  int pending = 0;
+  iw_cell_table *tables = NULL;
+  iw_cell_merge_result result;
+  char header[256];
+  int i;
+  int n;
+
+  /* Column names, at the start of stdout or of each file */
+  if (flat)
+  {
+    opts->sink_opts.header = header;
+    opts->sink_opts.header_len = print_scanning_header(header, sizeof(header),
+                                                       opts->format,
+                                                       opts->merge);
+  }
+
+  /* Same for the Arrow schema. Datagrams carry one record each, with
+   * the schema in front (see iw_sink_unix_write()), so there each
+   * record is a complete stream */
+  memset(&schema, 0, sizeof(schema));
+  if (opts->format == IWLIST_FORMAT_ARROW)
+  {
+    arrow = iw_arrow_new();
+    if ((arrow == NULL) || (iw_arrow_schema(arrow, &schema) < 0))
+    {
+      iw_arrow_free(arrow);
+      free(schema.data);
+      return (-1);
+    }
+    opts->sink_opts.header = (char *)schema.data;
+    opts->sink_opts.header_len = schema.len;
+    standalone = ((opts->sink != NULL) &&
+                  !strncmp(opts->sink, IW_SINK_UNIX_PREFIX,
+                           strlen(IW_SINK_UNIX_PREFIX)));
+  }
+
+  if ((opts->sink != NULL) && (opts->format != IWLIST_FORMAT_NONE))
+  {
+    sink = iw_sink_open(opts->sink, &opts->sink_opts);
+    if (sink == NULL)
+    {
+      iw_arrow_free(arrow);
+      free(schema.data);
+      return (-1);
+    }
+  }
+  if (opts->metrics != NULL)
+  {
+    metrics = iw_metrics_open(opts->metrics);
+    if (metrics == NULL)
+    {
+      iw_sink_close(sink, NULL);
+      iw_arrow_free(arrow);
+      free(schema.data);
+      return (-1);
+    }
+  }
+
+  memset(&state, 0, sizeof(state));
+  state.format = opts->format;
+  state.metrics = metrics;
+  state.arrow = arrow;
+  state.top_k = opts->top_k;
+  memset(&result, 0, sizeof(result));
+  if (opts->merge)
+  {
+    /* The tracker may bring more interfaces later */
+    tables = calloc((opts->tracker != NULL) ? IW_CELL_MERGE_MAX
+                                             : opts->num_ifname,
+                    sizeof(iw_cell_table));
+    if (tables == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      iw_metrics_close(metrics);
+      iw_sink_close(sink, NULL);
+      return (-1);
+    }
+  }
+  if (state.top_k > 0)
+  {
+    state.top = malloc(state.top_k * sizeof(iwscan_top));
+    if (state.top == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      free(tables);
+      iw_metrics_close(metrics);
+      iw_sink_close(sink, NULL);
+      iw_arrow_free(arrow);
+      free(schema.data);
+      return (-1);
+    }
+  }
+  if (opts->history != NULL)
+  {
+    state.hist = iw_hist_open(opts->history);
+    if (state.hist == NULL)
+    {
+      free(state.top);
+      free(tables);
+      iw_metrics_close(metrics);
+      iw_sink_close(sink, NULL);
+      iw_arrow_free(arrow);
+      free(schema.data);
+      return (-1);
+    }
+  }
+
+  /* Bulk formats are for bulk loads, favour throughput over latency */
+  if ((sink == NULL) && bulk)
+  {
+    setvbuf(stdout, NULL, _IOFBF, IWLIST_ROW_BUFSIZE);
+    fwrite(opts->sink_opts.header, 1, opts->sink_opts.header_len, stdout);
+  }
+
+  /* Terminate cleanly, we may have a lot buffered */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = scanning_sighandler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (n = 0; (opts->count == 0) || (n < opts->count); n++)
+  {
+    if (n > 0)
+    {
+      next.tv_sec += opts->period;
+      scanning_wait(skfd, opts, &state, sink, bulk, &next);
+    }
+    if (scanning_stop)
+      break;
+
+    if (opts->merge)
+    {
+      merge_scanning_round(skfd, opts, &state, tables, &result, sink);
+      if ((sink == NULL) && !bulk)
+        fflush(stdout);
+      continue;
+    }
+
+    for (i = 0; i < opts->num_ifname; i++)
+      scanning_one(skfd, opts->ifname[i], &state, sink, bulk);
+
+    /* Several scans per Arrow batch amortise the metadata */
+    if ((arrow != NULL) && (++pending >= opts->arrow_scans))
+    {
+      arrow_scanning_flush(&state, sink, standalone);
+      pending = 0;
+    }
+  }
+
+  iw_metrics_close(metrics);
+  if (arrow != NULL)
+  {
+    /* Leftover scans, and terminate the stream on stdout */
+    arrow_scanning_flush(&state, sink, standalone);
+    if (sink == NULL)
+    {
+      iw_arrow_buf eos;
+
+      memset(&eos, 0, sizeof(eos));
+      if (iw_arrow_eos(&eos) == 0)
+        fwrite(eos.data, 1, eos.len, stdout);
+      free(eos.data);
+    }
+  }
+  fflush(stdout);
+
+  if (sink != NULL)
+  {
+    iw_sink_stats stats;
+
+    iw_sink_close(sink, &stats);
+    if (stats.dropped || stats.errors)
+      fprintf(stderr, "%lu scans dropped, %lu lost on write errors\n",
+              stats.dropped, stats.errors);
+  }
+  iw_hist_close(state.hist);
+  if (tables != NULL)
+  {
+    for (i = 0; i < ((opts->tracker != NULL) ? IW_CELL_MERGE_MAX
+                                             : opts->num_ifname); i++)
+      iw_cell_free(&tables[i]);
+    free(tables);
+  }
+  iw_cell_merge_free(&result);
+  free(state.top);
+  free(state.raw);
+  iw_range_cache_free(&state.ranges);
+  /* The sink was using the schema as header */
+  iw_arrow_free(arrow);
+  free(schema.data);
+  return (0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Dump the scans of a history log in a time range, as a flat format
+ */
+static int
+hist_dump(iwlist_opts *opts)
+{
+  iw_hist_reader *reader;
+  iw_hist_cell cell;
+  int format = (opts->format == IWLIST_FORMAT_TSV) ? IWLIST_FORMAT_TSV
+                                                   : IWLIST_FORMAT_CSV;
+  char sep = (format == IWLIST_FORMAT_TSV) ? '\t' : ',';
+  char essid[2 * 256 + 2];
+  int64_t time;
+  int num_cells;
+  int ret;
+
+  reader = iw_hist_map(opts->replay);
+  if (reader == NULL)
+    return (-1);
+  setvbuf(stdout, NULL, _IOFBF, IWLIST_ROW_BUFSIZE);
+  printf("timestamp%cbssid%cessid%cfrequency_mhz%csignal_dbm\n",
+         sep, sep, sep, sep);
+
+  ret = iw_hist_seek(reader, opts->from);
+  while ((ret > 0) &&
+         ((ret = iw_hist_next_scan(reader, &time, &num_cells)) > 0))
+  {
+    if (time > opts->until)
+      break;
+    while ((ret = iw_hist_next_cell(reader, &cell)) > 0)
+    {
+      char field[256 + 1];
+      int len;
+
+      memcpy(field, cell.essid, cell.essid_len);
+      field[cell.essid_len] = '\0';
+      len = iw_escape_field(essid, field, cell.essid_len, format);
+      essid[len] = '\0';
+      printf("%lld.%03d%c%02X:%02X:%02X:%02X:%02X:%02X%c%s%c",
+             (long long)(time / 1000), (int)(time % 1000), sep,
+             (int)(cell.bssid >> 40) & 0xFF, (int)(cell.bssid >> 32) & 0xFF,
+             (int)(cell.bssid >> 24) & 0xFF, (int)(cell.bssid >> 16) & 0xFF,
+             (int)(cell.bssid >> 8) & 0xFF, (int)cell.bssid & 0xFF,
+             sep, essid, sep);
+      if (cell.freq)
+        printf("%d", cell.freq);
+      putchar(sep);
+      if (cell.has_signal)
+        printf("%d", cell.signal);
+      putchar('\n');
+    }
+    if (ret < 0)
+      break;
+    ret = 1;
+  }
+  fflush(stdout);
+  iw_hist_unmap(reader);
+
+  if (ret < 0)
+  {
+    fprintf(stderr, "History %s is corrupted\n", opts->replay);
+    return (-1);
+  }
+  return (0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Print the distribution of a value over a window
+ */
+static void
+qstat_print_value(const char *name,
+                  const iw_qstat_value *value,
+                  int format)
+{
+  char sep = (format == IWLIST_FORMAT_TSV) ? '\t' : ',';
+
+  if (format == IWLIST_FORMAT_JSON)
+  {
+    printf(",\"%s\":{\"count\":%u", name, value->count);
+    if (value->count)
+      printf(",\"min\":%d,\"p50\":%d,\"p95\":%d,\"p99\":%d,"
+             "\"max\":%d,\"mean\":%.1f",
+             value->min, value->p50, value->p95, value->p99, value->max,
+             value->mean);
+    putchar('}');
+  }
+  else if (value->count)
+    printf("%c%u%c%d%c%d%c%d%c%d%c%d%c%.1f", sep, value->count,
+           sep, value->min, sep, value->p50, sep, value->p95,
+           sep, value->p99, sep, value->max, sep, value->mean);
+  else
+    printf("%c0%c%c%c%c%c%c", sep, sep, sep, sep, sep, sep, sep);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Sample the link quality of an interface at a high rate, and print
+ * a summary of each window (-p) rather than the samples
+ */
+static int
+qstat_loop(int skfd,
+           iwlist_opts *opts)
+{
+  static const char *const values[] = {"quality", "level", "noise"};
+  static const char *const stats[] = {"count", "min", "p50", "p95", "p99",
+                                      "max", "mean"};
+  char *ifname = opts->ifname[0];
+  char sep = (opts->format == IWLIST_FORMAT_TSV) ? '\t' : ',';
+  struct sigaction sa;
+  iw_qstat qstat;
+  iw_qstat_window window;
+  long window_ticks = (long)opts->period * opts->qstat_rate;
+  long ticks = 0;
+  int windows = 0;
+  int ret;
+  int i;
+  int j;
+
+  if (iw_qstat_open(&qstat, skfd, ifname, opts->qstat_rate) < 0)
+  {
+    fprintf(stderr, "%-8.16s  Can't sample link quality : %s\n",
+            ifname, strerror(errno));
+    return (-1);
+  }
+
+  /* Not restarted, so that the timer read is interrupted */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = scanning_sighandler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if ((opts->format == IWLIST_FORMAT_CSV) ||
+      (opts->format == IWLIST_FORMAT_TSV))
+  {
+    printf("timestamp%cinterface%cduration%csamples%cerrors%cmissed%c"
+           "stale%cdbm", sep, sep, sep, sep, sep, sep, sep);
+    for (i = 0; i < 3; i++)
+      for (j = 0; j < 7; j++)
+        printf("%c%s_%s", sep, values[i], stats[j]);
+    printf("%cdiscard_nwid%cdiscard_crypt%cdiscard_fragment"
+           "%cdiscard_retries%cdiscard_misc%cmissed_beacon\n",
+           sep, sep, sep, sep, sep, sep);
+  }
+
+  while (!scanning_stop && ((opts->count == 0) || (windows < opts->count)))
+  {
+    struct timespec now;
+    char timestamp[32];
+
+    ret = iw_qstat_sample(&qstat);
+    if (ret > 0)
+      ticks += ret;
+    else if (errno != EINTR)
+    {
+      fprintf(stderr, "%-8.16s  Sampling timer failed : %s\n",
+              ifname, strerror(errno));
+      break;
+    }
+    /* The last window may be cut short by a signal */
+    if ((ticks < window_ticks) && !scanning_stop)
+      continue;
+    ticks = 0;
+    windows++;
+
+    iw_qstat_window_end(&qstat, &window);
+    if (opts->format == IWLIST_FORMAT_NONE)
+      continue;
+    clock_gettime(CLOCK_REALTIME, &now);
+    print_scanning_time(timestamp, sizeof(timestamp),
+                        (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    if (opts->format == IWLIST_FORMAT_JSON)
+      printf("{\"timestamp\":\"%s\",\"interface\":\"%s\","
+             "\"duration\":%.3f,\"samples\":%u,\"errors\":%u,"
+             "\"missed\":%u,\"stale\":%u,\"dbm\":%s",
+             timestamp, ifname, window.duration, window.samples,
+             window.errors, window.missed, window.stale,
+             window.dbm ? "true" : "false");
+    else
+      printf("%s%c%s%c%.3f%c%u%c%u%c%u%c%u%c%d", timestamp, sep, ifname,
+             sep, window.duration, sep, window.samples, sep, window.errors,
+             sep, window.missed, sep, window.stale, sep, window.dbm);
+    qstat_print_value(values[0], &window.qual, opts->format);
+    qstat_print_value(values[1], &window.level, opts->format);
+    qstat_print_value(values[2], &window.noise, opts->format);
+    if (opts->format == IWLIST_FORMAT_JSON)
+      printf(",\"discarded\":{\"nwid\":%u,\"crypt\":%u,\"fragment\":%u,"
+             "\"retries\":%u,\"misc\":%u},\"missed_beacon\":%u}\n",
+             window.discard_nwid, window.discard_code,
+             window.discard_fragment, window.discard_retries,
+             window.discard_misc, window.miss_beacon);
+    else
+      printf("%c%u%c%u%c%u%c%u%c%u%c%u\n", sep, window.discard_nwid,
+             sep, window.discard_code, sep, window.discard_fragment,
+             sep, window.discard_retries, sep, window.discard_misc,
+             sep, window.miss_beacon);
+    fflush(stdout);
+  }
+
+  iw_qstat_close(&qstat);
+  return (0);
+}
+
+/******************************* MAIN ********************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Display an help message and exit.
+ */
+static void
+iw_usage(int status)
+{
+  fprintf(status ? stderr : stdout,
+          "Usage: wlist [-i any | interface[,interface...]] [-M] [-n count]\n"
+          "             [-p period]\n"
+          "             [-o unix:/path | file:/path] [-q queue] [-b batch]\n"
+          "             [-l linger_ms] [-d] [-s rotate_size] [-a rotate_age]\n"
+          "             [-k keep] [-f json|csv|tsv|arrow|none] [-r scans]\n"
+          "             [-m file:/path | unix:/path | tcp:[addr:]port]\n"
+          "             [-H history] [-t top]\n"
+          "       wlist -R history [-S from] [-U until] [-f csv|tsv]\n"
+          "       wlist -L rate [-i interface] [-n windows] [-p period]\n"
+          "             [-f json|csv|tsv|none]\n");
+  exit(status);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * The main !
+ */
+int main(int argc,
+         char **argv)
+{
+  int skfd; /* generic raw socket desc.	*/
+  iwlist_opts opts;
+  iw_iftracker tracker;
+  int c;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.ifname[0] = "wlx6470021ccb6a";
+  opts.num_ifname = 1;
+  opts.count = 1;
+  opts.period = 10;
+  opts.format = IWLIST_FORMAT_JSON;
+  opts.arrow_scans = 1;
+  opts.from = INT64_MIN;
+  opts.until = INT64_MAX;
+  iw_sink_default_opts(&opts.sink_opts);
+
+  while ((c = getopt(argc, argv, "i:n:p:o:q:b:l:ds:a:k:f:m:r:H:R:S:U:t:L:Mh")) != -1)
+  {
+    switch (c)
+    {
+    case 'i':
+      /* Comma separated list */
+      for (opts.num_ifname = 0; optarg != NULL; opts.num_ifname++)
+      {
+        if (opts.num_ifname == IW_CELL_MERGE_MAX)
+          iw_usage(-1);
+        opts.ifname[opts.num_ifname] = optarg;
+        optarg = strchr(optarg, ',');
+        if (optarg != NULL)
+          *optarg++ = '\0';
+      }
+      break;
+    case 'M':
+      opts.merge = 1;
+      break;
+    case 'n':
+      opts.count = atoi(optarg);
+      break;
+    case 'p':
+      opts.period = atoi(optarg);
+      break;
+    case 'o':
+      opts.sink = optarg;
+      break;
+    case 'q':
+      opts.sink_opts.max_queue = atoi(optarg);
+      break;
+    case 'b':
+      opts.sink_opts.batch = atoi(optarg);
+      break;
+    case 'l':
+      opts.sink_opts.linger = atoi(optarg);
+      break;
+    case 'd':
+      opts.sink_opts.drop_policy = IW_SINK_DROP_OLDEST;
+      break;
+    case 's':
+      opts.sink_opts.rotate_size = strtoll(optarg, NULL, 0);
+      break;
+    case 'a':
+      opts.sink_opts.rotate_age = atol(optarg);
+      break;
+    case 'k':
+      opts.sink_opts.rotate_keep = atoi(optarg);
+      break;
+    case 'f':
+      if (!strcmp(optarg, "json"))
+        opts.format = IWLIST_FORMAT_JSON;
+      else if (!strcmp(optarg, "csv"))
+        opts.format = IWLIST_FORMAT_CSV;
+      else if (!strcmp(optarg, "tsv"))
+        opts.format = IWLIST_FORMAT_TSV;
+      else if (!strcmp(optarg, "arrow"))
+        opts.format = IWLIST_FORMAT_ARROW;
+      else if (!strcmp(optarg, "none"))
+        opts.format = IWLIST_FORMAT_NONE;
+      else
+        iw_usage(-1);
+      break;
+    case 'm':
+      opts.metrics = optarg;
+      break;
+    case 'r':
+      opts.arrow_scans = atoi(optarg);
+      break;
+    case 'H':
+      opts.history = optarg;
+      break;
+    case 'R':
+      opts.replay = optarg;
+      break;
+    case 'S':
+      opts.from = strtod(optarg, NULL) * 1000;
+      break;
+    case 'U':
+      opts.until = strtod(optarg, NULL) * 1000;
+      break;
+    case 't':
+      opts.top_k = atoi(optarg);
+      break;
+    case 'L':
+      opts.qstat_rate = atoi(optarg);
+      break;
+    case 'h':
+      iw_usage(0);
+      break;
+    default:
+      iw_usage(-1);
+    }
+  }
+  if ((optind < argc) || (opts.count < 0) || (opts.period < 0) ||
+      (opts.arrow_scans < 1) || (opts.top_k < 0) ||
+      (opts.merge && (opts.format == IWLIST_FORMAT_ARROW)) ||
+      (opts.qstat_rate < 0) ||
+      (opts.qstat_rate && ((opts.num_ifname != 1) || (opts.period < 1) ||
+                           (opts.format == IWLIST_FORMAT_ARROW))))
+    iw_usage(-1);
+
+  /* Reading a history doesn't need the interface */
+  if (opts.replay != NULL)
+    return (hist_dump(&opts) < 0);
+
+  /* Create a channel to the NET kernel. */
+  if ((skfd = iw_sockets_open()) < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+
+  /* One interface, many times per second */
+  if (opts.qstat_rate)
+  {
+    c = qstat_loop(skfd, &opts);
+    iw_sockets_close(skfd);
+    return c;
+  }
+
+  /* All the wireless interfaces, as they come and go */
+  if ((opts.num_ifname == 1) && !strcmp(opts.ifname[0], "any"))
+  {
+    memset(&tracker, 0, sizeof(tracker));
+    if (iw_iftracker_open(&tracker, skfd) < 0)
+    {
+      fprintf(stderr, "Can't track interfaces : %s\n", strerror(errno));
+      iw_sockets_close(skfd);
+      return -1;
+    }
+    opts.tracker = &tracker;
+    opts.num_ifname = 0;
+    scanning_track(&opts);
   }
 
-  print_scanning_info(skfd, "wlx6470021ccb6a", NULL, 0);
+  c = scanning_loop(skfd, &opts);
 
   /* Close the socket. */
+  if (opts.tracker != NULL)
+    iw_iftracker_close(&tracker);
   iw_sockets_close(skfd);
 
-  return 0;
+  return c;
 }
@@ -0,0 +1,784 @@
+/*
+ *	Wireless Tools
+ *
+ * OpenMetrics exporter for the scanning tools...
+ *
+ * Label sets never change for a given BSS, so they are rendered and
+ * escaped once, when the BSS is first seen (or its ESSID changes), and
+ * kept with it. Exposition is then mostly a walk copying those strings,
+ * only the values need formatting.
+ *
+ * The scanning loop updates the exporter between iw_metrics_begin() and
+ * iw_metrics_end(), which hold the exporter lock, so a scrape always
+ * sees complete scans.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#define _GNU_SOURCE		/* accept4(), pipe2() */
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "iwmetrics.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Metric family descriptors */
+#define IW_METRICS_PREAMBLE(name, type, help)	\
+	"# HELP " name " " help "\n# TYPE " name " " type "\n"
+
+/* Worst case for a formatted value */
+#define IW_METRICS_VALUE_MAX	32
+
+/* HTTP response */
+#define IW_METRICS_CONTENT_TYPE	\
+	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/************************* RENDERING HELPERS *************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Make sure the exposition buffer can take len more bytes.
+ */
+static int
+iw_metrics_reserve(iw_metrics *	metrics,
+		   size_t	len)
+{
+  char *	newbuf;
+  size_t	newmax;
+
+  if(metrics->outlen + len <= metrics->outmax)
+    return(0);
+
+  newmax = metrics->outmax ? metrics->outmax : 4096;
+  while(newmax < metrics->outlen + len)
+    newmax *= 2;
+  newbuf = realloc(metrics->out, newmax);
+  if(newbuf == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      return(-1);
+    }
+  metrics->out = newbuf;
+  metrics->outmax = newmax;
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append raw bytes. Space must have been reserved.
+ */
+static void
+iw_metrics_put(iw_metrics *	metrics,
+	       const char *	data,
+	       size_t		len)
+{
+  memcpy(metrics->out + metrics->outlen, data, len);
+  metrics->outlen += len;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a integer value and the end of line. Space must have been
+ * reserved.
+ */
+static void
+iw_metrics_put_long(iw_metrics *	metrics,
+		    long		value)
+{
+  char			digits[IW_METRICS_VALUE_MAX];
+  char *		p = digits + sizeof(digits);
+  unsigned long		u = (value < 0) ? -(unsigned long) value
+					: (unsigned long) value;
+
+  *--p = '\n';
+  do
+    {
+      *--p = '0' + (u % 10);
+      u /= 10;
+    }
+  while(u);
+  if(value < 0)
+    *--p = '-';
+  iw_metrics_put(metrics, p, digits + sizeof(digits) - p);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a label value, escaped as OpenMetrics wants : only \\, \" and
+ * \n have an escape, other control characters are replaced.
+ * buf must have room for 2 * len bytes.
+ * Return the number of bytes written.
+ */
+static int
+iw_metrics_escape(char *	buf,
+		  const char *	value,
+		  int		len)
+{
+  char *	p = buf;
+  int		i;
+
+  for(i = 0; i < len; i++)
+    {
+      unsigned char	c = value[i];
+
+      if((c == '\\') || (c == '"'))
+	{
+	  *p++ = '\\';
+	  *p++ = c;
+	}
+      else if(c == '\n')
+	{
+	  *p++ = '\\';
+	  *p++ = 'n';
+	}
+      else if((c < 0x20) || (c == 0x7F))
+	/* ESSIDs are not always printable */
+	*p++ = '?';
+      else
+	*p++ = c;
+    }
+  return(p - buf);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Render the label set of a BSS, done once per BSS.
+ */
+static void
+iw_metrics_render_bss(iw_metrics *	metrics,
+		      iw_metrics_bss *	bss)
+{
+  iw_metrics_if *	iface = &metrics->ifaces[bss->iface];
+  char *		p = bss->labels;
+
+  *p++ = '{';
+  memcpy(p, iface->labels, iface->labels_len);
+  p += iface->labels_len;
+  p += sprintf(p, ",bssid=\"");
+  iw_ether_ntop((const struct ether_addr *) bss->bssid, p);
+  p += strlen(p);
+  p += sprintf(p, "\",essid=\"");
+  p += iw_metrics_escape(p, bss->essid, strlen(bss->essid));
+  *p++ = '"';
+  *p++ = '}';
+  *p++ = ' ';
+  bss->labels_len = p - bss->labels;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append one per-BSS sample.
+ */
+static void
+iw_metrics_put_bss(iw_metrics *		metrics,
+		   const char *		name,
+		   size_t		namelen,
+		   const iw_metrics_bss *	bss,
+		   long			value)
+{
+  iw_metrics_put(metrics, name, namelen);
+  iw_metrics_put(metrics, bss->labels, bss->labels_len);
+  iw_metrics_put_long(metrics, value);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append one per-interface sample, with an optional extra label.
+ */
+static void
+iw_metrics_put_if(iw_metrics *		metrics,
+		  const char *		name,
+		  size_t		namelen,
+		  const iw_metrics_if *	iface,
+		  const char *		extra,
+		  size_t		extralen,
+		  long			value)
+{
+  iw_metrics_put(metrics, name, namelen);
+  iw_metrics_put(metrics, "{", 1);
+  iw_metrics_put(metrics, iface->labels, iface->labels_len);
+  iw_metrics_put(metrics, extra, extralen);
+  iw_metrics_put(metrics, "} ", 2);
+  iw_metrics_put_long(metrics, value);
+}
+
+#define IW_METRICS_PUT_STR(m, s)	iw_metrics_put(m, s, sizeof(s) - 1)
+
+/*------------------------------------------------------------------*/
+/*
+ * Render the whole exposition in metrics->out. Lock must be held.
+ */
+static int
+iw_metrics_render(iw_metrics *	metrics)
+{
+  static const char	sig[] = "wlist_bss_signal_dbm";
+  static const char	qual[] = "wlist_bss_quality";
+  static const char	chan[] = "wlist_channel_cells";
+  static const char	scans[] = "wlist_scans_total";
+  static const char	errors[] = "wlist_scan_errors_total";
+  static const char	retries[] = "wlist_scan_retries_total";
+  int			i;
+  int			b;
+
+  /* Worst case for one sample of each kind */
+  size_t	bss_max = sizeof(sig) + IW_METRICS_LABEL_MAX + IW_METRICS_VALUE_MAX;
+  size_t	if_max = sizeof(retries) + sizeof(((iw_metrics_if *) NULL)->labels)
+		  + 32 + IW_METRICS_VALUE_MAX;
+
+  metrics->outlen = 0;
+  if(iw_metrics_reserve(metrics, 2 * metrics->num_bss * bss_max
+			+ metrics->num_ifaces * (IW_METRICS_MAX_CHANNEL + 8)
+			* if_max + 2048) < 0)
+    return(-1);
+
+  /* Per BSS gauges, only for BSS seen in the last scan */
+  IW_METRICS_PUT_STR(metrics, IW_METRICS_PREAMBLE("wlist_bss_signal_dbm",
+		     "gauge", "Signal level of the BSS in dBm."));
+  for(b = 0; b < IW_METRICS_MAX_BSS; b++)
+    {
+      const iw_metrics_bss *	bss = &metrics->bss[b];
+      if((bss->iface >= 0) && bss->has_level
+	 && (bss->seen == metrics->ifaces[bss->iface].generation))
+	iw_metrics_put_bss(metrics, sig, sizeof(sig) - 1, bss, bss->level);
+    }
+  IW_METRICS_PUT_STR(metrics, IW_METRICS_PREAMBLE("wlist_bss_quality",
+		     "gauge", "Link quality of the BSS, driver units."));
+  for(b = 0; b < IW_METRICS_MAX_BSS; b++)
+    {
+      const iw_metrics_bss *	bss = &metrics->bss[b];
+      if((bss->iface >= 0) && bss->has_qual
+	 && (bss->seen == metrics->ifaces[bss->iface].generation))
+	iw_metrics_put_bss(metrics, qual, sizeof(qual) - 1, bss, bss->qual);
+    }
+
+  /* Per channel cell counts */
+  IW_METRICS_PUT_STR(metrics, IW_METRICS_PREAMBLE("wlist_channel_cells",
+		     "gauge", "Number of cells per channel in the last scan."));
+  for(i = 0; i < metrics->num_ifaces; i++)
+    {
+      const iw_metrics_if *	iface = &metrics->ifaces[i];
+      int			c;
+
+      for(c = 0; c <= IW_METRICS_MAX_CHANNEL; c++)
+	if(iface->channel_cells[c])
+	  {
+	    char	extra[24];
+	    int		len = sprintf(extra, ",channel=\"%d\"", c);
+	    iw_metrics_put_if(metrics, chan, sizeof(chan) - 1, iface,
+			      extra, len, iface->channel_cells[c]);
+	  }
+    }
+
+  /* Scan health */
+  IW_METRICS_PUT_STR(metrics, IW_METRICS_PREAMBLE("wlist_scan_duration_seconds",
+		     "gauge", "Duration of the last scan."));
+  for(i = 0; i < metrics->num_ifaces; i++)
+    {
+      const iw_metrics_if *	iface = &metrics->ifaces[i];
+      char			value[IW_METRICS_VALUE_MAX];
+      int			len;
+
+      IW_METRICS_PUT_STR(metrics, "wlist_scan_duration_seconds{");
+      iw_metrics_put(metrics, iface->labels, iface->labels_len);
+      len = snprintf(value, sizeof(value), "} %.6f\n", iface->duration);
+      iw_metrics_put(metrics, value, len);
+    }
+  IW_METRICS_PUT_STR(metrics, IW_METRICS_PREAMBLE("wlist_scans",
+		     "counter", "Number of scans performed."));
+  for(i = 0; i < metrics->num_ifaces; i++)
+    iw_metrics_put_if(metrics, scans, sizeof(scans) - 1, &metrics->ifaces[i],
+		      "", 0, metrics->ifaces[i].scans);
+  IW_METRICS_PUT_STR(metrics, IW_METRICS_PREAMBLE("wlist_scan_errors",
+		     "counter", "Number of failed scans."));
+  for(i = 0; i < metrics->num_ifaces; i++)
+    iw_metrics_put_if(metrics, errors, sizeof(errors) - 1, &metrics->ifaces[i],
+		      "", 0, metrics->ifaces[i].errors);
+  IW_METRICS_PUT_STR(metrics, IW_METRICS_PREAMBLE("wlist_scan_retries",
+		     "counter", "Number of scan result retries, by reason."));
+  for(i = 0; i < metrics->num_ifaces; i++)
+    {
+      iw_metrics_put_if(metrics, retries, sizeof(retries) - 1,
+			&metrics->ifaces[i], ",reason=\"e2big\"", 15,
+			metrics->ifaces[i].e2big);
+      iw_metrics_put_if(metrics, retries, sizeof(retries) - 1,
+			&metrics->ifaces[i], ",reason=\"eagain\"", 16,
+			metrics->ifaces[i].eagain);
+    }
+
+  IW_METRICS_PUT_STR(metrics, "# EOF\n");
+  return(0);
+}
+
+/*************************** TEXTFILE OUTPUT ***************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Write the exposition to the textfile, atomically (the collector
+ * must never see a partial file). Lock must be held.
+ */
+static int
+iw_metrics_write_file(iw_metrics *	metrics)
+{
+  size_t	plen = strlen(metrics->path) + 8;
+  char		tmp[plen];
+  int		fd;
+  ssize_t	ret;
+
+  if(iw_metrics_render(metrics) < 0)
+    return(-1);
+
+  snprintf(tmp, plen, "%s.tmp", metrics->path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0)
+    {
+      fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+      return(-1);
+    }
+  ret = write(fd, metrics->out, metrics->outlen);
+  close(fd);
+  if((ret < 0) || ((size_t) ret != metrics->outlen)
+     || (rename(tmp, metrics->path) < 0))
+    {
+      fprintf(stderr, "%s: %s\n", metrics->path, strerror(errno));
+      unlink(tmp);
+      return(-1);
+    }
+  return(0);
+}
+
+/***************************** HTTP OUTPUT *****************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Serve one scrape. We don't care about the request itself, any
+ * request gets the metrics.
+ */
+static void
+iw_metrics_serve(iw_metrics *	metrics,
+		 int		fd)
+{
+  char			request[1024];
+  char			header[256];
+  struct pollfd		pfd = { .fd = fd, .events = POLLIN };
+  struct iovec		iov[2];
+  int			len;
+
+  /* Don't let a stuck client block the exporter */
+  if(poll(&pfd, 1, 1000) <= 0)
+    return;
+  if(read(fd, request, sizeof(request)) <= 0)
+    return;
+
+  pthread_mutex_lock(&metrics->lock);
+  if(iw_metrics_render(metrics) == 0)
+    {
+      len = snprintf(header, sizeof(header),
+		     "HTTP/1.0 200 OK\r\n"
+		     "Content-Type: " IW_METRICS_CONTENT_TYPE "\r\n"
+		     "Content-Length: %zu\r\n"
+		     "Connection: close\r\n\r\n", metrics->outlen);
+      iov[0].iov_base = header;
+      iov[0].iov_len = len;
+      iov[1].iov_base = metrics->out;
+      iov[1].iov_len = metrics->outlen;
+      /* Best effort, a failed scrape is the scraper's business */
+      writev(fd, iov, 2);
+    }
+  pthread_mutex_unlock(&metrics->lock);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Accept scrapes until asked to stop.
+ */
+static void *
+iw_metrics_thread(void *	arg)
+{
+  iw_metrics *		metrics = (iw_metrics *) arg;
+  struct pollfd		pfd[2];
+
+  pfd[0].fd = metrics->listen_fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = metrics->stop_pipe[0];
+  pfd[1].events = POLLIN;
+
+  while(1)
+    {
+      int	fd;
+
+      if(poll(pfd, 2, -1) < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  break;
+	}
+      if(pfd[1].revents)
+	break;
+      if(!(pfd[0].revents & POLLIN))
+	continue;
+
+      fd = accept4(metrics->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if(fd < 0)
+	continue;
+      iw_metrics_serve(metrics, fd);
+      close(fd);
+    }
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Create the listening socket, on a Unix path or on [addr:]port.
+ */
+static int
+iw_metrics_listen(iw_metrics *	metrics,
+		  const char *	spec)
+{
+  int		fd;
+  int		one = 1;
+
+  if(!strncmp(spec, IW_METRICS_UNIX_PREFIX, strlen(IW_METRICS_UNIX_PREFIX)))
+    {
+      struct sockaddr_un	sun;
+
+      memset(&sun, 0, sizeof(sun));
+      sun.sun_family = AF_UNIX;
+      if(strlen(metrics->path) >= sizeof(sun.sun_path))
+	{
+	  fprintf(stderr, "Socket path too long : %s\n", metrics->path);
+	  return(-1);
+	}
+      strcpy(sun.sun_path, metrics->path);
+      fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if(fd < 0)
+	goto err;
+      /* Left over from a previous run */
+      unlink(metrics->path);
+      if(bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+	goto err_close;
+    }
+  else
+    {
+      struct sockaddr_in	sin;
+      char *			colon = strrchr(metrics->path, ':');
+
+      memset(&sin, 0, sizeof(sin));
+      sin.sin_family = AF_INET;
+      /* Local by default, this is not meant to be exposed */
+      sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      if(colon != NULL)
+	{
+	  *colon = '\0';
+	  if(inet_pton(AF_INET, metrics->path, &sin.sin_addr) != 1)
+	    {
+	      fprintf(stderr, "Invalid address : %s\n", metrics->path);
+	      return(-1);
+	    }
+	  sin.sin_port = htons(atoi(colon + 1));
+	}
+      else
+	sin.sin_port = htons(atoi(metrics->path));
+
+      fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if(fd < 0)
+	goto err;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if(bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+	goto err_close;
+    }
+
+  if(listen(fd, 8) < 0)
+    goto err_close;
+  metrics->listen_fd = fd;
+  return(0);
+
+ err_close:
+  close(fd);
+ err:
+  fprintf(stderr, "%s: %s\n", spec, strerror(errno));
+  return(-1);
+}
+
+/************************ EXPORTER INTERFACE ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Create an exporter from its specification : "file:/path" for the
+ * textfile collector, "unix:/path" or "tcp:[addr:]port" for HTTP.
+ * Return NULL on error.
+ */
+iw_metrics *
+iw_metrics_open(const char *	spec)
+{
+  iw_metrics *	metrics;
+  const char *	arg;
+  int		i;
+
+  if(!strncmp(spec, IW_METRICS_FILE_PREFIX, strlen(IW_METRICS_FILE_PREFIX)))
+    arg = spec + strlen(IW_METRICS_FILE_PREFIX);
+  else if(!strncmp(spec, IW_METRICS_UNIX_PREFIX,
+		   strlen(IW_METRICS_UNIX_PREFIX)))
+    arg = spec + strlen(IW_METRICS_UNIX_PREFIX);
+  else if(!strncmp(spec, IW_METRICS_TCP_PREFIX, strlen(IW_METRICS_TCP_PREFIX)))
+    arg = spec + strlen(IW_METRICS_TCP_PREFIX);
+  else
+    {
+      fprintf(stderr, "Unknown metrics endpoint : %s\n", spec);
+      return(NULL);
+    }
+
+  metrics = calloc(1, sizeof(iw_metrics));
+  if(metrics == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      return(NULL);
+    }
+  metrics->listen_fd = -1;
+  metrics->path = strdup(arg);
+  if(metrics->path == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      free(metrics);
+      return(NULL);
+    }
+
+  /* All BSS slots on the free list */
+  for(i = 0; i < IW_METRICS_HASH_SIZE; i++)
+    metrics->hash[i] = -1;
+  for(i = 0; i < IW_METRICS_MAX_BSS; i++)
+    {
+      metrics->bss[i].iface = -1;
+      metrics->bss[i].next = i + 1;
+    }
+  metrics->bss[IW_METRICS_MAX_BSS - 1].next = -1;
+  metrics->free_bss = 0;
+  pthread_mutex_init(&metrics->lock, NULL);
+
+  /* Textfile is written from iw_metrics_end(), nothing more to do */
+  if(!strncmp(spec, IW_METRICS_FILE_PREFIX, strlen(IW_METRICS_FILE_PREFIX)))
+    return(metrics);
+
+  if(iw_metrics_listen(metrics, spec) < 0)
+    goto err;
+  if(pipe2(metrics->stop_pipe, O_CLOEXEC) < 0)
+    {
+      close(metrics->listen_fd);
+      goto err;
+    }
+  if(pthread_create(&metrics->thread, NULL, iw_metrics_thread, metrics) != 0)
+    {
+      fprintf(stderr, "Cannot start metrics thread\n");
+      close(metrics->stop_pipe[0]);
+      close(metrics->stop_pipe[1]);
+      close(metrics->listen_fd);
+      goto err;
+    }
+  return(metrics);
+
+ err:
+  pthread_mutex_destroy(&metrics->lock);
+  free(metrics->path);
+  free(metrics);
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Start reporting the results of a scan on an interface. This takes
+ * the exporter lock, which is released by iw_metrics_end(). Call it
+ * once the results are available, not when triggering the scan.
+ * Return the interface index to pass to the other calls, or -1.
+ */
+int
+iw_metrics_begin(iw_metrics *	metrics,
+		 const char *	ifname)
+{
+  iw_metrics_if *	iface;
+  int			i;
+
+  pthread_mutex_lock(&metrics->lock);
+
+  for(i = 0; i < metrics->num_ifaces; i++)
+    if(!strcmp(metrics->ifaces[i].name, ifname))
+      break;
+  if(i == metrics->num_ifaces)
+    {
+      if(i == IW_METRICS_MAX_IF)
+	{
+	  pthread_mutex_unlock(&metrics->lock);
+	  return(-1);
+	}
+      /* New interface, render its label once */
+      iface = &metrics->ifaces[i];
+      strncpy(iface->name, ifname, IFNAMSIZ);
+      iface->labels_len = sprintf(iface->labels, "interface=\"");
+      iface->labels_len += iw_metrics_escape(iface->labels + iface->labels_len,
+					     iface->name, strlen(iface->name));
+      iface->labels[iface->labels_len++] = '"';
+      metrics->num_ifaces++;
+    }
+
+  iface = &metrics->ifaces[i];
+  iface->generation++;
+  iface->cells = 0;
+  memset(iface->channel_cells, 0, sizeof(iface->channel_cells));
+  return(i);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Record one cell of the current scan.
+ */
+void
+iw_metrics_cell(iw_metrics *		metrics,
+		int			iface,
+		const struct sockaddr *	ap_addr,
+		const char *		essid,
+		int			channel,
+		const iwqual *		qual,
+		const iwrange *		range,
+		int			has_range)
+{
+  iw_metrics_if *	mif = &metrics->ifaces[iface];
+  const unsigned char *	mac = (const unsigned char *) ap_addr->sa_data;
+  iw_metrics_bss *	bss;
+  unsigned int		h;
+  int			b;
+  int			noise;
+
+  mif->cells++;
+  if((channel >= 0) && (channel <= IW_METRICS_MAX_CHANNEL))
+    mif->channel_cells[channel]++;
+
+  /* Find the BSS */
+  /* The OUI is shared by many BSS, hash the NIC specific part */
+  h = (((mac[4] << 8) | mac[5]) ^ (mac[3] << 2) ^ iface)
+      & (IW_METRICS_HASH_SIZE - 1);
+  for(b = metrics->hash[h]; b >= 0; b = metrics->bss[b].next)
+    if((metrics->bss[b].iface == iface)
+       && !memcmp(metrics->bss[b].bssid, ap_addr->sa_data, ETH_ALEN))
+      break;
+
+  if(b < 0)
+    {
+      /* New BSS. If we are full, just ignore it until some age out */
+      b = metrics->free_bss;
+      if(b < 0)
+	return;
+      bss = &metrics->bss[b];
+      metrics->free_bss = bss->next;
+      metrics->num_bss++;
+      memset(bss, 0, sizeof(iw_metrics_bss));
+      bss->iface = iface;
+      memcpy(bss->bssid, ap_addr->sa_data, ETH_ALEN);
+      strncpy(bss->essid, essid, IW_ESSID_MAX_SIZE);
+      iw_metrics_render_bss(metrics, bss);
+      bss->next = metrics->hash[h];
+      metrics->hash[h] = b;
+    }
+  else
+    {
+      bss = &metrics->bss[b];
+      /* Hidden networks may reveal themselves later */
+      if(strncmp(bss->essid, essid, IW_ESSID_MAX_SIZE))
+	{
+	  strncpy(bss->essid, essid, IW_ESSID_MAX_SIZE);
+	  iw_metrics_render_bss(metrics, bss);
+	}
+    }
+
+  bss->seen = mif->generation;
+  bss->has_level = 0;
+  bss->has_qual = 0;
+  if(qual != NULL)
+    {
+      bss->has_level = iw_qual_dbm(qual, range, has_range,
+				   &bss->level, &noise) & IW_DBM_LEVEL;
+      if(!(qual->updated & IW_QUAL_QUAL_INVALID))
+	{
+	  bss->has_qual = 1;
+	  bss->qual = qual->qual;
+	}
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Finish reporting a scan : account for its health, forget the BSS
+ * not seen for a while, update the textfile and release the lock.
+ */
+void
+iw_metrics_end(iw_metrics *		metrics,
+	       int			iface,
+	       const iw_metrics_scan *	scan)
+{
+  iw_metrics_if *	mif = &metrics->ifaces[iface];
+  int			h;
+
+  mif->scans++;
+  if(scan->status < 0)
+    mif->errors++;
+  mif->duration = scan->duration;
+  mif->e2big += scan->e2big;
+  mif->eagain += scan->eagain;
+
+  /* Age out */
+  for(h = 0; h < IW_METRICS_HASH_SIZE; h++)
+    {
+      int *	pb = &metrics->hash[h];
+
+      while(*pb >= 0)
+	{
+	  iw_metrics_bss *	bss = &metrics->bss[*pb];
+	  int			b = *pb;
+
+	  if((bss->iface == iface)
+	     && (mif->generation - bss->seen >= IW_METRICS_STALE))
+	    {
+	      *pb = bss->next;
+	      bss->iface = -1;
+	      bss->next = metrics->free_bss;
+	      metrics->free_bss = b;
+	      metrics->num_bss--;
+	    }
+	  else
+	    pb = &bss->next;
+	}
+    }
+
+  if(metrics->listen_fd < 0)
+    iw_metrics_write_file(metrics);
+
+  pthread_mutex_unlock(&metrics->lock);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Stop the endpoint and release everything.
+ */
+void
+iw_metrics_close(iw_metrics *	metrics)
+{
+  if(metrics == NULL)
+    return;
+
+  if(metrics->listen_fd >= 0)
+    {
+      /* Wake up the server thread */
+      write(metrics->stop_pipe[1], "", 1);
+      pthread_join(metrics->thread, NULL);
+      close(metrics->listen_fd);
+      close(metrics->stop_pipe[0]);
+      close(metrics->stop_pipe[1]);
+    }
+
+  pthread_mutex_destroy(&metrics->lock);
+  free(metrics->out);
+  free(metrics->path);
+  free(metrics);
+}
@@ -0,0 +1,135 @@
+/*
+ *	Wireless Tools
+ *
+ * OpenMetrics exporter for the scanning tools...
+ *
+ * Keep the latest per-BSS signal and per-interface scan health, and
+ * expose them either through a textfile (for the node_exporter textfile
+ * collector) or through a minimal HTTP endpoint on a local socket.
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWMETRICS_H
+#define IWMETRICS_H
+
+/***************************** INCLUDES *****************************/
+
+#include "iwlib.h"
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Exporter specification prefixes (see iw_metrics_open()) */
+#define IW_METRICS_FILE_PREFIX	"file:"		/* Textfile collector */
+#define IW_METRICS_UNIX_PREFIX	"unix:"		/* HTTP on a Unix socket */
+#define IW_METRICS_TCP_PREFIX	"tcp:"		/* HTTP on [addr:]port */
+
+/* Limits */
+#define IW_METRICS_MAX_IF	8	/* Interfaces tracked */
+#define IW_METRICS_MAX_BSS	4096	/* BSS tracked, all interfaces */
+#define IW_METRICS_HASH_SIZE	1024	/* Must be a power of 2 */
+#define IW_METRICS_MAX_CHANNEL	255	/* Highest channel counted */
+#define IW_METRICS_STALE	3	/* Scans before forgetting a BSS */
+/* {interface="",bssid="",essid=""} with everything escaped */
+#define IW_METRICS_LABEL_MAX	(48 + 2 * IFNAMSIZ + 18 + 2 * IW_ESSID_MAX_SIZE)
+
+/****************************** TYPES ******************************/
+
+/* Scan health, reported once per scan */
+typedef struct iw_metrics_scan
+{
+  int		status;		/* 0 for success, < 0 on error */
+  double	duration;	/* Seconds, trigger to results */
+  unsigned int	e2big;		/* Buffer too small retries */
+  unsigned int	eagain;		/* Results not ready retries */
+} iw_metrics_scan;
+
+/* One BSS seen on one interface */
+typedef struct iw_metrics_bss
+{
+  int		next;		/* Hash chain / free list, -1 terminated */
+  int		iface;		/* Index in iw_metrics.ifaces */
+  unsigned char	bssid[ETH_ALEN];
+  unsigned int	seen;		/* Interface generation when last seen */
+  int		has_level;
+  int		level;		/* dBm */
+  int		has_qual;
+  int		qual;
+  char		essid[IW_ESSID_MAX_SIZE + 1];	/* For label refresh */
+  /* Pre-rendered {interface="",bssid="",essid=""} */
+  int		labels_len;
+  char		labels[IW_METRICS_LABEL_MAX];
+} iw_metrics_bss;
+
+/* Per interface state */
+typedef struct iw_metrics_if
+{
+  char		name[IFNAMSIZ + 1];
+  int		labels_len;	/* Pre-rendered interface="" */
+  char		labels[16 + 2 * IFNAMSIZ];	/* Escaped */
+  unsigned int	generation;	/* Number of scans started */
+  unsigned int	channel_cells[IW_METRICS_MAX_CHANNEL + 1];
+  unsigned int	cells;		/* Cells in the last scan */
+  double	duration;	/* Last scan */
+  unsigned long	scans;
+  unsigned long	errors;
+  unsigned long	e2big;
+  unsigned long	eagain;
+} iw_metrics_if;
+
+/* The exporter. Treat as opaque. */
+typedef struct iw_metrics
+{
+  pthread_mutex_t	lock;
+  int			num_ifaces;
+  iw_metrics_if		ifaces[IW_METRICS_MAX_IF];
+  int			hash[IW_METRICS_HASH_SIZE];
+  int			free_bss;	/* Free list head */
+  int			num_bss;	/* BSS in use */
+  iw_metrics_bss	bss[IW_METRICS_MAX_BSS];
+
+  /* Exposition buffer, reused across scrapes */
+  char *		out;
+  size_t		outlen;
+  size_t		outmax;
+
+  /* Endpoint */
+  char *		path;		/* Textfile or Unix socket */
+  int			listen_fd;	/* HTTP server, or -1 */
+  int			stop_pipe[2];
+  pthread_t		thread;
+} iw_metrics;
+
+/**************************** PROTOTYPES ****************************/
+
+iw_metrics *
+	iw_metrics_open(const char *	spec);
+int
+	iw_metrics_begin(iw_metrics *	metrics,
+			 const char *	ifname);
+void
+	iw_metrics_cell(iw_metrics *		metrics,
+			int			iface,
+			const struct sockaddr *	ap_addr,
+			const char *		essid,
+			int			channel,
+			const iwqual *		qual,
+			const iwrange *		range,
+			int			has_range);
+void
+	iw_metrics_end(iw_metrics *			metrics,
+		       int				iface,
+		       const iw_metrics_scan *	scan);
+void
+	iw_metrics_close(iw_metrics *	metrics);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* IWMETRICS_H */
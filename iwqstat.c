@@ -0,0 +1,299 @@
+/*
+ *	Wireless Tools
+ *
+ * High rate sampling of the link quality...
+ *
+ * At 100 Hz and more, the cost of a sample matters : the request is
+ * filled once and only handed to the kernel afterwards, the timer is a
+ * timerfd so that late ticks are counted rather than accumulated, and
+ * a sample is only a few increments in the histograms. Everything else
+ * happens once per window.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "iwqstat.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Any of the values was updated by the driver */
+#define IW_QSTAT_UPDATED	(IW_QUAL_QUAL_UPDATED | IW_QUAL_LEVEL_UPDATED \
+				 | IW_QUAL_NOISE_UPDATED)
+
+/*********************** HISTOGRAM SUBROUTINES ***********************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Add a value to a histogram.
+ */
+static void
+iw_qstat_hist_add(iw_qstat_hist *	hist,
+		  int			bin)
+{
+  hist->bins[bin & (IW_QSTAT_BINS - 1)]++;
+  hist->sum += bin & (IW_QSTAT_BINS - 1);
+  hist->count++;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Value at a percentile of a histogram, nearest rank.
+ */
+static int
+iw_qstat_hist_rank(const iw_qstat_hist *	hist,
+		   int				percent)
+{
+  uint64_t	rank = ((uint64_t) hist->count * percent + 99) / 100;
+  uint64_t	seen = 0;
+  int		bin;
+
+  if(rank == 0)
+    rank = 1;
+  for(bin = 0; bin < IW_QSTAT_BINS - 1; bin++)
+    {
+      seen += hist->bins[bin];
+      if(seen >= rank)
+	break;
+    }
+  return(bin);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Summarise a histogram, and empty it for the next window.
+ */
+static void
+iw_qstat_hist_end(iw_qstat_hist *	hist,
+		  int			offset,
+		  iw_qstat_value *	value)
+{
+  int		bin;
+
+  memset(value, 0, sizeof(iw_qstat_value));
+  value->count = hist->count;
+  if(hist->count)
+    {
+      for(bin = 0; !hist->bins[bin]; bin++)
+	;
+      value->min = bin + offset;
+      for(bin = IW_QSTAT_BINS - 1; !hist->bins[bin]; bin--)
+	;
+      value->max = bin + offset;
+      value->p50 = iw_qstat_hist_rank(hist, 50) + offset;
+      value->p95 = iw_qstat_hist_rank(hist, 95) + offset;
+      value->p99 = iw_qstat_hist_rank(hist, 99) + offset;
+      value->mean = (double) hist->sum / hist->count + offset;
+    }
+  memset(hist, 0, sizeof(iw_qstat_hist));
+}
+
+/************************ SAMPLING SUBROUTINES ************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Prepare the sampling of ifname, rate times per second. The timer
+ * starts right away, call iw_qstat_sample() in a loop.
+ * Return -1 if the interface or the timer is not available.
+ */
+int
+iw_qstat_open(iw_qstat *	qstat,
+	      int		skfd,
+	      const char *	ifname,
+	      int		rate)
+{
+  struct itimerspec	period;
+  long			ns;
+
+  memset(qstat, 0, sizeof(iw_qstat));
+  qstat->timer_fd = -1;
+  qstat->skfd = skfd;
+  if((rate <= 0) || (rate > IW_QSTAT_MAX_RATE))
+    {
+      errno = EINVAL;
+      return(-1);
+    }
+
+  /* /proc/net/wireless is the only way before WE-12, much too slow */
+  qstat->has_range = (iw_get_range_info_r(skfd, ifname, &qstat->range,
+					  NULL) >= 0);
+  if(!qstat->has_range || (qstat->range.we_version_compiled <= 11))
+    {
+      errno = EOPNOTSUPP;
+      return(-1);
+    }
+
+  /* The same request for all the samples, like iw_get_stats() */
+  strncpy(qstat->wrq.ifr_name, ifname, IFNAMSIZ);
+  qstat->wrq.u.data.pointer = (caddr_t) &qstat->stats;
+  qstat->wrq.u.data.length = sizeof(iwstats);
+  qstat->wrq.u.data.flags = 1;		/* Clear updated flag */
+
+  qstat->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if(qstat->timer_fd < 0)
+    return(-1);
+  ns = 1000000000L / rate;
+  period.it_interval.tv_sec = ns / 1000000000L;
+  period.it_interval.tv_nsec = ns % 1000000000L;
+  period.it_value = period.it_interval;
+  if(timerfd_settime(qstat->timer_fd, 0, &period, NULL) < 0)
+    {
+      iw_qstat_close(qstat);
+      return(-1);
+    }
+  clock_gettime(CLOCK_MONOTONIC, &qstat->start);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Wait for the next tick and take a sample. Failed reads are counted
+ * in the window, they don't stop the sampling.
+ * Return the number of ticks since the last sample (more than one if
+ * we were late), -1 if the timer failed (EINTR on a signal).
+ */
+int
+iw_qstat_sample(iw_qstat *	qstat)
+{
+  iwstats *	stats = &qstat->stats;
+  uint64_t	ticks;
+  int		updated;
+  int		level;
+  int		noise;
+  int		mask;
+
+  if(read(qstat->timer_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+    return(-1);
+  if(ticks > 1)
+    qstat->missed += ticks - 1;
+
+  qstat->samples++;
+  if(ioctl(qstat->skfd, SIOCGIWSTATS, &qstat->wrq) < 0)
+    {
+      qstat->errors++;
+      return(ticks);
+    }
+
+  /* Counters, the deltas are taken at the end of the window */
+  if(!qstat->has_base)
+    {
+      qstat->base_discard = stats->discard;
+      qstat->base_miss = stats->miss;
+      qstat->has_base = 1;
+    }
+  qstat->last_discard = stats->discard;
+  qstat->last_miss = stats->miss;
+
+  /* Faster than the driver updates : don't count the same values
+   * again, if the driver tells us */
+  updated = stats->qual.updated;
+  if(updated & IW_QSTAT_UPDATED)
+    qstat->sees_updates = 1;
+  else if(qstat->sees_updates)
+    {
+      qstat->stale++;
+      return(ticks);
+    }
+  if(qstat->sees_updates)
+    {
+      if(!(updated & IW_QUAL_QUAL_UPDATED))
+	updated |= IW_QUAL_QUAL_INVALID;
+      if(!(updated & IW_QUAL_LEVEL_UPDATED))
+	updated |= IW_QUAL_LEVEL_INVALID;
+      if(!(updated & IW_QUAL_NOISE_UPDATED))
+	updated |= IW_QUAL_NOISE_INVALID;
+    }
+
+  if(!(updated & IW_QUAL_QUAL_INVALID))
+    iw_qstat_hist_add(&qstat->qual, stats->qual.qual);
+
+  mask = iw_qual_dbm(&stats->qual, &qstat->range, qstat->has_range,
+		     &level, &noise);
+  qstat->dbm = mask != 0;
+  if(mask)
+    {
+      if((mask & IW_DBM_LEVEL) && !(updated & IW_QUAL_LEVEL_INVALID))
+	iw_qstat_hist_add(&qstat->level, level - IW_QSTAT_DBM_MIN);
+      if((mask & IW_DBM_NOISE) && !(updated & IW_QUAL_NOISE_INVALID))
+	iw_qstat_hist_add(&qstat->noise, noise - IW_QSTAT_DBM_MIN);
+    }
+  else
+    {
+      /* Relative values */
+      if(!(updated & IW_QUAL_LEVEL_INVALID))
+	iw_qstat_hist_add(&qstat->level, stats->qual.level);
+      if(!(updated & IW_QUAL_NOISE_INVALID))
+	iw_qstat_hist_add(&qstat->noise, stats->qual.noise);
+    }
+  return(ticks);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Summarise the current window, and start a new one.
+ */
+void
+iw_qstat_window_end(iw_qstat *		qstat,
+		    iw_qstat_window *	window)
+{
+  struct timespec	now;
+  int			offset = qstat->dbm ? IW_QSTAT_DBM_MIN : 0;
+
+  memset(window, 0, sizeof(iw_qstat_window));
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  window->duration = (now.tv_sec - qstat->start.tv_sec)
+		     + (now.tv_nsec - qstat->start.tv_nsec) / 1e9;
+  window->samples = qstat->samples;
+  window->errors = qstat->errors;
+  window->missed = qstat->missed;
+  window->stale = qstat->stale;
+  window->dbm = qstat->dbm;
+  iw_qstat_hist_end(&qstat->qual, 0, &window->qual);
+  iw_qstat_hist_end(&qstat->level, offset, &window->level);
+  iw_qstat_hist_end(&qstat->noise, offset, &window->noise);
+
+  /* Unsigned differences, wrapping counters are fine */
+  if(qstat->has_base)
+    {
+      window->discard_nwid = qstat->last_discard.nwid
+			     - qstat->base_discard.nwid;
+      window->discard_code = qstat->last_discard.code
+			     - qstat->base_discard.code;
+      window->discard_fragment = qstat->last_discard.fragment
+				 - qstat->base_discard.fragment;
+      window->discard_retries = qstat->last_discard.retries
+				- qstat->base_discard.retries;
+      window->discard_misc = qstat->last_discard.misc
+			     - qstat->base_discard.misc;
+      window->miss_beacon = qstat->last_miss.beacon
+			    - qstat->base_miss.beacon;
+      qstat->base_discard = qstat->last_discard;
+      qstat->base_miss = qstat->last_miss;
+    }
+
+  qstat->start = now;
+  qstat->samples = 0;
+  qstat->errors = 0;
+  qstat->missed = 0;
+  qstat->stale = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Stop sampling.
+ */
+void
+iw_qstat_close(iw_qstat *	qstat)
+{
+  if(qstat->timer_fd >= 0)
+    close(qstat->timer_fd);
+  qstat->timer_fd = -1;
+}
@@ -0,0 +1,131 @@
+/*
+ *	Wireless Tools
+ *
+ * High rate sampling of the link quality...
+ *
+ * Read the statistics of one interface (SIOCGIWSTATS) at a fixed rate,
+ * paced by a timerfd, and summarise them per window instead of keeping
+ * every sample : exact histograms of quality, signal and noise (they
+ * are 8 bit values, 256 bins each) give min/max and percentiles, and
+ * the discarded packet counters are reported as deltas.
+ * The request is prepared once, each sample is one read() of the timer
+ * and one ioctl().
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWQSTAT_H
+#define IWQSTAT_H
+
+/***************************** INCLUDES *****************************/
+
+#include <stdint.h>
+
+#include "iwlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* One bin per 8 bit value */
+#define IW_QSTAT_BINS		256
+
+/* dBm values are binned with this offset, see iw_qual_dbm() */
+#define IW_QSTAT_DBM_MIN	-192
+
+/* Highest sampling rate, Hz */
+#define IW_QSTAT_MAX_RATE	10000
+
+/****************************** TYPES ******************************/
+
+/* Distribution of one value over a window */
+typedef struct iw_qstat_value
+{
+  uint32_t	count;		/* Samples with a valid value */
+  int		min;		/* Valid if count > 0 */
+  int		max;
+  int		p50;
+  int		p95;
+  int		p99;
+  double	mean;
+} iw_qstat_value;
+
+/* Summary of a window */
+typedef struct iw_qstat_window
+{
+  double	duration;	/* Seconds */
+  uint32_t	samples;	/* Statistics read */
+  uint32_t	errors;		/* Failed reads */
+  uint32_t	missed;		/* Timer ticks we were too late for */
+  uint32_t	stale;		/* Nothing updated since the last read */
+  int		dbm;		/* Signal and noise in dBm, not relative */
+  iw_qstat_value	qual;
+  iw_qstat_value	level;
+  iw_qstat_value	noise;
+  /* Counter deltas over the window */
+  uint32_t	discard_nwid;
+  uint32_t	discard_code;
+  uint32_t	discard_fragment;
+  uint32_t	discard_retries;
+  uint32_t	discard_misc;
+  uint32_t	miss_beacon;
+} iw_qstat_window;
+
+/* Histogram of one value */
+typedef struct iw_qstat_hist
+{
+  uint32_t	count;
+  uint64_t	sum;		/* Of the bins */
+  uint32_t	bins[IW_QSTAT_BINS];
+} iw_qstat_hist;
+
+/* The sampler. Treat as opaque. */
+typedef struct iw_qstat
+{
+  int			skfd;
+  int			timer_fd;
+  struct iwreq		wrq;		/* Prepared once, points to stats */
+  iwstats		stats;
+  iwrange		range;
+  int			has_range;
+  int			sees_updates;	/* Driver sets the updated flags */
+  /* Current window */
+  struct timespec	start;
+  uint32_t		samples;
+  uint32_t		errors;
+  uint32_t		missed;
+  uint32_t		stale;
+  int			dbm;
+  iw_qstat_hist		qual;
+  iw_qstat_hist		level;
+  iw_qstat_hist		noise;
+  /* Counters at the start of the window */
+  int			has_base;
+  struct iw_discarded	base_discard;
+  struct iw_missed	base_miss;
+  struct iw_discarded	last_discard;
+  struct iw_missed	last_miss;
+} iw_qstat;
+
+/**************************** PROTOTYPES ****************************/
+
+int
+	iw_qstat_open(iw_qstat *	qstat,
+		      int		skfd,
+		      const char *	ifname,
+		      int		rate);
+int
+	iw_qstat_sample(iw_qstat *	qstat);
+void
+	iw_qstat_window_end(iw_qstat *		qstat,
+			    iw_qstat_window *	window);
+void
+	iw_qstat_close(iw_qstat *	qstat);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* IWQSTAT_H */
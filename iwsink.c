@@ -0,0 +1,561 @@
+/*
+ *	Wireless Tools
+ *
+ * Output sinks for the scanning tools...
+ *
+ * The producer (the scanning loop) formats each scan in memory and hands
+ * the buffer over to the sink with iw_sink_submit(). This never blocks
+ * on the consumer : the record is queued and the sink thread does the
+ * actual delivery, batching as many queued records as allowed in a
+ * single write. When the queue is full, records are dropped according
+ * to the configured policy and accounted for.
+ *
+ * This file is released under the GPL license.
+ */
+
+/***************************** INCLUDES *****************************/
+
+#define _GNU_SOURCE		/* sendmmsg() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "iwsink.h"		/* Header */
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Don't build larger iovec arrays than the kernel accepts */
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
+/* Datagrams per sendmmsg() */
+#define IW_SINK_MMSG	64
+
+/************************* UNIX DATAGRAM SINK *************************/
+/*
+ * Each record is sent as its own datagram, preceded by the header, so
+ * that each datagram can be parsed on its own whatever the batching.
+ * A batch still goes out in a single sendmmsg(). The consumer may not
+ * be there yet, or may go away and come back, so we don't connect the
+ * socket and address each datagram.
+ */
+
+/*------------------------------------------------------------------*/
+/*
+ * Create the socket.
+ */
+static int
+iw_sink_unix_open(iw_sink *	sink,
+		  const char *	arg)
+{
+  if(strlen(arg) >= sizeof(((struct sockaddr_un *) NULL)->sun_path))
+    {
+      fprintf(stderr, "Socket path too long : %s\n", arg);
+      return(-1);
+    }
+
+  sink->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if(sink->fd < 0)
+    {
+      fprintf(stderr, "socket(AF_UNIX): %s\n", strerror(errno));
+      return(-1);
+    }
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Send a batch, one datagram per record.
+ * Return the number of records delivered.
+ */
+static int
+iw_sink_unix_write(iw_sink *		sink,
+		   struct iovec *		iov,
+		   int			iovcnt,
+		   size_t		len)
+{
+  struct sockaddr_un	addr;
+  struct mmsghdr	msgs[IW_SINK_MMSG];
+  struct iovec		parts[IW_SINK_MMSG][2];
+  int			sent = 0;
+  int			done = 0;
+  int			num;
+  int			ret;
+  int			i;
+
+  /* Avoid "Unused parameter" warning */
+  len = len;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, sink->path, sizeof(addr.sun_path) - 1);
+
+  while(done < iovcnt)
+    {
+      num = iovcnt - done;
+      if(num > IW_SINK_MMSG)
+	num = IW_SINK_MMSG;
+      memset(msgs, 0, num * sizeof(struct mmsghdr));
+      for(i = 0; i < num; i++)
+	{
+	  int	n = 0;
+
+	  if(sink->header_len > 0)
+	    {
+	      parts[i][n].iov_base = sink->header;
+	      parts[i][n++].iov_len = sink->header_len;
+	    }
+	  parts[i][n++] = iov[done + i];
+	  msgs[i].msg_hdr.msg_name = &addr;
+	  msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+	  msgs[i].msg_hdr.msg_iov = parts[i];
+	  msgs[i].msg_hdr.msg_iovlen = n;
+	}
+
+      ret = sendmmsg(sink->fd, msgs, num, 0);
+      if(ret < 0)
+	{
+	  /* Consumer not listening, no point trying the others */
+	  if(errno != EMSGSIZE)
+	    break;
+	  /* Too big for a datagram, that one is lost */
+	  ret = 1;
+	}
+      else
+	sent += ret;
+      done += ret;
+    }
+  return(sent);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Close the socket.
+ */
+static void
+iw_sink_unix_close(iw_sink *	sink)
+{
+  if(sink->fd >= 0)
+    close(sink->fd);
+  sink->fd = -1;
+}
+
+/************************* ROTATING FILE SINK *************************/
+/*
+ * Records are appended to the file. When the file grows above the
+ * size limit, or gets older than the age limit, it is renamed to
+ * file.1 (file.1 to file.2 and so on, up to the number of kept files)
+ * and a new file is started.
+ */
+
+/*------------------------------------------------------------------*/
+/*
+ * (Re)open the current file.
+ */
+static int
+iw_sink_file_reopen(iw_sink *	sink)
+{
+  struct stat	st;
+
+  sink->fd = open(sink->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+		  0644);
+  if(sink->fd < 0)
+    {
+      fprintf(stderr, "%s: %s\n", sink->path, strerror(errno));
+      return(-1);
+    }
+  sink->size = (fstat(sink->fd, &st) == 0) ? st.st_size : 0;
+  sink->opened = time(NULL);
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Shift the old files and start a new one.
+ */
+static int
+iw_sink_file_rotate(iw_sink *	sink)
+{
+  size_t	plen = strlen(sink->path) + 16;
+  char		from[plen];
+  char		to[plen];
+  int		i;
+
+  close(sink->fd);
+  sink->fd = -1;
+
+  if(sink->opts.rotate_keep > 0)
+    {
+      for(i = sink->opts.rotate_keep - 1; i > 0; i--)
+	{
+	  snprintf(from, plen, "%s.%d", sink->path, i);
+	  snprintf(to, plen, "%s.%d", sink->path, i + 1);
+	  rename(from, to);	/* Holes are fine */
+	}
+      snprintf(to, plen, "%s.1", sink->path);
+      rename(sink->path, to);
+    }
+  else
+    unlink(sink->path);
+
+  return(iw_sink_file_reopen(sink));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Open the file.
+ */
+static int
+iw_sink_file_open(iw_sink *	sink,
+		  const char *	arg)
+{
+  /* Avoid "Unused parameter" warning */
+  arg = arg;
+
+  return(iw_sink_file_reopen(sink));
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Append a batch in a single write, rotating first if needed.
+ * Return the number of records delivered.
+ */
+static int
+iw_sink_file_write(iw_sink *		sink,
+		   struct iovec *		iov,
+		   int			iovcnt,
+		   size_t		len)
+{
+  ssize_t	ret;
+
+  /* Never rotate an empty file, a single record may be above the limit */
+  if((sink->fd >= 0) && (sink->size > 0)
+     && (((sink->opts.rotate_size > 0)
+	  && (sink->size + (off_t) len > sink->opts.rotate_size))
+	 || ((sink->opts.rotate_age > 0)
+	     && (time(NULL) - sink->opened >= sink->opts.rotate_age))))
+    iw_sink_file_rotate(sink);
+
+  /* The file may have disappeared on a previous rotation */
+  if((sink->fd < 0) && (iw_sink_file_reopen(sink) < 0))
+    return(0);
+
+  /* New file, start with the header (column names and so on) */
+  if((sink->size == 0) && (sink->header_len > 0))
+    {
+      ret = write(sink->fd, sink->header, sink->header_len);
+      if(ret > 0)
+	sink->size += ret;
+    }
+
+  ret = writev(sink->fd, iov, iovcnt);
+  if(ret < 0)
+    return(0);
+  sink->size += ret;
+  /* Short write : disk full or similar, count the batch as lost */
+  if((size_t) ret < len)
+    return(0);
+  return(iovcnt);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Close the file.
+ */
+static void
+iw_sink_file_close(iw_sink *	sink)
+{
+  if(sink->fd >= 0)
+    close(sink->fd);
+  sink->fd = -1;
+}
+
+/**************************** VARIABLES ****************************/
+
+/* Known sink plugins */
+static const iw_sink_ops	iw_sink_plugins[] = {
+  { IW_SINK_UNIX_PREFIX, iw_sink_unix_open, iw_sink_unix_write,
+    iw_sink_unix_close },
+  { IW_SINK_FILE_PREFIX, iw_sink_file_open, iw_sink_file_write,
+    iw_sink_file_close },
+};
+#define IW_SINK_NUM_PLUGINS	(sizeof(iw_sink_plugins) / sizeof(iw_sink_ops))
+
+/*************************** SINK THREAD ***************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Wait for records, pull a batch out of the queue and deliver it.
+ * When asked to stop, drain what is left in the queue and exit.
+ */
+static void *
+iw_sink_thread(void *	arg)
+{
+  iw_sink *		sink = (iw_sink *) arg;
+  iw_sink_rec *		batch = sink->batch;
+  struct iovec *	iov = sink->iov;
+  int			n;
+  int			i;
+
+  pthread_mutex_lock(&sink->lock);
+  while(1)
+    {
+      size_t	len = 0;
+      int	done;
+
+      while((sink->count == 0) && (!sink->stop))
+	pthread_cond_wait(&sink->cond, &sink->lock);
+      if(sink->count == 0)
+	break;
+
+      /* Give the batch a chance to fill up */
+      if((sink->opts.linger > 0) && (sink->count < sink->opts.batch))
+	{
+	  struct timespec	deadline;
+
+	  clock_gettime(CLOCK_REALTIME, &deadline);
+	  deadline.tv_sec += sink->opts.linger / 1000;
+	  deadline.tv_nsec += (sink->opts.linger % 1000) * 1000000L;
+	  if(deadline.tv_nsec >= 1000000000L)
+	    {
+	      deadline.tv_sec++;
+	      deadline.tv_nsec -= 1000000000L;
+	    }
+	  while((sink->count < sink->opts.batch) && (!sink->stop))
+	    if(pthread_cond_timedwait(&sink->cond, &sink->lock,
+				      &deadline) == ETIMEDOUT)
+	      break;
+	}
+
+      /* Take ownership of the batch */
+      n = (sink->count < sink->opts.batch) ? sink->count : sink->opts.batch;
+      for(i = 0; i < n; i++)
+	{
+	  batch[i] = sink->ring[sink->head];
+	  sink->head = (sink->head + 1) % sink->opts.max_queue;
+	  iov[i].iov_base = batch[i].data;
+	  iov[i].iov_len = batch[i].len;
+	  len += batch[i].len;
+	}
+      sink->count -= n;
+
+      /* Deliver without holding the lock, the producer must not wait */
+      pthread_mutex_unlock(&sink->lock);
+      done = sink->ops->write(sink, iov, n, len);
+      for(i = 0; i < n; i++)
+	free(batch[i].data);
+      pthread_mutex_lock(&sink->lock);
+
+      sink->stats.writes++;
+      sink->stats.written += done;
+      sink->stats.errors += n - done;
+    }
+  pthread_mutex_unlock(&sink->lock);
+
+  return(NULL);
+}
+
+/************************** SINK INTERFACE **************************/
+
+/*------------------------------------------------------------------*/
+/*
+ * Fill in the default tunables.
+ */
+void
+iw_sink_default_opts(iw_sink_opts *	opts)
+{
+  memset(opts, 0, sizeof(iw_sink_opts));
+  opts->max_queue = IW_SINK_DEF_QUEUE;
+  opts->batch = IW_SINK_DEF_BATCH;
+  opts->linger = IW_SINK_DEF_LINGER;
+  opts->drop_policy = IW_SINK_DROP_NEWEST;
+  opts->rotate_keep = IW_SINK_DEF_KEEP;
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Open a sink from its specification ("unix:/path" or "file:/path")
+ * and start its thread.
+ * Return NULL on error.
+ */
+iw_sink *
+iw_sink_open(const char *		spec,
+	     const iw_sink_opts *	opts)
+{
+  const iw_sink_ops *	ops = NULL;
+  iw_sink *		sink;
+  const char *		arg;
+  unsigned int		i;
+
+  /* Find the plugin */
+  for(i = 0; i < IW_SINK_NUM_PLUGINS; i++)
+    if(!strncmp(spec, iw_sink_plugins[i].prefix,
+		strlen(iw_sink_plugins[i].prefix)))
+      {
+	ops = &iw_sink_plugins[i];
+	break;
+      }
+  if(ops == NULL)
+    {
+      fprintf(stderr, "Unknown output sink : %s\n", spec);
+      return(NULL);
+    }
+  arg = spec + strlen(ops->prefix);
+
+  sink = calloc(1, sizeof(iw_sink));
+  if(sink == NULL)
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      return(NULL);
+    }
+  sink->ops = ops;
+  sink->fd = -1;
+  if(opts != NULL)
+    sink->opts = *opts;
+  else
+    iw_sink_default_opts(&sink->opts);
+  /* Sanitise */
+  if(sink->opts.max_queue < 1)
+    sink->opts.max_queue = 1;
+  if(sink->opts.batch < 1)
+    sink->opts.batch = 1;
+  if(sink->opts.batch > IOV_MAX)
+    sink->opts.batch = IOV_MAX;
+
+  sink->path = strdup(arg);
+  /* The header belongs to the caller */
+  if(sink->opts.header_len > 0)
+    {
+      sink->header = malloc(sink->opts.header_len);
+      if(sink->header == NULL)
+	{
+	  fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+	  goto err_free;
+	}
+      memcpy(sink->header, sink->opts.header, sink->opts.header_len);
+      sink->header_len = sink->opts.header_len;
+    }
+  sink->ring = calloc(sink->opts.max_queue, sizeof(iw_sink_rec));
+  sink->batch = malloc(sink->opts.batch * sizeof(iw_sink_rec));
+  sink->iov = malloc(sink->opts.batch * sizeof(struct iovec));
+  if((sink->path == NULL) || (sink->ring == NULL)
+     || (sink->batch == NULL) || (sink->iov == NULL))
+    {
+      fprintf(stderr, "%s: Allocation failed\n", __FUNCTION__);
+      goto err_free;
+    }
+
+  if(ops->open(sink, arg) < 0)
+    goto err_free;
+
+  pthread_mutex_init(&sink->lock, NULL);
+  pthread_cond_init(&sink->cond, NULL);
+  if(pthread_create(&sink->thread, NULL, iw_sink_thread, sink) != 0)
+    {
+      fprintf(stderr, "Cannot start sink thread\n");
+      ops->close(sink);
+      pthread_cond_destroy(&sink->cond);
+      pthread_mutex_destroy(&sink->lock);
+      goto err_free;
+    }
+  return(sink);
+
+ err_free:
+  free(sink->iov);
+  free(sink->batch);
+  free(sink->ring);
+  free(sink->header);
+  free(sink->path);
+  free(sink);
+  return(NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Queue a record. The sink takes ownership of data, which must have
+ * been allocated with malloc(), even when the record is dropped.
+ * Never blocks on the consumer.
+ * Return 0 if queued, -1 if the record was dropped.
+ */
+int
+iw_sink_submit(iw_sink *	sink,
+	       char *		data,
+	       size_t		len)
+{
+  pthread_mutex_lock(&sink->lock);
+  sink->stats.submitted++;
+  if(sink->count == sink->opts.max_queue)
+    {
+      sink->stats.dropped++;
+      if(sink->opts.drop_policy != IW_SINK_DROP_OLDEST)
+	{
+	  pthread_mutex_unlock(&sink->lock);
+	  free(data);
+	  return(-1);
+	}
+      /* Make room by evicting the oldest record */
+      free(sink->ring[sink->head].data);
+      sink->head = (sink->head + 1) % sink->opts.max_queue;
+      sink->count--;
+    }
+  sink->ring[(sink->head + sink->count) % sink->opts.max_queue].data = data;
+  sink->ring[(sink->head + sink->count) % sink->opts.max_queue].len = len;
+  sink->count++;
+  pthread_cond_signal(&sink->cond);
+  pthread_mutex_unlock(&sink->lock);
+
+  return(0);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Get a snapshot of the sink counters.
+ */
+void
+iw_sink_get_stats(iw_sink *		sink,
+		  iw_sink_stats *	stats)
+{
+  pthread_mutex_lock(&sink->lock);
+  *stats = sink->stats;
+  pthread_mutex_unlock(&sink->lock);
+}
+
+/*------------------------------------------------------------------*/
+/*
+ * Deliver whatever is still queued, stop the thread and release
+ * everything. The final counters are returned in stats, if not NULL.
+ */
+void
+iw_sink_close(iw_sink *		sink,
+	      iw_sink_stats *	stats)
+{
+  if(sink == NULL)
+    return;
+
+  pthread_mutex_lock(&sink->lock);
+  sink->stop = 1;
+  pthread_cond_signal(&sink->cond);
+  pthread_mutex_unlock(&sink->lock);
+  pthread_join(sink->thread, NULL);
+
+  if(stats != NULL)
+    *stats = sink->stats;
+  sink->ops->close(sink);
+  pthread_cond_destroy(&sink->cond);
+  pthread_mutex_destroy(&sink->lock);
+  free(sink->iov);
+  free(sink->batch);
+  free(sink->ring);
+  free(sink->header);
+  free(sink->path);
+  free(sink);
+}
@@ -0,0 +1,145 @@
+/*
+ *	Wireless Tools
+ *
+ * Output sinks for the scanning tools...
+ *
+ * A sink receives one formatted record per scan and delivers it from
+ * its own thread, so that a slow consumer never delays the next scan.
+ * Records are held in a bounded queue, and several of them may be
+ * delivered in a single write (a single sendmmsg() for datagrams, which
+ * still carry one record each).
+ *
+ * This file is released under the GPL license.
+ */
+
+#ifndef IWSINK_H
+#define IWSINK_H
+
+/***************************** INCLUDES *****************************/
+
+#include <sys/types.h>
+#include <sys/uio.h>		/* struct iovec */
+#include <pthread.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/************************ CONSTANTS & MACROS ************************/
+
+/* Sink specification prefixes (see iw_sink_open()) */
+#define IW_SINK_UNIX_PREFIX	"unix:"		/* Unix datagram socket */
+#define IW_SINK_FILE_PREFIX	"file:"		/* Append-only file */
+
+/* What to do when the queue is full */
+#define IW_SINK_DROP_NEWEST	0	/* Refuse the incomming record */
+#define IW_SINK_DROP_OLDEST	1	/* Evict the oldest queued record */
+
+/* Defaults */
+#define IW_SINK_DEF_QUEUE	64	/* Records */
+#define IW_SINK_DEF_BATCH	8	/* Records per write */
+#define IW_SINK_DEF_LINGER	0	/* ms to wait for a batch to fill */
+#define IW_SINK_DEF_KEEP	4	/* Rotated files kept */
+
+/****************************** TYPES ******************************/
+
+/* Tunables, passed to iw_sink_open() */
+typedef struct iw_sink_opts
+{
+  int		max_queue;	/* Max number of queued records */
+  int		batch;		/* Max number of records per write */
+  int		linger;		/* ms to wait for a batch to fill up */
+  int		drop_policy;	/* IW_SINK_DROP_XXX */
+  off_t		rotate_size;	/* Rotate file above this size (0 = never) */
+  time_t	rotate_age;	/* Rotate file older than this, in s (0 = never) */
+  int		rotate_keep;	/* Number of rotated files kept */
+  const char *	header;		/* Written at the start of each file */
+  size_t	header_len;
+} iw_sink_opts;
+
+/* Counters, see iw_sink_get_stats() */
+typedef struct iw_sink_stats
+{
+  unsigned long	submitted;	/* Records handed to the sink */
+  unsigned long	dropped;	/* Records dropped by the queue policy */
+  unsigned long	written;	/* Records delivered */
+  unsigned long	writes;		/* Number of writes performed */
+  unsigned long	errors;		/* Records lost on write errors */
+} iw_sink_stats;
+
+struct iw_sink;
+
+/* A sink plugin. Open/close are called from the caller's thread,
+ * write only from the sink thread */
+typedef struct iw_sink_ops
+{
+  const char *	prefix;		/* Specification prefix */
+  int		(*open)(struct iw_sink *	sink,
+			const char *		arg);
+  int		(*write)(struct iw_sink *	sink,
+			 struct iovec *		iov,
+			 int			iovcnt,
+			 size_t			len);
+  void		(*close)(struct iw_sink *	sink);
+} iw_sink_ops;
+
+/* One queued record */
+typedef struct iw_sink_rec
+{
+  char *	data;
+  size_t	len;
+} iw_sink_rec;
+
+/* A running sink. Treat as opaque. */
+typedef struct iw_sink
+{
+  const iw_sink_ops *	ops;
+  iw_sink_opts		opts;
+
+  /* Queue, protected by lock */
+  pthread_mutex_t	lock;
+  pthread_cond_t	cond;
+  pthread_t		thread;
+  iw_sink_rec *		ring;		/* max_queue entries */
+  int			head;		/* Oldest record */
+  int			count;		/* Number of queued records */
+  int			stop;		/* Drain and exit */
+  iw_sink_stats		stats;
+
+  /* Owned by the sink thread */
+  iw_sink_rec *		batch;		/* batch entries */
+  struct iovec *	iov;		/* batch entries */
+
+  /* Plugin state, only touched by the sink thread once running */
+  int			fd;
+  char *		path;
+  char *		header;		/* Copy of opts.header */
+  size_t		header_len;
+  off_t			size;		/* Current file size */
+  time_t		opened;		/* When the file was (re)opened */
+} iw_sink;
+
+/**************************** PROTOTYPES ****************************/
+
+void
+	iw_sink_default_opts(iw_sink_opts *	opts);
+iw_sink *
+	iw_sink_open(const char *		spec,
+		     const iw_sink_opts *	opts);
+int
+	iw_sink_submit(iw_sink *	sink,
+		       char *		data,
+		       size_t		len);
+void
+	iw_sink_get_stats(iw_sink *		sink,
+			  iw_sink_stats *	stats);
+void
+	iw_sink_close(iw_sink *		sink,
+		      iw_sink_stats *	stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* IWSINK_H */